@@ -0,0 +1,260 @@
+/**
+ * benchmark for Gzip, Gunzip, Bzip and Bunzip over a built-in synthetic corpus
+ *
+ *   node bench.js [--quick | --full] [--size bytes] [--repeat n] [--out file] [--filter text]
+ *
+ * every configuration prints one JSON object per line (also written to --out
+ * as an array), so runs before and after a change can be diffed by a script:
+ *   {codec, corpus, level, workfactor, small, chunk, io, bytes, calls,
+ *    mbps, ratio, latency: {p50, p90, p99, max} (microseconds),
+ *    outputs, reallocs, nativeTime, nativeMemory, heapDelta, peakRss}
+ * mbps is uncompressed megabytes (2^20) per second in both directions,
+ * outputs counts the Buffers/strings handed back, reallocs the native output
+ * block allocations, nativeTime (ms) and nativeMemory (peak bytes) come from
+ * the object's getStats(), heapDelta and peakRss from process.memoryUsage().
+ */
+var gzbz2 = require('./gzbz2'),
+    fs = require('fs');
+
+var args = process.argv.slice(2), opts = {size: 4*1048576, repeat: 3, out: null, full: false, filter: null};
+for (var i = 0; i < args.length; i++) {
+    switch (args[i]) {
+    case '--quick':  opts.size = 1048576; opts.repeat = 1; break;
+    case '--full':   opts.full = true; break;
+    case '--size':   opts.size = parseInt(args[++i], 10); break;
+    case '--repeat': opts.repeat = parseInt(args[++i], 10); break;
+    case '--out':    opts.out = args[++i]; break;
+    case '--filter': opts.filter = args[++i]; break;
+    default:
+        console.error('unknown argument: ' + args[i]);
+        process.exit(2);
+    }
+}
+
+/**
+ * the same pseudo random sequence on every run
+ */
+var Random = function(seed) {
+    this.s = seed;
+};
+Random.prototype.next = function() {
+    this.s = (this.s * 1103515245 + 12345) & 0x7fffffff;
+    return this.s;
+};
+Random.prototype.pick = function(list) {
+    return list[this.next() % list.length];
+};
+
+var WORDS = ['the', 'of', 'and', 'compression', 'stream', 'buffer', 'node', 'block', 'window',
+             'huffman', 'data', 'a', 'to', 'in', 'is', 'that', 'for', 'with', 'as', 'on',
+             'zlib', 'bzip2', 'deflate', 'inflate', 'level', 'output', 'input', 'chunk'];
+var PATHS = ['/', '/index.html', '/api/v1/orders', '/api/v1/users/42', '/static/app.js', '/health'];
+
+var fill = function(size, gen) {
+    var parts = [], len = 0;
+    while (len < size) {
+        var s = gen();
+        parts.push(s);
+        len += s.length;
+    }
+    return new Buffer(parts.join('').substr(0, size), 'binary');
+};
+
+var corpus = function(size) {
+    var r = new Random(42), c = {};
+    c.text = fill(size, function() {
+        var n = 5 + r.next() % 15, w = [];
+        for (var i = 0; i < n; i++) {
+            w.push(r.pick(WORDS));
+        }
+        return w.join(' ') + '.\n';
+    });
+    c.json = fill(size, function() {
+        return JSON.stringify({id: r.next() % 100000, user: 'user' + r.next() % 500,
+                               path: r.pick(PATHS), status: r.pick([200, 200, 200, 304, 404, 500]),
+                               tags: [r.pick(WORDS), r.pick(WORDS)], ok: r.next() % 2 == 0}) + '\n';
+    });
+    c.logs = fill(size, function() {
+        var t = 1300000000 + r.next() % 86400;
+        return '10.0.' + r.next() % 256 + '.' + r.next() % 256 + ' - - [' + t + '] "GET ' +
+               r.pick(PATHS) + ' HTTP/1.1" ' + r.pick([200, 200, 301, 404]) + ' ' +
+               r.next() % 50000 + ' "-" "' + r.pick(['curl/7.21', 'Mozilla/5.0', 'node']) + '"\n';
+    });
+    var rnd = new Buffer(size);
+    for (var i = 0; i < size; i++) {
+        rnd[i] = r.next() >> 7 & 0xff;
+    }
+    c.random = rnd;
+    return c;
+};
+
+var now = process.hrtime ? function() {
+    var t = process.hrtime();
+    return t[0] * 1e6 + t[1] / 1e3;
+} : function() {
+    return Date.now() * 1e3;
+};
+
+var percentile = function(sorted, p) {
+    if (sorted.length == 0) {
+        return 0;
+    }
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+};
+
+var CODECS = {
+    gzip:   {ctor: 'Gzip',   op: 'deflate', compress: true},
+    gunzip: {ctor: 'Gunzip', op: 'inflate', compress: false},
+    bzip:   {ctor: 'Bzip',   op: 'deflate', compress: true},
+    bunzip: {ctor: 'Bunzip', op: 'inflate', compress: false}
+};
+
+/**
+ * one pass of data through a fresh object, chunk bytes per call
+ */
+var pass = function(cfg, data) {
+    var c = CODECS[cfg.codec], z = new gzbz2[c.ctor](), init = {};
+    if (cfg.level != null) init.level = cfg.level;
+    if (cfg.workfactor != null) init.workfactor = cfg.workfactor;
+    if (cfg.small != null) init.small = cfg.small;
+    if (cfg.io == 'string') init.encoding = 'binary';
+    z.init(init);
+
+    var input = cfg.io == 'string' ? data.toString('binary') : data;
+    var lat = [], outputs = 0, outBytes = 0, peak = 0;
+    var heap0 = process.memoryUsage().heapUsed, t0 = now();
+    for (var pos = 0; pos < data.length; pos += cfg.chunk) {
+        var piece = input.slice(pos, Math.min(pos + cfg.chunk, data.length)), s = now();
+        var out = cfg.io == 'string' ? z[c.op](piece, 'binary') : z[c.op](piece);
+        lat.push(now() - s);
+        outputs++;
+        outBytes += out.length;
+        if (lat.length % 64 == 0) {
+            peak = Math.max(peak, process.memoryUsage().rss);
+        }
+    }
+    var last = z.end();
+    if (last != null) {
+        outputs++;
+        outBytes += last.length;
+    }
+    var elapsed = now() - t0, mem = process.memoryUsage(), stats = z.getStats();
+    return {elapsed: elapsed, lat: lat, outputs: outputs, outBytes: outBytes, stats: stats,
+            heapDelta: mem.heapUsed - heap0, peakRss: Math.max(peak, mem.rss)};
+};
+
+var compressed = {};
+var compressedFor = function(codec, name, data) {
+    var key = codec + '/' + name;
+    if (!compressed[key]) {
+        var z = codec == 'gunzip' ? new gzbz2.Gzip() : new gzbz2.Bzip();
+        z.init({level: codec == 'gunzip' ? 6 : 9});
+        var a = z.deflate(data), b = z.end(), all = new Buffer(a.length + b.length);
+        a.copy(all, 0, 0, a.length);
+        b.copy(all, a.length, 0, b.length);
+        compressed[key] = all;
+    }
+    return compressed[key];
+};
+
+var run = function(cfg, corpora) {
+    var raw = corpora[cfg.corpus];
+    var data = CODECS[cfg.codec].compress ? raw : compressedFor(cfg.codec, cfg.corpus, raw);
+    var best = null;
+    for (var r = 0; r < opts.repeat; r++) {
+        var res = pass(cfg, data);
+        if (!best || res.elapsed < best.elapsed) {
+            best = res;
+        }
+    }
+    var lat = best.lat.sort(function(a, b) { return a - b; });
+    var result = {};
+    for (var k in cfg) {
+        result[k] = cfg[k];
+    }
+    result.bytes = raw.length;
+    result.calls = lat.length;
+    result.mbps = Math.round(raw.length / 1048576 / (best.elapsed / 1e6) * 100) / 100;
+    result.ratio = Math.round((CODECS[cfg.codec].compress ? best.outBytes / raw.length
+                                                          : data.length / raw.length) * 10000) / 10000;
+    result.latency = {p50: Math.round(percentile(lat, 0.5)), p90: Math.round(percentile(lat, 0.9)),
+                      p99: Math.round(percentile(lat, 0.99)), max: Math.round(lat[lat.length - 1] || 0)};
+    result.outputs = best.outputs;
+    result.reallocs = best.stats.reallocs;
+    result.nativeTime = Math.round(best.stats.time * 100) / 100;
+    result.nativeMemory = best.stats.peakMemory;
+    result.heapDelta = best.heapDelta;
+    result.peakRss = best.peakRss;
+    return result;
+};
+
+/**
+ * the sweep, --full crosses every parameter, otherwise each parameter is
+ * varied on its own around a default configuration
+ */
+var configs = function() {
+    var list = [], corpora = ['text', 'json', 'logs', 'random'];
+    var chunks = [4096, 65536, 1048576], ios = ['buffer', 'string'];
+    var sweep = {
+        gzip:   {level: [1, 6, 9]},
+        gunzip: {},
+        bzip:   {level: [1, 9], workfactor: [0, 30, 250]},
+        bunzip: {small: [false, true]}
+    };
+    var defaults = {gzip: {level: 6}, gunzip: {}, bzip: {level: 9, workfactor: 30}, bunzip: {small: false}};
+    for (var codec in sweep) {
+        var axes = {chunk: chunks, io: ios, corpus: corpora};
+        for (var a in sweep[codec]) {
+            axes[a] = sweep[codec][a];
+        }
+        var base = {codec: codec, corpus: 'text', chunk: 65536, io: 'buffer'};
+        for (var d in defaults[codec]) {
+            base[d] = defaults[codec][d];
+        }
+        if (opts.full) {
+            var combos = [base];
+            for (var axis in axes) {
+                var next = [];
+                for (var i = 0; i < combos.length; i++) {
+                    for (var j = 0; j < axes[axis].length; j++) {
+                        var c = {};
+                        for (var k in combos[i]) c[k] = combos[i][k];
+                        c[axis] = axes[axis][j];
+                        next.push(c);
+                    }
+                }
+                combos = next;
+            }
+            list = list.concat(combos);
+        } else {
+            var seen = {};
+            for (var axis in axes) {
+                for (var j = 0; j < axes[axis].length; j++) {
+                    var c = {};
+                    for (var k in base) c[k] = base[k];
+                    c[axis] = axes[axis][j];
+                    var key = JSON.stringify(c);
+                    if (!seen[key]) {
+                        seen[key] = true;
+                        list.push(c);
+                    }
+                }
+            }
+        }
+    }
+    return list;
+};
+
+var corpora = corpus(opts.size), results = [], list = configs();
+for (var i = 0; i < list.length; i++) {
+    var cfg = list[i];
+    if (opts.filter && JSON.stringify(cfg).indexOf(opts.filter) < 0) {
+        continue;
+    }
+    var res = run(cfg, corpora);
+    results.push(res);
+    console.log(JSON.stringify(res));
+}
+if (opts.out) {
+    fs.writeFileSync(opts.out, JSON.stringify(results, null, 1));
+}
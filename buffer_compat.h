@@ -5,6 +5,8 @@
 #include <node_buffer.h>
 #include <node_version.h>
 #include <v8.h>
+#include <stdlib.h>
+#include <string.h>
 
 #if NODE_MINOR_VERSION < 3
 
@@ -24,6 +26,15 @@ size_t BufferLength(v8::Local<v8::Object> buf_obj) {
     node::Buffer *buf = node::ObjectWrap::Unwrap<node::Buffer>(buf_obj);
     return buf->length();
 }
+// no external buffers before 0.3, copy into a new buffer
+node::Buffer *BufferAdopt(char *data, size_t length) {
+    node::Buffer *b = node::Buffer::New(length);
+    if (length != 0) {
+        memcpy(b->data(), data, length);
+    }
+    free(data);
+    return b;
+}
 
 #else // NODE_VERSION
 
@@ -41,6 +52,13 @@ size_t BufferLength(v8::Local<v8::Object> buf_obj) {
     v8::HandleScope scope;
     return node::Buffer::Length(buf_obj);
 }
+void BufferAdoptFree(char *data, void *hint) {
+    free(data);
+}
+// the malloc'd block becomes the buffer's backing store, freed when the buffer is collected
+node::Buffer *BufferAdopt(char *data, size_t length) {
+    return node::Buffer::New(data, length, BufferAdoptFree, NULL);
+}
 
 #endif // NODE_VERSION
 
@@ -1,61 +1,30 @@
 var fs = require('fs'),
     sys = require('sys'),
-    gzbz2 = require('gzbz2'),
-    stream = require('stream');
+    CodecStream = require('./codecstream').CodecStream;
 
 /**
- * wrap an readable stream (for binary data) with bunzip
+ * wrap an readable stream (for binary data) with bunzip, the input is piped
+ * in so a slow consumer (pause, or write() returning false further down a
+ * pipe) holds the readable stream back instead of buffering, and inflation
+ * runs on the thread pool while the next input is read
+ *
+ * @param options   bunzip init options and CodecStream options (highWaterMark, pieceSize)
  */
-var BunzipStream = function(readStream, enc) {
-    stream.Stream.call(this);
+var BunzipStream = function(readStream, options) {
+    if (typeof options == 'string' || options == null) {
+        options = {encoding: options};
+    }
+    CodecStream.call(this, 'bunzip', options);
     var self = this;
 
     self.stream = readStream;
-    self.bz = new gzbz2.Bunzip();
-    self.bz.init({encoding: enc});
-
-    self.ondata = function(data) {
-        try {
-            var inflated = self.bz.inflate(data);
-        } catch (err) {
-            return self.onerror(err);
-        }
-        self.emit('data', inflated);
-    };
-    self.onclose = function() {
-        self.bz.end();
-        self.emit('close');
-        self._cleanup();
-    };
-    self.onend = function() {
-        self.bz.end();
-        self.emit('end');
-        self._cleanup();
-    };
     self.onerror = function(err) {
-        self.bz.end();
-        self.emit('error', err);
-        self._cleanup();
-    };
-    self.pause = function() {
-        self.stream.pause();
-    };
-    self.resume = function() {
-        self.stream.resume();
+        self._error(err);
     };
-    self._cleanup = function() {
-        self.stream.removeListener('data', self.ondata);
-        self.stream.removeListener('close', self.onclose);
-        self.stream.removeListener('end', self.onend);
-        self.stream.removeListener('error', self.onerror);
-    };
-
-    self.stream.addListener('data', self.ondata);
-    self.stream.addListener('end', self.onend);
-    self.stream.addListener('close', self.onclose);
     self.stream.addListener('error', self.onerror);
+    self.stream.pipe(self);
 };
-sys.inherits(BunzipStream, stream.Stream);
+sys.inherits(BunzipStream, CodecStream);
 exports.BunzipStream = BunzipStream;
 
 /**
@@ -68,13 +37,13 @@ exports.BunzipStream = BunzipStream;
  * @param path      string pathname, if null/undefined: use stdin
  * ---------------------------------------------------------------
  * @param path      string pathname, if null/undefined && options.fd == null/undefined, use stdin
- * @param options   as would be given to fs.createReadStream()
+ * @param options   as would be given to fs.createReadStream(), plus the bunzip stream options
  *
  * @return  a BunzipStream object, the underlying ReadStream is available as attribute named 'stream'
  */
 exports.wrap = function() {
     // [stream] | [path, [options,]]
-    var stream = arguments[0], options = arguments[1];
+    var stream = arguments[0], options = arguments[1] || {};
     var enc = options.encoding;
     if( stream == null ) {
         if( options.fd == null ) {
@@ -87,5 +56,6 @@ exports.wrap = function() {
         }
         stream = fs.createReadStream(stream, options);
     } // else stream is all set, options (if provided) are ignored
-    return new BunzipStream(stream, enc);
+    return new BunzipStream(stream, {encoding: enc, highWaterMark: options.highWaterMark,
+                                lowWaterMark: options.lowWaterMark, pieceSize: options.pieceSize});
 };
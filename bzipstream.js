@@ -0,0 +1,42 @@
+var fs = require('fs'),
+    sys = require('sys'),
+    CodecStream = require('./codecstream').CodecStream;
+
+/**
+ * a writable bzip stream: write or pipe data in, compressed data comes out
+ * as 'data' events (or pipe it on). compression runs on the thread pool and
+ * write() returns false while the stream is backed up, see CodecStream.
+ *
+ * @param options   bzip init options (level, workfactor, threads) and CodecStream
+ *                  options (highWaterMark, lowWaterMark, pieceSize)
+ */
+var BzipStream = function(options) {
+    CodecStream.call(this, 'bzip', options);
+};
+sys.inherits(BzipStream, CodecStream);
+exports.BzipStream = BzipStream;
+
+/**
+ * bzip into a writable stream or a file:
+ *
+ * ---------------------------------------------------------------
+ * @param stream    WriteStream, if null/undefined, use stdout
+ * ---------------------------------------------------------------
+ * @param path      string pathname
+ * @param options   bzip stream options, plus the options of fs.createWriteStream()
+ *
+ * @return  a BzipStream object to write to, the underlying WriteStream is available as attribute named 'stream'
+ */
+exports.wrap = function() {
+    // [stream] | [path, [options,]]
+    var stream = arguments[0], options = arguments[1] || {};
+    if( stream == null ) {
+        stream = process.stdout;
+    } else if( typeof stream == 'string' ) {
+        stream = fs.createWriteStream(stream, {flags: options.flags, mode: options.mode});
+    }
+    var out = new BzipStream(options);
+    out.stream = stream;
+    out.pipe(stream);
+    return out;
+};
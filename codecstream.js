@@ -0,0 +1,311 @@
+var sys = require('sys'),
+    gzbz2 = require('gzbz2'),
+    stream = require('stream');
+
+var CODECS = {
+    gzip:   {ctor: 'Gzip',   op: 'deflateAsync', flush: true},
+    gunzip: {ctor: 'Gunzip', op: 'inflateAsync', flush: false},
+    bzip:   {ctor: 'Bzip',   op: 'deflateAsync', flush: true},
+    bunzip: {ctor: 'Bunzip', op: 'inflateAsync', flush: false}
+};
+
+/**
+ * a readable and writable stream around one of the codecs. every write is
+ * (de)compressed on the thread pool, so reading the next input overlaps the
+ * work on the last one. output is emitted in pieces of at most pieceSize and
+ * is held while the stream is paused.
+ *
+ * write() returns false once more than highWaterMark bytes are in the codec
+ * or held, a source should then wait for 'drain' (pipe() does), which comes
+ * when that is back down to lowWaterMark. memory stays bounded by the marks
+ * and the source's chunk size, whatever the size of the whole input.
+ *
+ * gunzip and bunzip run in pull mode (maxOutput, default pieceSize): one call
+ * is in the codec at a time and gives at most maxOutput bytes, the codec is
+ * drained before the next write goes in and not while paused. so a small
+ * write of highly compressible input can not inflate into one huge Buffer.
+ * bunzip with threads > 1 and gunzip with index or checkpoint can not pull
+ * and take each write whole.
+ *
+ * @param codec     'gzip', 'gunzip', 'bzip' or 'bunzip'
+ * @param options   init options for the codec, plus
+ *                  highWaterMark: int [256K]
+ *                  lowWaterMark:  int [highWaterMark/4]
+ *                  pieceSize:     int [64K]
+ *                  maxOutput:     int [pieceSize], gunzip and bunzip: the
+ *                                 most one call inflates
+ *                  flushInterval: int [0], gzip and bzip: flush once no write
+ *                                 came for this many ms (flushBytes, the init
+ *                                 option, flushes by volume)
+ */
+var CodecStream = function(codec, options) {
+    stream.Stream.call(this);
+    var c = CODECS[codec];
+    if (!c) {
+        throw new Error('unknown codec: ' + codec);
+    }
+    options = options || {};
+    this.pieceSize = options.pieceSize || 65536;
+
+    // pull mode needs maxOutput, which these options rule out
+    this.pull = !c.flush && !(options.threads > 1) && !options.index && !options.checkpoint;
+    var init = options;
+    if (this.pull && !options.maxOutput) {
+        init = {};
+        for (var k in options) {
+            init[k] = options[k];
+        }
+        init.maxOutput = this.pieceSize;
+    }
+    this.codec = new gzbz2[c.ctor]();
+    this.codec.init(init);
+    this.op = c.op;
+    this.canFlush = c.flush;
+    this.readable = true;
+    this.writable = true;
+    this.highWaterMark = options.highWaterMark || 262144;
+    this.lowWaterMark = options.lowWaterMark != null ? options.lowWaterMark : this.highWaterMark >> 2;
+    this.flushInterval = c.flush ? options.flushInterval || 0 : 0;
+
+    this.paused = false;
+    this.inflight = 0;      // input bytes given to the codec and not back yet
+    this.held = [];         // output pieces not emitted yet
+    this.heldBytes = 0;
+    this.needDrain = false;
+    this.ended = false;     // the codec has ended, 'end' follows the held output
+    this.unflushed = 0;     // bytes written since the last flush
+    this.timer = null;
+    this.done = false;      // 'end' emitted, or destroyed
+    this.queue = [];        // pull mode: writes waiting for the codec to drain
+    this.busy = false;      // pull mode: a call is in the codec
+    this.ending = false;    // pull mode: end once the queue is through
+};
+sys.inherits(CodecStream, stream.Stream);
+
+CodecStream.prototype.write = function(data, encoding) {
+    if (!this.writable) {
+        this.emit('error', new Error('write after end'));
+        return false;
+    }
+    if (typeof data == 'string') {
+        data = new Buffer(data, encoding || 'utf8');
+    }
+    var self = this, len = data.length;
+    this.inflight += len;
+    this.unflushed += len;
+    if (this.flushInterval > 0) {
+        // idle from now on, unless another write comes first
+        clearTimeout(this.timer);
+        this.timer = setTimeout(function() {
+            self.timer = null;
+            if (self.unflushed > 0 && self.writable) {
+                self.flush();
+            }
+        }, this.flushInterval);
+    }
+    if (this.pull) {
+        this.queue.push(data);
+        this._pump();
+    } else {
+        this.codec[this.op](data, function(err, out) {
+            self.inflight -= len;
+            if (err) {
+                return self._error(err);
+            }
+            self._push(out);
+        });
+    }
+    if (this.inflight + this.heldBytes >= this.highWaterMark) {
+        this.needDrain = true;
+        return false;
+    }
+    return true;
+};
+
+CodecStream.prototype.end = function(data, encoding) {
+    if (data) {
+        this.write(data, encoding);
+    }
+    if (!this.writable) {
+        return;
+    }
+    this.writable = false;
+    this._clearTimer();
+    if (this.pull) {
+        // ends once the queued writes are inflated and drained
+        this.ending = true;
+        this._pump();
+        return;
+    }
+    this._endCodec();
+};
+
+CodecStream.prototype._endCodec = function() {
+    var self = this;
+    // queued behind the writes, so it completes after all of them
+    this.codec.endAsync(function(err, out) {
+        if (err) {
+            return self._error(err);
+        }
+        self.ended = true;
+        self._push(out);
+    });
+};
+
+/**
+ * gzip and bzip: push out everything written so far without ending the
+ * stream, it arrives as 'data' like any other output
+ *
+ * @param mode      gzip only, 'sync' (default) or 'full' (also resets the history)
+ * @param callback  optional, called once the flushed output was pushed
+ */
+CodecStream.prototype.flush = function(mode, callback) {
+    if (typeof mode == 'function') {
+        callback = mode;
+        mode = undefined;
+    }
+    if (!this.canFlush) {
+        throw new Error('flush: only compressing streams can flush');
+    }
+    if (!this.writable) {
+        return;
+    }
+    var self = this;
+    this.unflushed = 0;
+    this._clearTimer();
+    this.codec.flushAsync(mode, function(err, out) {
+        if (err) {
+            return self._error(err);
+        }
+        self._push(out);
+        if (callback) {
+            callback();
+        }
+    });
+};
+
+CodecStream.prototype.pause = function() {
+    this.paused = true;
+};
+
+CodecStream.prototype.resume = function() {
+    this.paused = false;
+    this._flush();
+    this._pump();
+};
+
+/**
+ * stop now, held output is dropped and no more events are emitted
+ */
+CodecStream.prototype.destroy = function() {
+    if (this.done) {
+        return;
+    }
+    this.done = true;
+    this.readable = false;
+    this.held = [];
+    this.heldBytes = 0;
+    this.queue = [];
+    this._clearTimer();
+    if (this.writable || this.ending) {
+        this.writable = false;
+        this.ending = false;
+        // hands the context back once the queued calls are through
+        this.codec.endAsync(function() { });
+    }
+    this.emit('close');
+};
+
+CodecStream.prototype._push = function(out) {
+    if (this.done) {
+        return;
+    }
+    if (out && out.length > 0) {
+        for (var pos = 0; pos < out.length; pos += this.pieceSize) {
+            this.held.push(out.slice(pos, Math.min(pos + this.pieceSize, out.length)));
+        }
+        this.heldBytes += out.length;
+    }
+    this._flush();
+};
+
+/**
+ * pull mode: give the codec its next call, draining the output it still has
+ * before the next write goes in, and ending once both are through
+ */
+CodecStream.prototype._pump = function() {
+    if (this.busy || this.done || this.paused) {
+        return;
+    }
+    var self = this, data, len = 0;
+    if (this.codec.pending().more) {
+        data = new Buffer(0);
+    } else if (this.queue.length > 0) {
+        data = this.queue.shift();
+        len = data.length;
+    } else {
+        if (this.ending) {
+            this.ending = false;
+            this._endCodec();
+        }
+        return;
+    }
+    this.busy = true;
+    this.codec[this.op](data, function(err, out) {
+        self.busy = false;
+        self.inflight -= len;
+        if (err) {
+            return self._error(err);
+        }
+        self._push(out);
+        self._pump();
+    });
+};
+
+CodecStream.prototype._flush = function() {
+    while (!this.paused && !this.done && this.held.length > 0) {
+        var piece = this.held.shift();
+        this.heldBytes -= piece.length;
+        this.emit('data', piece);
+    }
+    if (this.done || this.paused) {
+        return;
+    }
+    if (this.ended) {
+        this.done = true;
+        this.readable = false;
+        this.emit('end');
+        this.emit('close');
+    } else if (this.needDrain && this.inflight + this.heldBytes <= this.lowWaterMark) {
+        this.needDrain = false;
+        this.emit('drain');
+    }
+};
+
+CodecStream.prototype._clearTimer = function() {
+    if (this.timer) {
+        clearTimeout(this.timer);
+        this.timer = null;
+    }
+};
+
+CodecStream.prototype._error = function(err) {
+    if (this.done) {
+        return;
+    }
+    this._clearTimer();
+    this.done = true;
+    this.readable = false;
+    this.held = [];
+    this.heldBytes = 0;
+    this.queue = [];
+    if (this.writable || this.ending) {
+        this.writable = false;
+        this.ending = false;
+        // the native context goes back now, not once the codec is collected
+        this.codec.endAsync(function() { });
+    }
+    this.emit('error', err);
+};
+
+exports.CodecStream = CodecStream;
@@ -5,12 +5,35 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <node_buffer.h>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <math.h>
 #include "buffer_compat.h"
 
 #ifdef  WITH_GZIP
 #include <zlib.h>
+// carry-less multiply crc32 needs per function target attributes
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_CRC32_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 #endif//WITH_GZIP
 
 #ifdef  WITH_BZIP
@@ -46,8 +69,4955 @@ public:
    char * buffer;
 };
 
+/* turn a realloc'd output block into the js result (buffer or encoded string),
+ * takes ownership of out. buffers take over the block itself, strings copy it.
+ */
+static Local<Value> MakeOutput(char* out, int out_size, bool use_buffers, enum encoding enc) {
+  HandleScope scope;
+  if (use_buffers) {
+    // output data in a buffer, the realloc'd block is handed over without a copy
+    if (out_size == 0) {
+      free(out);
+      return scope.Close(Local<Value>::New(Buffer::New(0)->handle_));
+    }
+    // give back the unused tail of the last CHUNK, shrinking is done in place
+    char* temp = (char *)realloc(out, out_size);
+    if (temp != NULL) {
+      out = temp;
+    }
+    Buffer* b = BufferAdopt(out, out_size);
+    return scope.Close(Local<Value>::New(b->handle_));
+  } else if (out_size == 0) {
+    free(out);
+    return scope.Close(String::Empty());
+  } else {
+    // output data in an encoded string
+    Local<Value> outString = Encode(out, out_size, enc);
+    free(out);
+    return scope.Close(outString);
+  }
+}
+
+/* the getStats() counters are bumped from the event loop and the worker
+ * threads alike. relaxed atomic adds are enough (nothing is ordered against
+ * them) and cheap enough to leave on, older gccs only have the full barrier ones.
+ */
+#ifdef  __ATOMIC_RELAXED
+#define STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(field, n) __sync_fetch_and_add(&(field), (n))
+#define STAT_GET(field) __sync_fetch_and_add(&(field), 0)
+#endif
+
+enum StatCodec { STATS_GZIP, STATS_GUNZIP, STATS_BZIP, STATS_BUNZIP, STATS_CODECS };
+
+/* runtime counters, one set per object and one per codec for the whole
+ * process. everything counted on an object is counted on its codec's set too.
+ * memory is the estimated size of the contexts held plus the output blocks
+ * being filled by native calls that are running, output handed to js as a
+ * Buffer is no longer counted.
+ */
+class Stats {
+public:
+  explicit Stats(int codec) : reported(0), global(&globals[codec]) {
+    Clear();
+  }
+
+  static uint64_t Now() {
+#ifdef  CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+  }
+
+  static Stats* Global(int codec) {
+    return &globals[codec];
+  }
+
+  /* one native call is done, in and out bytes and the time it took */
+  void Call(uint64_t in, uint64_t out, uint64_t ns) {
+    for (Stats* s = this; s; s = s->global) {
+      STAT_ADD(s->calls, 1);
+      STAT_ADD(s->bytes_in, in);
+      STAT_ADD(s->bytes_out, out);
+      STAT_ADD(s->nanos, ns);
+    }
+  }
+
+  void Realloc() {
+    for (Stats* s = this; s; s = s->global) {
+      STAT_ADD(s->reallocs, 1);
+    }
+  }
+
+  /* the incompressible data check looked at a slice of bytes, stored if it
+   * judged the slice incompressible
+   */
+  void Sampled(uint64_t bytes, bool stored) {
+    for (Stats* s = this; s; s = s->global) {
+      STAT_ADD(s->sampled, 1);
+      if (stored) {
+        STAT_ADD(s->stored, 1);
+        STAT_ADD(s->stored_bytes, bytes);
+      }
+    }
+  }
+
+  void Memory(int64_t delta) {
+    for (Stats* s = this; s; s = s->global) {
+      int64_t now = STAT_ADD(s->memory, delta) + delta;
+      int64_t peak = STAT_GET(s->peak_memory);
+      while (now > peak && !__sync_bool_compare_and_swap(&s->peak_memory, peak, now)) {
+        peak = STAT_GET(s->peak_memory);
+      }
+    }
+  }
+
+  /* delta contexts of about bytes each were set up (or given up if negative) */
+  void Contexts(int delta, int64_t bytes) {
+    for (Stats* s = this; s; s = s->global) {
+      STAT_ADD(s->contexts, delta);
+    }
+    Memory(delta * bytes);
+  }
+
+  /* the object set up a context of about bytes, the one it held before is given up */
+  void Acquire(int64_t bytes) {
+    Release();
+    context_bytes = bytes;
+    Contexts(1, bytes);
+  }
+
+  void Release() {
+    if (context_bytes == 0) {
+      return;
+    }
+    Contexts(-1, context_bytes);
+    context_bytes = 0;
+  }
+
+  /* tell V8 how much native memory the object's context holds now, so the
+   * small JS wrapper gets collected as soon as its size calls for. main thread
+   * only, Acquire and Release may run on a worker.
+   */
+  void Report() {
+    int64_t delta = context_bytes - reported;
+    if (delta != 0) {
+      V8::AdjustAmountOfExternalAllocatedMemory((int)delta);
+      reported = context_bytes;
+    }
+  }
+
+  /* {calls, bytesIn, bytesOut, ratio, time (ms), reallocs, memory, peakMemory, contexts,
+   *  sampled, stored, storedBytes}
+   */
+  Local<Object> ToObject() {
+    HandleScope scope;
+    Local<Object> o = Object::New();
+    uint64_t in = STAT_GET(bytes_in);
+    uint64_t out = STAT_GET(bytes_out);
+    o->Set(String::NewSymbol("calls"), Number::New((double)STAT_GET(calls)));
+    o->Set(String::NewSymbol("bytesIn"), Number::New((double)in));
+    o->Set(String::NewSymbol("bytesOut"), Number::New((double)out));
+    o->Set(String::NewSymbol("ratio"), Number::New(in > 0 ? (double)out / in : 0));
+    o->Set(String::NewSymbol("time"), Number::New(STAT_GET(nanos) / 1e6));
+    o->Set(String::NewSymbol("reallocs"), Number::New((double)STAT_GET(reallocs)));
+    o->Set(String::NewSymbol("memory"), Number::New((double)STAT_GET(memory)));
+    o->Set(String::NewSymbol("peakMemory"), Number::New((double)STAT_GET(peak_memory)));
+    o->Set(String::NewSymbol("contexts"), Number::New((double)STAT_GET(contexts)));
+    o->Set(String::NewSymbol("sampled"), Number::New((double)STAT_GET(sampled)));
+    o->Set(String::NewSymbol("stored"), Number::New((double)STAT_GET(stored)));
+    o->Set(String::NewSymbol("storedBytes"), Number::New((double)STAT_GET(stored_bytes)));
+    return scope.Close(o);
+  }
+
+  /* gzbz2.getStats(), the process wide counters as {gzip, gunzip, bzip, bunzip} */
+  static Handle<Value> GetStats(const Arguments& args) {
+    HandleScope scope;
+    static const char* names[STATS_CODECS] = { "gzip", "gunzip", "bzip", "bunzip" };
+    Local<Object> o = Object::New();
+    for (int i = 0; i < STATS_CODECS; i++) {
+      o->Set(String::NewSymbol(names[i]), globals[i].ToObject());
+    }
+    return scope.Close(o);
+  }
+
+private:
+  Stats() : reported(0), global(NULL) {
+    Clear();
+  }
+
+  void Clear() {
+    calls = bytes_in = bytes_out = nanos = reallocs = 0;
+    memory = peak_memory = contexts = context_bytes = 0;
+    sampled = stored = stored_bytes = 0;
+  }
+
+  uint64_t calls;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t nanos;           // inside the native calls
+  uint64_t reallocs;        // output block (re)allocations
+  int64_t memory;           // estimated native bytes held now
+  int64_t peak_memory;
+  int64_t contexts;         // live codec contexts
+  int64_t context_bytes;    // estimated size of the object's own context, 0 for none
+  int64_t reported;         // context_bytes as last given to V8
+  uint64_t sampled;         // slices the incompressible data check looked at
+  uint64_t stored;          // of those, the ones that went out stored
+  uint64_t stored_bytes;
+  Stats* global;            // the codec's process wide set, NULL for that set itself
+
+  static Stats globals[STATS_CODECS];
+};
+
+Stats Stats::globals[STATS_CODECS];
+
+/* times one native call and counts its input and output, *out_len is zeroed
+ * and read again at the end. output blocks grown through it count as reallocs
+ * and as held memory until it is done.
+ */
+class StatCall {
+public:
+  StatCall(Stats& s, int in, int* out) : stats(s), in_len(in), out_len(out), held(0), start(Stats::Now()) {
+    *out_len = 0;
+  }
+
+  ~StatCall() {
+    stats.Memory(-held);
+    stats.Call(in_len, *out_len > 0 ? *out_len : 0, Stats::Now() - start);
+  }
+
+  void Grew(int64_t bytes) {
+    held += bytes;
+    stats.Realloc();
+    stats.Memory(bytes);
+  }
+
+private:
+  Stats& stats;
+  int in_len;
+  int* out_len;
+  int64_t held;
+  uint64_t start;
+};
+
+/* the process wide memory budget for codec state, gzbz2.setMemoryBudget.
+ * every block zlib and libbzip2 get through our allocators is counted, the
+ * idle ones kept by the pools too. init() checks its estimate against what is
+ * left, after emptying the idle pools if that is short. policy 'fail' then
+ * makes init throw, 'degrade' first retries with smaller settings: fewer
+ * threads, a lower memLevel for gzip, a smaller block size for bzip and small
+ * mode for bunzip. running streams are never cut off.
+ */
+class MemoryBudget {
+public:
+  enum Policy { FAIL, DEGRADE };
+
+  /* a block of bytes was allocated (negative: freed) */
+  static void Charge(int64_t bytes) {
+    int64_t now = STAT_ADD(used, bytes) + bytes;
+    int64_t high = STAT_GET(peak);
+    while (now > high && !__sync_bool_compare_and_swap(&peak, high, now)) {
+      high = STAT_GET(peak);
+    }
+  }
+
+  /* room for a new context of about bytes? empties the idle pools first if
+   * not. a yes reserves the bytes until Settle, so two threads admitting at
+   * once can not both take the last of the budget. use a Hold for it.
+   */
+  static bool Admit(int64_t bytes);
+
+  /* the reserved bytes are allocated (and charged) now, or will not be */
+  static void Settle(int64_t bytes) {
+    if (bytes != 0) {
+      STAT_ADD(reserved, -bytes);
+    }
+  }
+
+  /* the reservation of one init, settled when it goes out of scope */
+  class Hold {
+  public:
+    Hold() : bytes(0) { }
+    ~Hold() {
+      Settle(bytes);
+    }
+    bool Admit(int64_t n) {
+      Settle(bytes);
+      bytes = MemoryBudget::Admit(n) ? n : 0;
+      return bytes != 0;
+    }
+  private:
+    int64_t bytes;
+  };
+
+  static bool Degrading() {
+    return policy == DEGRADE;
+  }
+
+  /* init gave up, returns code for it to return */
+  static int Refuse(int code) {
+    STAT_ADD(refused, 1);
+    return code;
+  }
+
+  /* init went ahead with smaller settings */
+  static void Degraded() {
+    STAT_ADD(degraded, 1);
+  }
+
+  /* gzbz2.setMemoryBudget(bytes, ['fail' | 'degrade']), 0 for no budget,
+   * returns the previous limit
+   */
+  static Handle<Value> SetBudget(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1 && args[0]->IsNumber(), "setMemoryBudget argument must be a number");
+    double bytes = args[0]->NumberValue();
+    THROW_IF_NOT (bytes >= 0, "setMemoryBudget: negative budget");
+    int p = policy;
+    if (args.Length() > 1 && !args[1]->IsUndefined() && !args[1]->IsNull()) {
+      String::AsciiValue name(args[1]);
+      if (strcmp(*name, "fail") == 0) {
+        p = FAIL;
+      } else {
+        THROW_IF_NOT (strcmp(*name, "degrade") == 0, "invalid budget policy, expected 'fail' or 'degrade'");
+        p = DEGRADE;
+      }
+    }
+    int64_t prev = limit;
+    limit = (int64_t)bytes;
+    policy = p;
+    return scope.Close(Number::New((double)prev));
+  }
+
+  /* gzbz2.getMemoryBudget() {limit, used, peak, policy, refused, degraded} */
+  static Handle<Value> GetBudget(const Arguments& args) {
+    HandleScope scope;
+    Local<Object> o = Object::New();
+    o->Set(String::NewSymbol("limit"), Number::New((double)limit));
+    o->Set(String::NewSymbol("used"), Number::New((double)STAT_GET(used)));
+    o->Set(String::NewSymbol("peak"), Number::New((double)STAT_GET(peak)));
+    o->Set(String::NewSymbol("policy"), String::New(policy == DEGRADE ? "degrade" : "fail"));
+    o->Set(String::NewSymbol("refused"), Number::New((double)STAT_GET(refused)));
+    o->Set(String::NewSymbol("degraded"), Number::New((double)STAT_GET(degraded)));
+    return scope.Close(o);
+  }
+
+private:
+  static bool Fits(int64_t bytes) {
+    return limit == 0 || STAT_GET(used) + STAT_GET(reserved) + bytes <= limit;
+  }
+
+  static int64_t limit;     // 0 for none
+  static int policy;
+  static int64_t used;
+  static int64_t reserved;  // admitted, not allocated yet
+  static pthread_mutex_t lock;  // one Admit at a time
+  static int64_t peak;
+  static uint64_t refused;
+  static uint64_t degraded;
+};
+
+int64_t MemoryBudget::limit = 0;
+int MemoryBudget::policy = MemoryBudget::FAIL;
+int64_t MemoryBudget::used = 0;
+int64_t MemoryBudget::reserved = 0;
+pthread_mutex_t MemoryBudget::lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t MemoryBudget::peak = 0;
+uint64_t MemoryBudget::refused = 0;
+uint64_t MemoryBudget::degraded = 0;
+
+/* make room for need bytes in the realloc'd block *out of capacity *cap. the
+ * first allocation takes the caller's size estimate, after that the block
+ * doubles, so a large result costs a handful of reallocs instead of one per chunk.
+ * the block never grows past limit.
+ */
+static bool GrowOutput(char** out, int* cap, int need, int hint, StatCall* call = NULL, int limit = INT_MAX) {
+  if (need <= *cap) {
+    return true;
+  }
+  int64_t size = *cap ? (int64_t)*cap * 2 : hint;
+  if (size < need) {
+    size = need;
+  }
+  if (size > limit) {
+    size = limit;
+  }
+  char* temp = (char *)realloc(*out, size);
+  if (temp == NULL) {
+    return false;
+  }
+  if (call) {
+    call->Grew(size - *cap);
+  }
+  *out = temp;
+  *cap = size;
+  return true;
+}
+
+/* expected output for in bytes of input, at the ratio seen so far on the
+ * stream or the guess when there is no history yet
+ */
+static int RatioHint(uint64_t total_in, uint64_t total_out, int in, double guess) {
+  double ratio = total_in > 0 ? (double)total_out / total_in : guess;
+  // a little headroom so hitting the estimate exactly does not cost a doubling
+  double hint = ratio * in * 1.125 + 64;
+  return hint > INT_MAX ? INT_MAX : (int)hint;
+}
+
+/* little endian fields of the index and checkpoint blobs */
+static void PutLE(std::string& s, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    s += (char)((v >> (8*i)) & 0xff);
+  }
+}
+
+static uint64_t GetLE(const unsigned char* p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes-1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+/* the bytes of a Buffer, or of a string in encoding enc */
+static bool ValueBytes(Handle<Value> data, enum encoding enc, std::string* out) {
+  if (Buffer::HasInstance(data)) {
+    Local<Object> b = data->ToObject();
+    out->assign(BufferData(b), BufferLength(b));
+    return true;
+  }
+  ssize_t len = DecodeBytes(data, enc);
+  if (len < 0) {
+    return false;
+  }
+  out->resize(len);
+  return DecodeWrite(len ? &(*out)[0] : NULL, len, data, enc) == len;
+}
+
+/* the input, output and offset arguments of inflateInto/deflateInto, out and
+ * out_len are set to the free space from offset on. returns an error message
+ * or NULL.
+ */
+static const char* IntoArgs(const Arguments& args, char** in, int* in_len, char** out, int* out_len) {
+  if (args.Length() < 2 || !Buffer::HasInstance(args[0]) || !Buffer::HasInstance(args[1])) {
+    return "expected an input Buffer and an output Buffer";
+  }
+  Local<Object> input = args[0]->ToObject();
+  Local<Object> output = args[1]->ToObject();
+  if (BufferLength(input) > INT_MAX || BufferLength(output) > INT_MAX) {
+    return "Buffer too large";
+  }
+  double offset = args.Length() > 2 && !args[2]->IsUndefined() ? args[2]->NumberValue() : 0;
+  if (!(offset >= 0 && offset <= BufferLength(output))) {
+    return "offset out of range";
+  }
+  *in = BufferData(input);
+  *in_len = BufferLength(input);
+  *out = BufferData(output) + (size_t)offset;
+  *out_len = BufferLength(output) - (size_t)offset;
+  return NULL;
+}
+
+/* {read, written, more, end}: input bytes consumed, output bytes produced,
+ * whether output is still pending for a further call, and whether the stream is complete
+ */
+static Local<Object> IntoResult(int read, int written, bool more, bool end) {
+  HandleScope scope;
+  Local<Object> o = Object::New();
+  o->Set(String::NewSymbol("read"), Integer::New(read));
+  o->Set(String::NewSymbol("written"), Integer::New(written));
+  o->Set(String::NewSymbol("more"), Boolean::New(more));
+  o->Set(String::NewSymbol("end"), Boolean::New(end));
+  return scope.Close(o);
+}
+
+/* {state, input, output} of checkpoint(): the blob for restore, the compressed
+ * offset to read on from after restoring and the uncompressed offset the
+ * output then starts at. state is null for no checkpoint, output is empty.
+ */
+static Local<Object> CheckpointResult(const std::string* state, uint64_t input, uint64_t output) {
+  HandleScope scope;
+  Local<Object> o = Object::New();
+  if (state) {
+    Buffer* b = Buffer::New(state->size());
+    memcpy(BufferData(b), state->data(), state->size());
+    o->Set(String::NewSymbol("state"), b->handle_);
+  } else {
+    o->Set(String::NewSymbol("state"), Null());
+  }
+  o->Set(String::NewSymbol("input"), Number::New((double)input));
+  o->Set(String::NewSymbol("output"), Number::New((double)output));
+  return scope.Close(o);
+}
+
+/* {input, output} of restore(), as in CheckpointResult */
+static Local<Object> RestoreResult(uint64_t input, uint64_t output) {
+  HandleScope scope;
+  Local<Object> o = Object::New();
+  o->Set(String::NewSymbol("input"), Number::New((double)input));
+  o->Set(String::NewSymbol("output"), Number::New((double)output));
+  return scope.Close(o);
+}
+
+/* a single queued deflateAsync/inflateAsync/endAsync call.
+ * the worker thread only touches in/out/ret/error, everything v8 related
+ * stays on the event loop thread.
+ */
+class AsyncRequest {
+public:
+  AsyncRequest() : end(false), flush(0), in(NULL), in_len(0), out(NULL), out_len(0), ret(0), next(NULL) { }
+  ~AsyncRequest() {
+    if (!buffer.IsEmpty()) {
+      buffer.Dispose();
+    }
+    if (!callback.IsEmpty()) {
+      callback.Dispose();
+    }
+    free(out);
+  }
+
+  /* buffers are pinned and used in place, strings are decoded into bw */
+  bool SetInput(Handle<Value> data, enum encoding enc) {
+    if (Buffer::HasInstance(data)) {
+      Local<Object> b = data->ToObject();
+      buffer = Persistent<Object>::New(b);
+      in = BufferData(b);
+      in_len = BufferLength(b);
+      return true;
+    }
+    ssize_t len = DecodeBytes(data, enc);
+    if (len < 0) {
+      return false;
+    }
+    in = new char[len];
+    bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( in ));
+    in_len = DecodeWrite(in, len, data, enc);
+    return in_len == len;
+  }
+
+  bool end;             // end the stream instead of deflate/inflate
+  int flush;            // flush the stream in this mode instead, 0 for none
+  char* in;
+  ssize_t in_len;
+  char* out;            // realloc'd output, handed to MakeOutput
+  int out_len;
+  int ret;
+  std::string error;    // set by the worker thread on failure
+  Persistent<Function> callback;
+  AsyncRequest* next;
+
+private:
+  Persistent<Object> buffer;
+  std::auto_ptr<BufferWrapper> bw;
+};
+
+/* priority classes of the executor, see Executor */
+enum TaskClass { TASK_HIGH, TASK_NORMAL, TASK_LOW, TASK_CLASSES };
+
+static const char* task_class_names[TASK_CLASSES] = { "high", "normal", "low" };
+
+/* 'high', 'normal' or 'low' to a TaskClass, -1 for anything else */
+static int TaskPriority(Handle<Value> name) {
+  String::AsciiValue s(name);
+  for (int c = 0; c < TASK_CLASSES; c++) {
+    if (*s && strcmp(*s, task_class_names[c]) == 0) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+/* work(arg) runs on a worker thread, after(arg) on the event loop thread */
+typedef void (*TaskFn)(void* arg);
+
+/* the process wide pool the async calls run on, instead of the eio pool that
+ * fs and dns share. a fixed set of workers (one per core by default) each
+ * have a fifo per priority class, tasks are dealt round robin and a worker
+ * with nothing of its own steals from the back of the others' queues. a
+ * higher class always goes first, except that every 8th pick of a worker
+ * starts from the lowest class so a busy class can not starve the others.
+ * completions go back to the event loop through one ev_async.
+ *
+ * ordering is up to the callers: AsyncQueue only ever has one task of a
+ * stream in here, so thousands of streams share the workers fairly (one call
+ * each in turn) and each stream's calls still run one after the other.
+ */
+class Executor {
+public:
+  static void Submit(TaskFn work, TaskFn after, void* arg, int priority) {
+    if (workers == NULL) {
+      Start();
+    }
+    Task* task = new Task();
+    task->work = work;
+    task->after = after;
+    task->arg = arg;
+    task->priority = priority;
+    task->queued = Stats::Now();
+    STAT_ADD(counts[priority].queued, 1);
+    STAT_ADD(counts[priority].submitted, 1);
+
+    ev_ref(EV_DEFAULT_UC);
+    if (started == 0) {
+      // no worker thread could be created, the task runs here and after()
+      // still comes from the event loop
+      Run(task);
+      return;
+    }
+    Worker* w = &workers[__sync_fetch_and_add(&next_worker, 1) % threads];
+    pthread_mutex_lock(&w->lock);
+    w->queue[priority].push_back(task);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&idle_lock);
+    ready++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  }
+
+  /* gzbz2.setExecutorThreads(n), only before the first async call, returns the
+   * previous setting
+   */
+  static Handle<Value> SetThreads(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1 && args[0]->IsNumber(), "setExecutorThreads argument must be a number");
+    int n = args[0]->Int32Value();
+    THROW_IF_NOT_A (1 <= n && n <= 256, "invalid executor threads: %d", n);
+    THROW_IF_NOT (workers == NULL, "setExecutorThreads: the executor is already running");
+    int prev = threads > 0 ? threads : DefaultThreads();
+    threads = n;
+    return scope.Close(Integer::New(prev));
+  }
+
+  /* gzbz2.getExecutorStats() {threads, queued, running, completed, stolen,
+   * high: {...}, normal: {...}, low: {...}}, per class queued (depth now),
+   * submitted, completed, stolen, waitTime/maxWait/avgWait (ms queued before a
+   * worker took the task) and runTime (ms)
+   */
+  static Handle<Value> GetStats(const Arguments& args) {
+    HandleScope scope;
+    Local<Object> o = Object::New();
+    int64_t queued = 0;
+    uint64_t completed = 0, stolen = 0;
+    for (int c = 0; c < TASK_CLASSES; c++) {
+      ClassCounts& k = counts[c];
+      Local<Object> cls = Object::New();
+      uint64_t done = STAT_GET(k.completed);
+      uint64_t wait = STAT_GET(k.wait_ns);
+      cls->Set(String::NewSymbol("queued"), Number::New((double)STAT_GET(k.queued)));
+      cls->Set(String::NewSymbol("submitted"), Number::New((double)STAT_GET(k.submitted)));
+      cls->Set(String::NewSymbol("completed"), Number::New((double)done));
+      cls->Set(String::NewSymbol("stolen"), Number::New((double)STAT_GET(k.stolen)));
+      cls->Set(String::NewSymbol("waitTime"), Number::New(wait / 1e6));
+      cls->Set(String::NewSymbol("maxWait"), Number::New(STAT_GET(k.max_wait_ns) / 1e6));
+      cls->Set(String::NewSymbol("avgWait"), Number::New(done > 0 ? wait / 1e6 / done : 0));
+      cls->Set(String::NewSymbol("runTime"), Number::New(STAT_GET(k.run_ns) / 1e6));
+      o->Set(String::NewSymbol(task_class_names[c]), cls);
+      queued += STAT_GET(k.queued);
+      completed += done;
+      stolen += STAT_GET(k.stolen);
+    }
+    // the workers actually running once started, which can be fewer than asked for
+    o->Set(String::NewSymbol("threads"), Integer::New(workers ? started : threads > 0 ? threads : DefaultThreads()));
+    o->Set(String::NewSymbol("queued"), Number::New((double)queued));
+    o->Set(String::NewSymbol("running"), Number::New((double)STAT_GET(running)));
+    o->Set(String::NewSymbol("completed"), Number::New((double)completed));
+    o->Set(String::NewSymbol("stolen"), Number::New((double)stolen));
+    return scope.Close(o);
+  }
+
+private:
+  struct Task {
+    TaskFn work;
+    TaskFn after;
+    void* arg;
+    int priority;
+    uint64_t queued;      // Stats::Now() at Submit
+  };
+
+  struct Worker {
+    pthread_mutex_t lock;
+    std::deque<Task*> queue[TASK_CLASSES];
+    unsigned int picks;   // only touched by the worker itself
+  };
+
+  struct ClassCounts {
+    int64_t queued;       // submitted and not taken yet
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;      // taken from another worker's queue
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t run_ns;
+  };
+
+  static int DefaultThreads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > 256 ? 256 : (int)n;
+  }
+
+  /* on the event loop thread, at the first Submit */
+  static void Start() {
+    if (threads <= 0) {
+      threads = DefaultThreads();
+    }
+    ev_async_init(&done_watcher, Drain);
+    ev_async_start(EV_DEFAULT_UC, &done_watcher);
+    // only the tasks keep the loop alive, not the watcher
+    ev_unref(EV_DEFAULT_UC);
+
+    workers = new Worker[threads];
+    for (int i = 0; i < threads; i++) {
+      pthread_mutex_init(&workers[i].lock, NULL);
+      workers[i].picks = 0;
+    }
+    // a worker that did not start leaves its queue to be stolen from by the others
+    for (int i = 0; i < threads; i++) {
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, Loop, (void*)(intptr_t)i) == 0) {
+        pthread_detach(tid);
+        started++;
+      }
+    }
+  }
+
+  static void* Loop(void* p) {
+    int self = (int)(intptr_t)p;
+    for (;;) {
+      // claim one task, then find it: every claim matches one queued task
+      pthread_mutex_lock(&idle_lock);
+      while (ready == 0) {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+      }
+      ready--;
+      pthread_mutex_unlock(&idle_lock);
+
+      Task* task;
+      while ((task = Take(self)) == NULL) {
+        sched_yield();
+      }
+      Run(task);
+    }
+    return NULL;
+  }
+
+  /* run a taken task and hand it to the event loop for its after() */
+  static void Run(Task* task) {
+    ClassCounts& k = counts[task->priority];
+    uint64_t start = Stats::Now();
+    uint64_t wait = start - task->queued;
+    STAT_ADD(k.queued, -1);
+    STAT_ADD(k.wait_ns, wait);
+    uint64_t max = STAT_GET(k.max_wait_ns);
+    while (wait > max && !__sync_bool_compare_and_swap(&k.max_wait_ns, max, wait)) {
+      max = STAT_GET(k.max_wait_ns);
+    }
+    STAT_ADD(running, 1);
+    task->work(task->arg);
+    STAT_ADD(running, -1);
+    STAT_ADD(k.run_ns, Stats::Now() - start);
+
+    pthread_mutex_lock(&done_lock);
+    done.push_back(task);
+    pthread_mutex_unlock(&done_lock);
+    ev_async_send(EV_DEFAULT_UC, &done_watcher);
+  }
+
+  /* the next task for worker self: its own oldest one of the highest class,
+   * else the newest one of that class on another worker
+   */
+  static Task* Take(int self) {
+    Worker* me = &workers[self];
+    bool aging = (++me->picks & 7) == 0;
+    for (int i = 0; i < TASK_CLASSES; i++) {
+      int c = aging ? TASK_CLASSES-1-i : i;
+      for (int v = 0; v < threads; v++) {
+        Worker* w = &workers[(self + v) % threads];
+        pthread_mutex_lock(&w->lock);
+        if (w->queue[c].empty()) {
+          pthread_mutex_unlock(&w->lock);
+          continue;
+        }
+        Task* task;
+        if (v == 0) {
+          task = w->queue[c].front();
+          w->queue[c].pop_front();
+        } else {
+          task = w->queue[c].back();
+          w->queue[c].pop_back();
+          STAT_ADD(counts[c].stolen, 1);
+        }
+        pthread_mutex_unlock(&w->lock);
+        return task;
+      }
+    }
+    return NULL;
+  }
+
+  /* on the event loop thread, ev_async_send calls may be merged into one */
+  static void Drain(EV_P_ ev_async* watcher, int revents) {
+    std::vector<Task*> list;
+    pthread_mutex_lock(&done_lock);
+    list.swap(done);
+    pthread_mutex_unlock(&done_lock);
+    for (size_t i = 0; i < list.size(); i++) {
+      Task* task = list[i];
+      STAT_ADD(counts[task->priority].completed, 1);
+      ev_unref(EV_DEFAULT_UC);
+      task->after(task->arg);
+      delete task;
+    }
+  }
+
+  static int threads;                 // 0 until set or started
+  static Worker* workers;             // NULL until the first Submit
+  static int started;                 // worker threads running, 0: tasks run in Submit
+  static unsigned int next_worker;
+  static pthread_mutex_t idle_lock;
+  static pthread_cond_t idle_cond;
+  static int ready;                   // queued tasks no worker has claimed
+  static pthread_mutex_t done_lock;
+  static std::vector<Task*> done;     // run, waiting for their after()
+  static ev_async done_watcher;
+  static ClassCounts counts[TASK_CLASSES];
+  static int64_t running;
+};
+
+int Executor::threads = 0;
+Executor::Worker* Executor::workers = NULL;
+int Executor::started = 0;
+unsigned int Executor::next_worker = 0;
+pthread_mutex_t Executor::idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Executor::idle_cond = PTHREAD_COND_INITIALIZER;
+int Executor::ready = 0;
+pthread_mutex_t Executor::done_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Executor::Task*> Executor::done;
+ev_async Executor::done_watcher;
+Executor::ClassCounts Executor::counts[TASK_CLASSES];
+int64_t Executor::running = 0;
+
+/* per instance fifo of AsyncRequests, only the head is ever on the Executor
+ * so calls on the same instance complete in the order they were made.
+ * T must provide async_head/async_tail, priority (a TaskClass), use_buffers,
+ * encoding, stats and void AsyncWork(AsyncRequest*), which runs on a worker thread.
+ */
+template <class T>
+class AsyncQueue {
+public:
+  static void Push(T* self, AsyncRequest* req) {
+    if (self->async_tail) {
+      self->async_tail->next = req;
+      self->async_tail = req;
+    } else {
+      self->async_head = self->async_tail = req;
+      Start(self);
+    }
+  }
+
+  /* parse the trailing callback and queue the request, returns undefined or a thrown exception */
+  static Handle<Value> Queue(T* self, const Arguments& args, AsyncRequest* req) {
+    HandleScope scope;
+    Local<Value> cb = args[args.Length()-1];
+    if (!cb->IsFunction()) {
+      delete req;
+      return ThrowException(Exception::Error (String::New("last argument must be a callback")));
+    }
+    req->callback = Persistent<Function>::New(Local<Function>::Cast(cb));
+    Push(self, req);
+    return scope.Close(Undefined());
+  }
+
+private:
+  static void Start(T* self) {
+    self->Ref();
+    Executor::Submit(Work, After, self, self->priority);
+  }
+
+  static void Work(void* arg) {
+    T* self = static_cast<T*>(arg);
+    AsyncRequest* req = self->async_head;
+    try {
+      self->AsyncWork(req);
+    } catch( const std::string & msg ) {
+      req->error = msg;
+    }
+  }
+
+  static void After(void* arg) {
+    HandleScope scope;
+    T* self = static_cast<T*>(arg);
+
+    AsyncRequest* req = self->async_head;
+    self->async_head = req->next;
+    if (self->async_head == NULL) {
+      self->async_tail = NULL;
+    } else {
+      Start(self);
+    }
+
+    // init or end may have run on the worker
+    self->stats.Report();
+
+    Handle<Value> argv[2];
+    if (!req->error.empty()) {
+      argv[0] = Exception::Error (String::New(req->error.c_str()));
+      argv[1] = Undefined();
+    } else {
+      argv[0] = Null();
+      if (req->end && req->out == NULL) {
+        argv[1] = Undefined();
+      } else {
+        argv[1] = MakeOutput(req->out, req->out_len, self->use_buffers, self->encoding);
+        req->out = NULL;
+      }
+    }
+
+    TryCatch try_catch;
+    req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+    delete req;
+    self->Unref();
+  }
+};
+
+/* job(arg, i) is called once for every i in [0, count) */
+typedef void (*ParallelJob)(void* arg, int i);
+
+class ParallelRun {
+public:
+  /* run the jobs on up to threads threads, the calling thread takes part so
+   * with one thread (or one job) everything runs inline
+   */
+  static void Run(ParallelJob job, void* arg, int count, int threads) {
+    ParallelRun run(job, arg, count);
+    if (threads > count) {
+      threads = count;
+    }
+    pthread_t* tids = new pthread_t[threads > 1 ? threads-1 : 1];
+    int started = 0;
+    for (int t = 0; t < threads-1; t++) {
+      if (pthread_create(&tids[started], NULL, Worker, &run) == 0) {
+        started++;
+      }
+    }
+    Worker(&run);
+    for (int t = 0; t < started; t++) {
+      pthread_join(tids[t], NULL);
+    }
+    delete[] tids;
+  }
+
+private:
+  ParallelRun(ParallelJob j, void* a, int c) : job(j), arg(a), count(c), next(0) { }
+
+  static void* Worker(void* p) {
+    ParallelRun* run = static_cast<ParallelRun*>(p);
+    int i;
+    while ((i = __sync_fetch_and_add(&run->next, 1)) < run->count) {
+      run->job(run->arg, i);
+    }
+    return NULL;
+  }
+
+  ParallelJob job;
+  void* arg;
+  int count;
+  int next;
+};
+
 #ifdef  WITH_GZIP
-class Gzip : public EventEmitter {
+#define GZIP_WINDOW 32768
+
+/* what zlib allocates for a stream, as given in zconf.h */
+#define DEFLATE_MEMORY(window_bits, mem_level) ((1 << ((window_bits) + 2)) + (1 << ((mem_level) + 9)))
+#define INFLATE_MEMORY(window_bits) ((1 << (window_bits)) + 7168)
+
+/* the ISIZE of a buffer that looks like a whole gzip member, if plausible */
+static bool GzipTrailerSize(const char* data, int data_len, uint32_t* isize) {
+  const unsigned char* p = (const unsigned char*)data;
+  // the top three flag bits are reserved, zlib rejects a header with any of them set
+  if (data_len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xe0) != 0) {
+    return false;
+  }
+  p += data_len - 4;
+  *isize = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  // deflate can not do better than about 1032:1
+  return *isize <= (uint64_t)data_len * 1032;
+}
+
+/* the output block for inflating a whole gzip buffer in one go: ISIZE and a
+ * byte, so the inflate that writes the last byte still sees room and the
+ * block is never grown. 0 if the trailer is implausible or the size does not
+ * fit an int. ISIZE is the last member's, a multi-member buffer grows from there.
+ */
+static int GzipExactSize(const char* data, int data_len) {
+  uint32_t isize;
+  if (!GzipTrailerSize(data, data_len, &isize) || isize == 0 || isize >= INT_MAX) {
+    return 0;
+  }
+  return isize + 1;
+}
+
+/* windowBits for a format name: gzip, zlib or raw deflate, 0 if unknown */
+static int FormatWindowBits(Handle<Value> format) {
+  String::AsciiValue name(format);
+  if (strcmp(*name, "gzip") == 0) {
+    return 16+MAX_WBITS;
+  } else if (strcmp(*name, "zlib") == 0) {
+    return MAX_WBITS;
+  } else if (strcmp(*name, "raw") == 0) {
+    return -MAX_WBITS;
+  }
+  return 0;
+}
+
+static const char* z_strategy_names[] = { "default", "filtered", "huffman", "rle", "fixed" };
+static const int z_strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED };
+
+#define Z_STRATEGIES ((int)(sizeof(z_strategies) / sizeof(z_strategies[0])))
+
+/* deflate strategy for a name, -1 if unknown */
+static int ZStrategy(Handle<Value> name) {
+  String::AsciiValue s(name);
+  for (int i = 0; i < Z_STRATEGIES; i++) {
+    if (*s && strcmp(*s, z_strategy_names[i]) == 0) {
+      return z_strategies[i];
+    }
+  }
+  return -1;
+}
+
+/* the name init takes for a deflate strategy */
+static const char* ZStrategyName(int strategy) {
+  for (int i = 0; i < Z_STRATEGIES; i++) {
+    if (z_strategies[i] == strategy) {
+      return z_strategy_names[i];
+    }
+  }
+  return "default";
+}
+
+/* order-0 entropy in bits per byte of at most 4K bytes sampled evenly over
+ * the data. four histograms side by side keep the increments independent,
+ * so runs of one byte value do not stall the loop on the same counter.
+ */
+static double SampleEntropy(const unsigned char* p, int len) {
+  uint32_t h[4][256];
+  memset(h, 0, sizeof(h));
+  int stride = len > 4096 ? len / 4096 : 1;
+  int n = 0;
+  int i = 0;
+  for (; i + 3*stride < len && n + 4 <= 4096; i += 4*stride, n += 4) {
+    h[0][p[i]]++;
+    h[1][p[i + stride]]++;
+    h[2][p[i + 2*stride]]++;
+    h[3][p[i + 3*stride]]++;
+  }
+  for (; i < len && n < 4096; i += stride, n++) {
+    h[0][p[i]]++;
+  }
+  double bits = 0;
+  for (int b = 0; b < 256; b++) {
+    uint32_t c = h[0][b] + h[1][b] + h[2][b] + h[3][b];
+    if (c) {
+      double q = (double)c / n;
+      bits -= q * log(q);
+    }
+  }
+  return bits / M_LN2;
+}
+
+// compressed or encrypted data samples at about 7.95 bits, text at 4 to 5
+#define INCOMPRESSIBLE_BITS 7.85
+// slices smaller than this are deflated whatever they look like
+#define INCOMPRESSIBLE_MIN 4096
+
+/* the settings the adaptive level moves over, slowest and smallest first */
+struct ZRung {
+  int level;
+  int strategy;
+};
+
+static const ZRung z_ladder[] = {
+  {9, Z_DEFAULT_STRATEGY}, {8, Z_DEFAULT_STRATEGY}, {7, Z_DEFAULT_STRATEGY},
+  {6, Z_DEFAULT_STRATEGY}, {5, Z_DEFAULT_STRATEGY}, {4, Z_DEFAULT_STRATEGY},
+  {3, Z_DEFAULT_STRATEGY}, {2, Z_DEFAULT_STRATEGY}, {1, Z_DEFAULT_STRATEGY},
+  {1, Z_RLE}, {1, Z_HUFFMAN_ONLY}
+};
+
+#define Z_LADDER ((int)(sizeof(z_ladder) / sizeof(z_ladder[0])))
+
+/* init({targetMBps}) / init({targetCpu}): after every window of input the
+ * deflate speed (input MB per second spent in deflate) and cpu share (time in
+ * deflate over wall time) of that window move the stream one rung down the
+ * ladder when it falls short of a target, and one rung back up, never past
+ * the init level, once there is plenty of headroom. a window that hardly
+ * compressed is no reason to try harder.
+ */
+class LevelController {
+public:
+  LevelController() : target_mbps(0), target_cpu(0), window(0), top(0), rung(0), switches(0) { }
+
+  void Init(int level, double mbps, double cpu, int window_bytes) {
+    target_mbps = mbps;
+    target_cpu = cpu;
+    window = window_bytes;
+    top = 0;
+    while (top + 1 < Z_LADDER && z_ladder[top].level > level) {
+      top++;
+    }
+    rung = top;
+    switches = 0;
+    Restart();
+  }
+
+  bool Enabled() {
+    return target_mbps > 0 || target_cpu > 0;
+  }
+
+  /* one deflate call of ns nanoseconds took in and gave out bytes */
+  void Sample(uint64_t in, uint64_t out, uint64_t ns) {
+    win_in += in;
+    win_out += out;
+    win_ns += ns;
+    if (win_in < (uint64_t)window) {
+      return;
+    }
+    uint64_t now = Stats::Now();
+    double mbps = win_ns > 0 ? win_in / 1048576.0 / (win_ns / 1e9) : 1e9;
+    double cpu = now > win_start ? 100.0 * win_ns / (now - win_start) : 0;
+    bool slow = (target_mbps > 0 && mbps < target_mbps) || (target_cpu > 0 && cpu > target_cpu);
+    bool spare = (target_mbps == 0 || mbps > target_mbps * 1.5) && (target_cpu == 0 || cpu < target_cpu * 0.5);
+    if (slow && rung + 1 < Z_LADDER) {
+      rung++;
+      switches++;
+    } else if (spare && rung > top && win_out < win_in * 0.9) {
+      rung--;
+      switches++;
+    }
+    Restart();
+  }
+
+  int Level() {
+    return z_ladder[rung].level;
+  }
+
+  int Strategy() {
+    return z_ladder[rung].strategy;
+  }
+
+  uint64_t Switches() {
+    return switches;
+  }
+
+private:
+  void Restart() {
+    win_in = win_out = win_ns = 0;
+    win_start = Stats::Now();
+  }
+
+  double target_mbps;       // 0 for none
+  double target_cpu;        // percent, 0 for none
+  int window;               // input bytes between decisions
+  int top;                  // rung of the init level
+  int rung;
+  uint64_t switches;
+  uint64_t win_in;
+  uint64_t win_out;
+  uint64_t win_ns;
+  uint64_t win_start;
+};
+
+#ifdef  HAVE_CRC32_PCLMUL
+/* the gzip crc32 (reflected, polynomial 0x104c11db7) folded 64 bytes at a time
+ * with pclmulqdq, after Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction" and the Linux crc32-pclmul code. len is a
+ * multiple of 16 and at least 64, crc is the inverted running value.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t Crc32Pclmul(const unsigned char* p, size_t len, uint32_t crc) {
+  const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+  const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*)p);
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  p += 64;
+  len -= 64;
+
+  // four lanes 512 bits apart
+  while (len >= 64) {
+    __m128i h1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    __m128i h2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    __m128i h3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    __m128i h4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), h1),
+                       _mm_loadu_si128((const __m128i*)p));
+    x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), h2),
+                       _mm_loadu_si128((const __m128i*)(p + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), h3),
+                       _mm_loadu_si128((const __m128i*)(p + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x00), h4),
+                       _mm_loadu_si128((const __m128i*)(p + 48)));
+    p += 64;
+    len -= 64;
+  }
+
+  // fold the lanes into one, then the remaining 16 byte pieces into that
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00),
+                                   _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00),
+                                   _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00),
+                                   _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+  while (len >= 16) {
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00),
+                                     _mm_clmulepi64_si128(x1, k3k4, 0x11)),
+                       _mm_loadu_si128((const __m128i*)p));
+    p += 16;
+    len -= 16;
+  }
+
+  // 128 bits down to 64, then 32 more zero bits
+  __m128i t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), t);
+
+  // barrett reduction to the 32 bit remainder
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, t);
+  return _mm_extract_epi32(x1, 1);
+}
+
+static bool HasPclmul() {
+  static int has = -1;
+  if (has < 0) {
+    unsigned int a, b, c, d;
+    has = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL) && (c & bit_SSE4_1);
+  }
+  return has;
+}
+#endif//HAVE_CRC32_PCLMUL
+
+/* crc32() with the same arguments, the bulk of a long buffer goes through
+ * pclmulqdq when the cpu has it, zlib's tables do the rest
+ */
+static uLong Crc32(uLong crc, const unsigned char* p, size_t len) {
+#ifdef  HAVE_CRC32_PCLMUL
+  if (len >= 64 && HasPclmul()) {
+    size_t n = len & ~(size_t)15;
+    crc = ~Crc32Pclmul(p, n, ~(uint32_t)crc) & 0xffffffffUL;
+    p += n;
+    len -= n;
+  }
+#endif//HAVE_CRC32_PCLMUL
+  return crc32(crc, p, len);
+}
+
+#define ZMEM_MIN 4096
+#define ZMEM_CLASSES 9      // 4K .. 1M
+#define ZMEM_KEEP 8         // free blocks kept per class
+
+/* zalloc/zfree of every zlib stream. blocks are counted against the memory
+ * budget, and freed blocks of 4K to 1M go on a free list per power of two
+ * size class (a few each) for the next stream that is not taken from the
+ * pool. a stream asks for about five blocks, most of them 64K.
+ */
+class ZMemory {
+public:
+  static voidpf Alloc(voidpf opaque, uInt items, uInt size) {
+    size_t bytes = (size_t)items * size;
+    int c = Class(bytes);
+    Header* h = NULL;
+    if (c >= 0) {
+      bytes = (size_t)ZMEM_MIN << c;
+      pthread_mutex_lock(&lock);
+      h = free_list[c];
+      if (h) {
+        free_list[c] = h->next;
+        free_count[c]--;
+      }
+      pthread_mutex_unlock(&lock);
+    }
+    if (h == NULL) {
+      h = (Header*)malloc(sizeof(Header) + bytes);
+      if (h == NULL) {
+        return Z_NULL;
+      }
+      h->size = bytes;
+      MemoryBudget::Charge(sizeof(Header) + bytes);
+    }
+    return h + 1;
+  }
+
+  static void Free(voidpf opaque, voidpf p) {
+    Header* h = (Header*)p - 1;
+    int c = Class(h->size);
+    if (c >= 0) {
+      pthread_mutex_lock(&lock);
+      if (free_count[c] < ZMEM_KEEP) {
+        h->next = free_list[c];
+        free_list[c] = h;
+        free_count[c]++;
+        h = NULL;
+      }
+      pthread_mutex_unlock(&lock);
+    }
+    if (h) {
+      MemoryBudget::Charge(-(int64_t)(sizeof(Header) + h->size));
+      free(h);
+    }
+  }
+
+  /* give the free lists back to the system */
+  static void Trim() {
+    Header* drop[ZMEM_CLASSES];
+    pthread_mutex_lock(&lock);
+    for (int c = 0; c < ZMEM_CLASSES; c++) {
+      drop[c] = free_list[c];
+      free_list[c] = NULL;
+      free_count[c] = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    for (int c = 0; c < ZMEM_CLASSES; c++) {
+      while (drop[c]) {
+        Header* h = drop[c];
+        drop[c] = h->next;
+        MemoryBudget::Charge(-(int64_t)(sizeof(Header) + h->size));
+        free(h);
+      }
+    }
+  }
+
+private:
+  // two words, so the block after it stays aligned for anything
+  struct Header {
+    Header* next;       // while on a free list
+    size_t size;
+  };
+
+  /* the size class for bytes, -1 for blocks that are not kept */
+  static int Class(size_t bytes) {
+    int c = 0;
+    while (((size_t)ZMEM_MIN << c) < bytes) {
+      c++;
+    }
+    return c < ZMEM_CLASSES ? c : -1;
+  }
+
+  static pthread_mutex_t lock;
+  static Header* free_list[ZMEM_CLASSES];
+  static int free_count[ZMEM_CLASSES];
+};
+
+pthread_mutex_t ZMemory::lock = PTHREAD_MUTEX_INITIALIZER;
+ZMemory::Header* ZMemory::free_list[ZMEM_CLASSES];
+int ZMemory::free_count[ZMEM_CLASSES];
+
+/* process wide free lists of initialised zlib streams. init() borrows one and
+ * only has to deflateReset/inflateReset it instead of paying for
+ * deflateInit2/inflateInit2 and their allocations, end() hands it back.
+ * deflate streams are kept apart by all of their init parameters, inflate
+ * streams are switched with inflateReset2. end() may run on a worker thread.
+ */
+class ZStreamPool {
+public:
+  struct Key {
+    bool operator==(const Key& o) const {
+      return level == o.level && window_bits == o.window_bits &&
+             mem_level == o.mem_level && strategy == o.strategy;
+    }
+    int level;
+    int window_bits;
+    int mem_level;
+    int strategy;
+  };
+
+  static z_stream* Deflate(const Key& key, int* ret) {
+    z_stream* strm = Take(deflate_pool, key);
+    if (strm) {
+      *ret = deflateReset(strm);
+      if (*ret == Z_OK) {
+        return strm;
+      }
+      deflateEnd(strm);
+      delete strm;
+    }
+    strm = New();
+    *ret = deflateInit2(strm, key.level, Z_DEFLATED, key.window_bits, key.mem_level, key.strategy);
+    if (*ret != Z_OK) {
+      delete strm;
+      return NULL;
+    }
+    return strm;
+  }
+
+  static z_stream* Inflate(int window_bits, int* ret) {
+    z_stream* strm = Take(inflate_pool, inflate_key);
+    if (strm) {
+      *ret = inflateReset2(strm, window_bits);
+      if (*ret == Z_OK) {
+        return strm;
+      }
+      inflateEnd(strm);
+      delete strm;
+    }
+    strm = New();
+    *ret = inflateInit2(strm, window_bits);
+    if (*ret != Z_OK) {
+      delete strm;
+      return NULL;
+    }
+    return strm;
+  }
+
+  static void ReleaseDeflate(z_stream* strm, const Key& key) {
+    if (strm->state == Z_NULL || !Give(deflate_pool, strm, key, deflate_limit)) {
+      deflateEnd(strm);
+      delete strm;
+    }
+  }
+
+  static void ReleaseInflate(z_stream* strm) {
+    // a stream that hit an error was ended already
+    if (strm->state == Z_NULL || !Give(inflate_pool, strm, inflate_key, inflate_limit)) {
+      inflateEnd(strm);
+      delete strm;
+    }
+  }
+
+  /* idle streams kept per set of init parameters, returns the previous limit */
+  static int SetLimit(bool deflating, int limit) {
+    std::vector<Entry>& pool = deflating ? deflate_pool : inflate_pool;
+    std::vector<z_stream*> drop;
+    pthread_mutex_lock(&lock);
+    int* l = deflating ? &deflate_limit : &inflate_limit;
+    int prev = *l;
+    *l = limit;
+    for (size_t i = pool.size(); i-- > 0; ) {
+      if (Count(pool, pool[i].key) > limit) {
+        drop.push_back(pool[i].strm);
+        pool.erase(pool.begin() + i);
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < drop.size(); i++) {
+      deflating ? deflateEnd(drop[i]) : inflateEnd(drop[i]);
+      delete drop[i];
+    }
+    return prev;
+  }
+
+private:
+  struct Entry {
+    z_stream* strm;
+    Key key;
+  };
+
+  static z_stream* New() {
+    z_stream* strm = new z_stream;
+    strm->zalloc = ZMemory::Alloc;
+    strm->zfree = ZMemory::Free;
+    strm->opaque = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    return strm;
+  }
+
+  static int Count(std::vector<Entry>& pool, const Key& key) {
+    int n = 0;
+    for (size_t i = 0; i < pool.size(); i++) {
+      if (pool[i].key == key) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  static z_stream* Take(std::vector<Entry>& pool, const Key& key) {
+    z_stream* strm = NULL;
+    pthread_mutex_lock(&lock);
+    for (size_t i = pool.size(); i-- > 0; ) {
+      if (pool[i].key == key) {
+        strm = pool[i].strm;
+        pool.erase(pool.begin() + i);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    return strm;
+  }
+
+  static bool Give(std::vector<Entry>& pool, z_stream* strm, const Key& key, int limit) {
+    bool kept = false;
+    pthread_mutex_lock(&lock);
+    if (Count(pool, key) < limit) {
+      Entry e = { strm, key };
+      pool.push_back(e);
+      kept = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return kept;
+  }
+
+  static pthread_mutex_t lock;
+  static std::vector<Entry> deflate_pool;
+  static std::vector<Entry> inflate_pool;
+  static const Key inflate_key;   // inflateReset2 can switch window bits, one list does for all
+  static int deflate_limit;
+  static int inflate_limit;
+};
+
+pthread_mutex_t ZStreamPool::lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<ZStreamPool::Entry> ZStreamPool::deflate_pool;
+std::vector<ZStreamPool::Entry> ZStreamPool::inflate_pool;
+const ZStreamPool::Key ZStreamPool::inflate_key = { 0, 0, 0, 0 };
+int ZStreamPool::deflate_limit = 8;
+int ZStreamPool::inflate_limit = 8;
+
+/* pigz style parallel gzip. the input is cut into blocks which are raw deflated
+ * on their own threads, each primed with the 32K of input that precedes it.
+ * every block but the last ends on a sync flush so the blocks can simply be
+ * concatenated between our own gzip header and trailer, the block crcs are
+ * merged with crc32_combine.
+ */
+class ParallelGzip {
+public:
+  ParallelGzip(int level, int threads, int block_size)
+    : level(level), threads(threads), block_size(block_size),
+      pending(NULL), pending_len(0), window_len(0), header_done(false),
+      crc(crc32(0L, Z_NULL, 0)), isize(0) {
+    window = (char *)malloc(GZIP_WINDOW);
+    pending = (char *)malloc(block_size);
+  }
+
+  ~ParallelGzip() {
+    free(window);
+    free(pending);
+  }
+
+  /* flush is Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FULL_FLUSH (both of which also
+   * deflate the partial block) or Z_FINISH
+   */
+  int Deflate(const char* data, int data_len, int flush, char** out, int* out_len) {
+    *out = NULL;
+    *out_len = 0;
+    if (window == NULL || pending == NULL) {
+      return Z_MEM_ERROR;
+    }
+    bool finish = flush == Z_FINISH;
+
+    // top up the buffered partial block first, it becomes block 0
+    std::vector<Block> blocks;
+    if (pending_len > 0) {
+      int take = block_size - pending_len < data_len ? block_size - pending_len : data_len;
+      memcpy(pending + pending_len, data, take);
+      pending_len += take;
+      data += take;
+      data_len -= take;
+      if (pending_len == block_size || flush != Z_NO_FLUSH) {
+        blocks.push_back(Block(pending, pending_len));
+      }
+    }
+    while (data_len >= block_size) {
+      if (data_len == block_size && finish) {
+        break;
+      }
+      blocks.push_back(Block(data, block_size));
+      data += block_size;
+      data_len -= block_size;
+    }
+    if (finish) {
+      // the remainder (possibly empty) is the final block
+      if (data_len > 0 || blocks.empty()) {
+        blocks.push_back(Block(data, data_len));
+      }
+      blocks.back().last = true;
+    } else if (flush != Z_NO_FLUSH && data_len > 0) {
+      // every block ends in a sync flush already, so a short one is all it takes
+      blocks.push_back(Block(data, data_len));
+      data_len = 0;
+    }
+
+    // every block is primed with the 32K of input before it. a rolling window
+    // carries that across blocks (and calls) shorter than 32K, as after a flush
+    std::vector<std::string> dicts(blocks.size());
+    std::string roll(window, window_len);
+    for (size_t b = 0; b < blocks.size(); b++) {
+      dicts[b] = roll;
+      blocks[b].dict = dicts[b].data();
+      blocks[b].dict_len = dicts[b].size();
+      int tail = blocks[b].in_len < GZIP_WINDOW ? blocks[b].in_len : GZIP_WINDOW;
+      roll.append(blocks[b].in + blocks[b].in_len - tail, tail);
+      if (roll.size() > GZIP_WINDOW) {
+        roll.erase(0, roll.size() - GZIP_WINDOW);
+      }
+    }
+    if (blocks.size() > 0) {
+      current = &blocks[0];
+      ParallelRun::Run(DeflateBlock, this, blocks.size(), threads);
+    }
+
+    int size = header_done ? 0 : 10;
+    for (size_t b = 0; b < blocks.size(); b++) {
+      if (blocks[b].ret != Z_OK) {
+        int ret = blocks[b].ret;
+        FreeBlocks(blocks);
+        return ret;
+      }
+      size += blocks[b].out_len;
+    }
+    size += finish ? 8 : 0;
+
+    *out = (char *)malloc(size > 0 ? size : 1);
+    if (*out == NULL) {
+      FreeBlocks(blocks);
+      return Z_MEM_ERROR;
+    }
+    unsigned char* o = (unsigned char *)*out;
+    if (!header_done) {
+      // magic, deflate, no flags, no mtime, no extra flags, os unix
+      static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+      memcpy(o, header, 10);
+      o += 10;
+      header_done = true;
+    }
+    for (size_t b = 0; b < blocks.size(); b++) {
+      memcpy(o, blocks[b].out, blocks[b].out_len);
+      o += blocks[b].out_len;
+      crc = crc32_combine(crc, blocks[b].crc, blocks[b].in_len);
+      isize += blocks[b].in_len;
+    }
+    if (finish) {
+      PutLE32(o, crc);
+      PutLE32(o + 4, isize);
+    }
+    *out_len = size;
+
+    // keep the 32K the next block must be primed with, and whatever did not fill a block
+    if (!finish && blocks.size() > 0) {
+      window_len = roll.size();
+      memcpy(window, roll.data(), window_len);
+    }
+    if (flush == Z_FULL_FLUSH) {
+      // the next block must not refer back past the flush
+      window_len = 0;
+    }
+    if (blocks.size() > 0 && blocks[0].in == pending) {
+      pending_len = 0;
+    }
+    if (!finish && data_len > 0) {
+      memcpy(pending + pending_len, data, data_len);
+      pending_len += data_len;
+    }
+    FreeBlocks(blocks);
+    return Z_OK;
+  }
+
+private:
+  struct Block {
+    Block(const char* in, int in_len)
+      : in(in), in_len(in_len), dict(NULL), dict_len(0), last(false),
+        out(NULL), out_len(0), crc(0), ret(Z_OK) { }
+    const char* in;
+    int in_len;
+    const char* dict;
+    int dict_len;
+    bool last;
+    char* out;
+    int out_len;
+    uLong crc;
+    int ret;
+  };
+
+  static void PutLE32(unsigned char* p, uLong v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+  }
+
+  static void FreeBlocks(std::vector<Block>& blocks) {
+    for (size_t b = 0; b < blocks.size(); b++) {
+      free(blocks[b].out);
+    }
+  }
+
+  /* runs on a worker thread */
+  static void DeflateBlock(void* arg, int i) {
+    ParallelGzip* self = static_cast<ParallelGzip*>(arg);
+    Block& b = self->current[i];
+    b.crc = Crc32(crc32(0L, Z_NULL, 0), (const Bytef*)b.in, b.in_len);
+
+    z_stream strm;
+    strm.zalloc = ZMemory::Alloc;
+    strm.zfree = ZMemory::Free;
+    strm.opaque = Z_NULL;
+    // negative windowBits for a raw deflate stream, framing is done by hand
+    b.ret = deflateInit2(&strm, self->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (b.ret != Z_OK) {
+      return;
+    }
+    if (b.dict_len > 0) {
+      deflateSetDictionary(&strm, (const Bytef*)b.dict, b.dict_len);
+    }
+    // room for the worst case plus the sync flush marker
+    int size = deflateBound(&strm, b.in_len) + 16;
+    b.out = (char *)malloc(size);
+    if (b.out == NULL) {
+      b.ret = Z_MEM_ERROR;
+      deflateEnd(&strm);
+      return;
+    }
+    strm.next_in = (Bytef*)b.in;
+    strm.avail_in = b.in_len;
+    int ret;
+    for (;;) {
+      strm.next_out = (Bytef*)b.out + b.out_len;
+      strm.avail_out = size - b.out_len;
+      ret = deflate(&strm, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+      b.out_len = size - strm.avail_out;
+      if (ret == Z_STREAM_END) {
+        ret = Z_OK;
+        break;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        break;
+      }
+      if (strm.avail_out != 0) {
+        // a sync flush is complete once it leaves room in the output
+        ret = b.last ? Z_STREAM_ERROR : Z_OK;
+        break;
+      }
+      char* temp = (char *)realloc(b.out, size + CHUNK);
+      if (temp == NULL) {
+        ret = Z_MEM_ERROR;
+        break;
+      }
+      b.out = temp;
+      size += CHUNK;
+    }
+    deflateEnd(&strm);
+    b.ret = ret;
+  }
+
+  int level;
+  int threads;
+  int block_size;
+  char* pending;       // input that did not fill a whole block yet
+  int pending_len;
+  char* window;        // last 32K of compressed input, primes the next block
+  int window_len;
+  bool header_done;
+  uLong crc;
+  uLong isize;
+  Block* current;      // blocks of the running Deflate call
+};
+
+class Gzip : public EventEmitter {
+ public:
+  static void Initialize(v8::Handle<v8::Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    t->Inherit(EventEmitter::constructor_template);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", GzipInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflate", GzipDeflate);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", GzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "flush", GzipFlush);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflateAsync", GzipDeflateAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "flushAsync", GzipFlushAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "endAsync", GzipEndAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GzipGetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", GzipDestroy);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflateInto", GzipDeflateInto);
+
+    target->Set(String::NewSymbol("Gzip"), t->GetFunction());
+  }
+
+  int GzipInit(int level, int threads, int block_size, int window_bits, int strategy = Z_DEFAULT_STRATEGY) {
+    Release();
+    // over the memory budget: give up, or go down to one thread, then to smaller hash tables
+    MemoryBudget::Hold hold;
+    int mem_level = 8;
+    bool degraded = false;
+    while (!hold.Admit(threads > 1 ? (int64_t)threads * DEFLATE_MEMORY(MAX_WBITS, 8) + block_size + GZIP_WINDOW
+                                            : DEFLATE_MEMORY(MAX_WBITS, mem_level))) {
+      if (!MemoryBudget::Degrading() || mem_level == 1) {
+        return MemoryBudget::Refuse(Z_MEM_ERROR);
+      }
+      if (threads > 1) {
+        threads = 1;
+      } else {
+        mem_level = mem_level > 4 ? 4 : 1;
+      }
+      degraded = true;
+    }
+    if (degraded) {
+      MemoryBudget::Degraded();
+    }
+    if (threads > 1) {
+      // the blocks get their own raw streams, strm stays unused
+      parallel = new ParallelGzip(level, threads, block_size);
+      stats.Acquire((int64_t)threads * DEFLATE_MEMORY(MAX_WBITS, 8) + block_size + GZIP_WINDOW);
+      return Z_OK;
+    }
+    /* borrow deflate state */
+    int ret;
+    // 16+MAX_WBITS writes a simple gzip header and trailer around the
+    // compressed data, MAX_WBITS a zlib wrapper and -MAX_WBITS nothing
+    key.level = level;
+    key.window_bits = window_bits;
+    key.mem_level = mem_level;
+    key.strategy = strategy;
+    base_level = level;
+    base_strategy = strategy;
+    stored = false;
+    strm = ZStreamPool::Deflate(key, &ret);
+    if (strm) {
+      stats.Acquire(DEFLATE_MEMORY(MAX_WBITS, key.mem_level));
+    }
+    if (strm && ret == Z_OK && !dictionary.empty()) {
+      ret = deflateSetDictionary(strm, (const Bytef*)dictionary.data(), dictionary.size());
+    }
+    return ret;
+  }
+
+  /* hand the stream back to the pool, under the settings it has now */
+  void Release() {
+    delete parallel;
+    parallel = NULL;
+    if (strm) {
+      ZStreamPool::ReleaseDeflate(strm, key);
+      strm = NULL;
+    }
+    stats.Release();
+  }
+
+  const char* Msg() {
+    return strm && strm->msg ? strm->msg : "";
+  }
+
+  int GzipDeflate(char* data, int data_len, char** out, int* out_len) {
+    StatCall call(stats, data_len, out_len);
+    // the call that takes the stream past flushBytes ends in a sync flush
+    int flush = Z_NO_FLUSH;
+    unflushed += data_len;
+    if (flush_bytes > 0 && unflushed >= (uint64_t)flush_bytes) {
+      flush = Z_SYNC_FLUSH;
+      unflushed = 0;
+    }
+    if (parallel) {
+      return parallel->Deflate(data, data_len, flush, out, out_len);
+    }
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    int ret = 0;
+    int cap = 0;
+    // deflateBound covers all of this call's output in one allocation
+    uLong bound = deflateBound(strm, data_len);
+    int hint = bound > INT_MAX ? INT_MAX : (int)bound;
+    uint64_t start = Stats::Now();
+    int in_len = data_len;
+
+    *out = NULL;
+    *out_len = 0;
+    ret = 0;
+
+    while (data_len > 0) {
+      int slice = data_len > chunk ? chunk : data_len;
+      if (detect && slice >= INCOMPRESSIBLE_MIN) {
+        // already compressed or encrypted slices go out as stored blocks
+        stored = SampleEntropy((const unsigned char*)data, slice) > INCOMPRESSIBLE_BITS;
+        stats.Sampled(slice, stored);
+      } else if (detect) {
+        // too small to judge, so a previous verdict must not stick to it
+        stored = false;
+      }
+      int level, strategy;
+      Wanted(&level, &strategy);
+      if (level != key.level || strategy != key.strategy) {
+        ret = Retune(level, strategy, out, &cap, out_len, &call);
+        if (ret != Z_OK) {
+          return ret;
+        }
+      }
+      strm->avail_in = slice;
+
+      strm->next_in = (Bytef*)data;
+      do {
+        if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+          return Z_MEM_ERROR;
+        }
+        strm->avail_out = cap - *out_len;
+        strm->next_out = (Bytef*)*out + *out_len;
+        ret = deflate(strm, data_len <= chunk ? flush : Z_NO_FLUSH);
+        // former assert
+        THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipDeflate.deflate: %d", ret);  /* state not clobbered */
+
+        *out_len = cap - strm->avail_out;
+      } while (strm->avail_out == 0);
+
+      data += chunk;
+      data_len -= chunk;
+    }
+    if (adapt.Enabled()) {
+      adapt.Sample(in_len, *out_len, Stats::Now() - start);
+    }
+    return ret;
+  }
+
+  /* the settings the next slice should go through deflate with */
+  void Wanted(int* level, int* strategy) {
+    if (stored) {
+      *level = Z_NO_COMPRESSION;
+      *strategy = Z_DEFAULT_STRATEGY;
+    } else if (adapt.Enabled()) {
+      *level = adapt.Level();
+      *strategy = adapt.Strategy();
+    } else {
+      *level = base_level;
+      *strategy = base_strategy;
+    }
+  }
+
+  /* move the stream to other settings between slices. deflateParams first
+   * deflates what it has at the old settings, which needs room in the output;
+   * if that still does not do it the old settings stay and the next slice
+   * tries again.
+   */
+  int Retune(int level, int strategy, char** out, int* cap, int* out_len, StatCall* call) {
+    int ret;
+    int tries = 0;
+    strm->avail_in = 0;
+    strm->next_in = NULL;
+    do {
+      if (!GrowOutput(out, cap, *out_len + chunk, chunk, call)) {
+        return Z_MEM_ERROR;
+      }
+      strm->avail_out = *cap - *out_len;
+      strm->next_out = (Bytef*)*out + *out_len;
+      ret = deflateParams(strm, level, strategy);
+      THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipDeflate.deflateParams: %d", ret);
+      *out_len = *cap - strm->avail_out;
+    } while (ret == Z_BUF_ERROR && ++tries < 4);
+    if (ret == Z_OK) {
+      // pooled under these from now on, deflateReset keeps them
+      key.level = level;
+      key.strategy = strategy;
+    }
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+  /* everything deflated so far comes out without ending the stream,
+   * Z_FULL_FLUSH also lets the output after it decode on its own
+   */
+  int GzipFlush(int mode, char** out, int* out_len) {
+    StatCall call(stats, 0, out_len);
+    unflushed = 0;
+    if (parallel) {
+      return parallel->Deflate(NULL, 0, mode, out, out_len);
+    }
+    *out = NULL;
+    *out_len = 0;
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    int ret;
+    int cap = 0;
+    strm->avail_in = 0;
+    strm->next_in = NULL;
+
+    do {
+      if (!GrowOutput(out, &cap, *out_len + chunk, chunk, &call)) {
+        return Z_MEM_ERROR;
+      }
+      strm->avail_out = cap - *out_len;
+      strm->next_out = (Bytef*)*out + *out_len;
+      ret = deflate(strm, mode);
+      THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipFlush.deflate: %d", ret);  /* state not clobbered */
+
+      *out_len = cap - strm->avail_out;
+    } while (strm->avail_out == 0);
+
+    // Z_BUF_ERROR only says there was nothing new to flush
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+  int GzipEnd(char** out, int* out_len) {
+    StatCall call(stats, 0, out_len);
+    if (parallel) {
+      int ret = parallel->Deflate(NULL, 0, Z_FINISH, out, out_len);
+      Release();
+      return ret == Z_OK ? Z_STREAM_END : ret;
+    }
+    if (strm == NULL) {
+      *out = NULL;
+      *out_len = 0;
+      return Z_STREAM_ERROR;
+    }
+    int ret;
+    int cap = 0;
+    int hint = chunk;
+
+    *out = NULL;
+    *out_len = 0;
+    strm->avail_in = 0;
+    strm->next_in = NULL;
+
+    do {
+      if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+        return Z_MEM_ERROR;
+      }
+      strm->avail_out = cap - *out_len;
+      strm->next_out = (Bytef*)*out + *out_len;
+      ret = deflate(strm, Z_FINISH);
+      // former assert
+      THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipEnd.deflate: %d", ret);  /* state not clobbered */
+
+      *out_len = cap - strm->avail_out;
+    } while (strm->avail_out == 0);
+
+    // ret had better be Z_STREAM_END
+    THROWS_IF_NOT_A (ret == Z_STREAM_END, "GzipEnd.deflate: %d != Z_STREAM_END", ret);
+    Release();
+    return ret;
+  }
+
+  /* deflate into memory of the caller's, stops once the input is taken (and
+   * the flush is through) or the output is full. a complete Z_FINISH ends the
+   * stream as GzipEnd does.
+   */
+  int GzipDeflateInto(char* data, int data_len, int flush, char* out, int out_len, int* read, int* written) {
+    *read = 0;
+    *written = 0;
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    uint64_t start = Stats::Now();
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = data_len;
+    strm->next_out = (Bytef*)out;
+    strm->avail_out = out_len;
+    int ret = deflate(strm, flush);
+    THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipDeflateInto.deflate: %d", ret);  /* state not clobbered */
+
+    *read = data_len - strm->avail_in;
+    *written = out_len - strm->avail_out;
+    stats.Call(*read, *written, Stats::Now() - start);
+    if (ret == Z_STREAM_END) {
+      Release();
+      // only deflateInto calls this, on the main thread
+      stats.Report();
+    }
+    // Z_BUF_ERROR only says there was nothing to do
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+  /* runs on a worker thread, see AsyncQueue */
+  void AsyncWork(AsyncRequest* req) {
+    if (req->end) {
+      req->ret = GzipEnd(&req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "gzip end: error(%d) %s", req->ret, Msg());
+    } else if (req->flush) {
+      req->ret = GzipFlush(req->flush, &req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "gzip flush: error(%d) %s", req->ret, Msg());
+    } else {
+      req->ret = GzipDeflate(req->in, req->in_len, &req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "gzip deflate: error(%d) %s", req->ret, Msg());
+    }
+  }
+ protected:
+
+  static Handle<Value> New(const Arguments& args) {
+    HandleScope scope;
+
+    Gzip *gzip = new Gzip();
+    gzip->Wrap(args.This());
+
+    return args.This();
+  }
+
+  /* options: encoding:  string [null] if set output strings, else buffers
+   *          level:     int    [-1]   (compression level)
+   *          threads:   int    [1]    (> 1 deflates blockSize blocks in parallel)
+   *          blockSize: int    [128K] (parallel block size, at least 32K)
+   *          chunkSize: int    [16K]  (input slice, output grows by at least this)
+   *          dictionary: Buffer|string [null] (preset dictionary, see trainDictionary)
+   *          format:    string [gzip]  ('gzip', 'zlib' or 'raw', zlib by default
+   *                                     with a dictionary, gzip can not carry one)
+   *          flushBytes: int   [0]    (sync flush every time this much more input went in)
+   *          priority:  string [normal] ('high', 'normal' or 'low', class of the async calls)
+   *          strategy:  string [default] ('default', 'filtered', 'huffman', 'rle' or 'fixed')
+   *          targetMBps: number [0]   (adapt the level to deflate at least this fast,
+   *                                     level is the strongest it goes)
+   *          targetCpu: number [0]    (adapt the level to keep deflate under this
+   *                                     percent of the wall time)
+   *          adaptWindow: int  [256K] (input between two adaptive decisions)
+   *          detectIncompressible: boolean [true] (slices that sample like compressed
+   *                                     or encrypted data go out as stored blocks)
+   */
+  static Handle<Value> GzipInit(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip init: async calls are still pending");
+    gzip->priority = TASK_NORMAL;
+
+    int level = Z_DEFAULT_COMPRESSION;
+    int threads = 1;
+    int block_size = 128*1024;
+    int window_bits = 0;
+    int strategy = Z_DEFAULT_STRATEGY;
+    double target_mbps = 0;
+    double target_cpu = 0;
+    int adapt_window = 256*1024;
+    gzip->use_buffers = true;
+    gzip->detect = true;
+    gzip->chunk = CHUNK;
+    gzip->dictionary.clear();
+    gzip->flush_bytes = 0;
+    gzip->unflushed = 0;
+    if (args.Length() > 0) {
+      THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
+      Local<Object> options = args[0]->ToObject();
+      Local<Value> enc = options->Get(String::NewSymbol("encoding"));
+      Local<Value> pri = options->Get(String::NewSymbol("priority"));
+      Local<Value> lev = options->Get(String::NewSymbol("level"));
+      Local<Value> thr = options->Get(String::NewSymbol("threads"));
+      Local<Value> bs = options->Get(String::NewSymbol("blockSize"));
+      Local<Value> cs = options->Get(String::NewSymbol("chunkSize"));
+      Local<Value> dict = options->Get(String::NewSymbol("dictionary"));
+      Local<Value> fmt = options->Get(String::NewSymbol("format"));
+      Local<Value> fb = options->Get(String::NewSymbol("flushBytes"));
+      Local<Value> st = options->Get(String::NewSymbol("strategy"));
+      Local<Value> tm = options->Get(String::NewSymbol("targetMBps"));
+      Local<Value> tc = options->Get(String::NewSymbol("targetCpu"));
+      Local<Value> aw = options->Get(String::NewSymbol("adaptWindow"));
+      Local<Value> di = options->Get(String::NewSymbol("detectIncompressible"));
+
+      if ((enc->IsUndefined() || enc->IsNull()) == false) {
+        gzip->encoding = ParseEncoding(enc);
+        gzip->use_buffers = false;
+      }
+      if ((pri->IsUndefined() || pri->IsNull()) == false) {
+        gzip->priority = TaskPriority(pri);
+        THROW_IF_NOT (gzip->priority >= 0, "invalid priority, expected 'high', 'normal' or 'low'");
+      }
+      if ((lev->IsUndefined() || lev->IsNull()) == false) {
+        level = lev->Int32Value();
+        THROW_IF_NOT_A (Z_NO_COMPRESSION <= level && level <= Z_BEST_COMPRESSION,
+                        "invalid compression level: %d", level);
+      }
+      if ((thr->IsUndefined() || thr->IsNull()) == false) {
+        threads = thr->Int32Value();
+        THROW_IF_NOT_A (1 <= threads && threads <= 256, "invalid threads: %d", threads);
+      }
+      if ((bs->IsUndefined() || bs->IsNull()) == false) {
+        block_size = bs->Int32Value();
+        THROW_IF_NOT_A (GZIP_WINDOW <= block_size && block_size <= 64*1024*1024,
+                        "invalid blockSize: %d", block_size);
+      }
+      if ((cs->IsUndefined() || cs->IsNull()) == false) {
+        gzip->chunk = cs->Int32Value();
+        THROW_IF_NOT_A (1024 <= gzip->chunk && gzip->chunk <= 64*1024*1024,
+                        "invalid chunkSize: %d", gzip->chunk);
+      }
+      if ((dict->IsUndefined() || dict->IsNull()) == false) {
+        THROW_IF_NOT (ValueBytes(dict, UTF8, &gzip->dictionary), "invalid dictionary");
+      }
+      if ((fb->IsUndefined() || fb->IsNull()) == false) {
+        gzip->flush_bytes = fb->Int32Value();
+        THROW_IF_NOT_A (gzip->flush_bytes >= 0, "invalid flushBytes: %d", gzip->flush_bytes);
+      }
+      if ((fmt->IsUndefined() || fmt->IsNull()) == false) {
+        window_bits = FormatWindowBits(fmt);
+        THROW_IF_NOT (window_bits != 0, "invalid format, expected 'gzip', 'zlib' or 'raw'");
+      }
+      if ((st->IsUndefined() || st->IsNull()) == false) {
+        strategy = ZStrategy(st);
+        THROW_IF_NOT (strategy >= 0, "invalid strategy, expected 'default', 'filtered', 'huffman', 'rle' or 'fixed'");
+      }
+      if ((tm->IsUndefined() || tm->IsNull()) == false) {
+        target_mbps = tm->NumberValue();
+        THROW_IF_NOT (target_mbps >= 0, "invalid targetMBps");
+      }
+      if ((tc->IsUndefined() || tc->IsNull()) == false) {
+        target_cpu = tc->NumberValue();
+        THROW_IF_NOT (0 <= target_cpu && target_cpu <= 100, "invalid targetCpu, expected a percentage");
+      }
+      if ((aw->IsUndefined() || aw->IsNull()) == false) {
+        adapt_window = aw->Int32Value();
+        THROW_IF_NOT_A (CHUNK <= adapt_window, "invalid adaptWindow: %d", adapt_window);
+      }
+      if ((di->IsUndefined() || di->IsNull()) == false) {
+        gzip->detect = di->BooleanValue();
+      }
+    }
+    if (window_bits == 0) {
+      window_bits = gzip->dictionary.empty() ? 16+MAX_WBITS : MAX_WBITS;
+    }
+    THROW_IF_NOT (window_bits != 16+MAX_WBITS || gzip->dictionary.empty(),
+                  "a dictionary needs format 'zlib' or 'raw'");
+    THROW_IF_NOT (threads == 1 || (window_bits == 16+MAX_WBITS && gzip->dictionary.empty()),
+                  "threads only work with format 'gzip' and no dictionary");
+    THROW_IF_NOT (threads == 1 || strategy == Z_DEFAULT_STRATEGY, "threads only work with the default strategy");
+    bool adaptive = target_mbps > 0 || target_cpu > 0;
+    THROW_IF_NOT (!adaptive || threads == 1, "targetMBps/targetCpu only work with threads 1");
+    THROW_IF_NOT (!adaptive || strategy == Z_DEFAULT_STRATEGY, "targetMBps/targetCpu pick the strategy themselves");
+    // every rung of the ladder compresses, so none of them is at or below level 0
+    THROW_IF_NOT (!adaptive || level != Z_NO_COMPRESSION, "targetMBps/targetCpu need a level above 0");
+    if (adaptive && level == Z_DEFAULT_COMPRESSION) {
+      // the ladder (and the pool key) want the actual level
+      level = 6;
+    }
+    gzip->adapt.Init(level, target_mbps, target_cpu, adapt_window);
+
+    int r = gzip->GzipInit(level, threads, block_size, window_bits, strategy);
+    gzip->stats.Report();
+    return scope.Close(Integer::New(r));
+  }
+
+  static Handle<Value> GzipDeflate(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip deflate: async calls are still pending");
+    std::auto_ptr<BufferWrapper> bw;
+
+    char* buf;
+    ssize_t len;
+    // deflate a buffer or a string?
+    if (Buffer::HasInstance(args[0])) {
+       // buffer
+       Local<Object> buffer = args[0]->ToObject();
+       len = BufferLength(buffer);
+       buf = BufferData(buffer);
+    } else {
+      // string, default encoding is utf8
+      enum encoding enc = args.Length() == 1 ? UTF8 : ParseEncoding(args[1], UTF8);
+      len = DecodeBytes(args[0], enc);
+      THROW_IF_NOT_A (len >= 0, "invalid DecodeBytes result: %zd", len);
+
+      buf = new char[len];
+      bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
+      ssize_t written = DecodeWrite(buf, len, args[0], enc);
+      THROW_IF_NOT_A (written == len, "GzipDeflate.DecodeWrite: %zd != %zd", written, len);
+    }
+
+    char* out;
+    int r, out_size;
+    try {
+      r = gzip->GzipDeflate(buf, len, &out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gzip deflate: error(%d) %s", r, gzip->Msg());
+    THROW_IF_NOT_A (out_size >= 0, "gzip deflate: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, gzip->use_buffers, gzip->encoding));
+  }
+
+  /* flush(['sync' | 'full']), returns the output so far, the stream stays open */
+  static Handle<Value> GzipFlush(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip flush: async calls are still pending");
+    int mode = args.Length() > 0 ? FlushMode(args[0]) : Z_SYNC_FLUSH;
+    THROW_IF_NOT (mode != Z_NO_FLUSH, "invalid flush mode, expected 'sync' or 'full'");
+
+    char* out;
+    int r, out_size;
+    try {
+      r = gzip->GzipFlush(mode, &out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gzip flush: error(%d) %s", r, gzip->Msg());
+    THROW_IF_NOT_A (out_size >= 0, "gzip flush: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, gzip->use_buffers, gzip->encoding));
+  }
+
+  static Handle<Value> GzipEnd(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip end: async calls are still pending");
+
+    char* out;
+    int r, out_size;
+    try {
+      r = gzip->GzipEnd(&out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    gzip->stats.Report();
+    THROW_IF_NOT_A (r >= 0, "gzip end: error(%d) %s", r, gzip->Msg());
+    THROW_IF_NOT_A (out_size >= 0, "gzip end: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, gzip->use_buffers, gzip->encoding));
+  }
+
+  /* deflateAsync(data, [encoding], callback), callback(err, data) */
+  static Handle<Value> GzipDeflateAsync(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 2, "deflateAsync: expected data and a callback");
+
+    // default encoding is utf8
+    enum encoding enc = args.Length() == 2 ? UTF8 : ParseEncoding(args[1], UTF8);
+    AsyncRequest* req = new AsyncRequest();
+    if (!req->SetInput(args[0], enc)) {
+      delete req;
+      return ThrowException(Exception::Error (String::New("deflateAsync: invalid input")));
+    }
+    return scope.Close(AsyncQueue<Gzip>::Queue(gzip, args, req));
+  }
+
+  /* flushAsync([mode], callback), callback(err, data) */
+  static Handle<Value> GzipFlushAsync(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "flushAsync: expected a callback");
+    int mode = args.Length() > 1 ? FlushMode(args[0]) : Z_SYNC_FLUSH;
+    THROW_IF_NOT (mode != Z_NO_FLUSH, "invalid flush mode, expected 'sync' or 'full'");
+
+    AsyncRequest* req = new AsyncRequest();
+    req->flush = mode;
+    return scope.Close(AsyncQueue<Gzip>::Queue(gzip, args, req));
+  }
+
+  /* 'sync' (or undefined) and 'full', Z_NO_FLUSH for anything else */
+  static int FlushMode(Handle<Value> mode) {
+    if (mode->IsUndefined() || mode->IsNull()) {
+      return Z_SYNC_FLUSH;
+    }
+    String::AsciiValue name(mode);
+    if (strcmp(*name, "sync") == 0) {
+      return Z_SYNC_FLUSH;
+    } else if (strcmp(*name, "full") == 0) {
+      return Z_FULL_FLUSH;
+    }
+    return Z_NO_FLUSH;
+  }
+
+  /* endAsync(callback), callback(err, data) */
+  static Handle<Value> GzipEndAsync(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "endAsync: expected a callback");
+
+    AsyncRequest* req = new AsyncRequest();
+    req->end = true;
+    return scope.Close(AsyncQueue<Gzip>::Queue(gzip, args, req));
+  }
+
+  /* deflateInto(input, output, [offset], [mode]) deflates the input Buffer
+   * straight into the output Buffer from offset on, mode is null, 'sync',
+   * 'full' or 'finish'. returns {read, written, more, end}, while more is set
+   * call again with the input not read yet (or an empty Buffer) and the same
+   * mode. a complete 'finish' sets end and ends the stream like end().
+   * flushBytes does not apply.
+   */
+  static Handle<Value> GzipDeflateInto(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip deflateInto: async calls are still pending");
+    THROW_IF_NOT (gzip->parallel == NULL, "gzip deflateInto: not available with threads > 1");
+    char* in;
+    char* out;
+    int in_len, out_len;
+    const char* err = IntoArgs(args, &in, &in_len, &out, &out_len);
+    THROW_IF_NOT_A (err == NULL, "gzip deflateInto: %s", err);
+    int flush = Z_NO_FLUSH;
+    if (args.Length() > 3 && !args[3]->IsUndefined() && !args[3]->IsNull()) {
+      String::AsciiValue name(args[3]);
+      flush = strcmp(*name, "finish") == 0 ? Z_FINISH : FlushMode(args[3]);
+      THROW_IF_NOT (flush != Z_NO_FLUSH, "invalid deflateInto mode, expected 'sync', 'full' or 'finish'");
+    }
+
+    int r, read, written;
+    try {
+      r = gzip->GzipDeflateInto(in, in_len, flush, out, out_len, &read, &written);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gzip deflateInto: error(%d) %s", r, gzip->Msg());
+    bool end = r == Z_STREAM_END;
+    bool more = flush == Z_FINISH ? !end : written == out_len;
+    return scope.Close(IntoResult(read, written, more, end));
+  }
+
+  /* destroy(), give the native state back now rather than whenever the
+   * object is collected. nothing but init() works afterwards
+   */
+  static Handle<Value> GzipDestroy(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gzip->async_head == NULL, "gzip destroy: async calls are still pending");
+    gzip->Release();
+    gzip->stats.Report();
+    return scope.Close(Undefined());
+  }
+
+  /* getStats() this object's counters, see gzbz2.getStats */
+  static Handle<Value> GzipGetStats(const Arguments& args) {
+    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+
+    HandleScope scope;
+    Local<Object> o = gzip->stats.ToObject();
+    if (gzip->adapt.Enabled()) {
+      // where the adaptive level is now
+      o->Set(String::NewSymbol("level"), Integer::New(gzip->key.level));
+      o->Set(String::NewSymbol("strategy"), String::New(ZStrategyName(gzip->key.strategy)));
+      o->Set(String::NewSymbol("switches"), Number::New((double)gzip->adapt.Switches()));
+    }
+    return scope.Close(o);
+  }
+
+  Gzip() : EventEmitter(), strm(NULL), use_buffers(true), encoding(BINARY), chunk(CHUNK),
+    flush_bytes(0), unflushed(0), async_head(NULL), async_tail(NULL), priority(TASK_NORMAL), parallel(NULL),
+    base_level(Z_DEFAULT_COMPRESSION), base_strategy(Z_DEFAULT_STRATEGY), detect(true), stored(false), stats(STATS_GZIP) {
+  }
+
+  ~Gzip() {
+    Release();
+    stats.Report();
+  }
+
+ private:
+
+  z_stream* strm;
+  ZStreamPool::Key key;     // what strm was borrowed with
+  bool use_buffers;
+  enum encoding encoding;
+  int chunk;                // input slice and minimum output growth
+  std::string dictionary;   // preset dictionary, empty for none
+  int flush_bytes;          // flushBytes, 0 for no automatic flushes
+  uint64_t unflushed;       // input since the last flush
+  AsyncRequest* async_head;
+  AsyncRequest* async_tail;
+  int priority;             // TaskClass of the async calls
+  ParallelGzip* parallel;
+  LevelController adapt;    // idle unless targetMBps/targetCpu
+  int base_level;           // the init settings
+  int base_strategy;
+  bool detect;              // detectIncompressible
+  bool stored;              // the last slice checked looked incompressible
+  Stats stats;
+
+  friend class AsyncQueue<Gzip>;
+  friend class FileJob;
+};
+
+/* a place in a gzip stream inflation can be restarted from (as in zlib's
+ * zran example): the first compressed byte of a deflate block, how many bits
+ * of the byte before it belong to the block, and the 32K of output before it.
+ */
+struct AccessPoint {
+  uint64_t out;         // uncompressed offset
+  uint64_t in;          // compressed offset of the first whole byte
+  int bits;             // bits of byte in-1 to prime with, 0-7
+  unsigned int window_len;
+  unsigned char window[GZIP_WINDOW];
+};
+
+#define GZIP_INDEX_MAGIC "GZIX"
+#define GZIP_INDEX_VERSION 1
+#define GZIP_CHECKPOINT_MAGIC "GZCK"
+#define GZIP_CHECKPOINT_VERSION 1
+
+class Gunzip : public EventEmitter {
+ public:
+  static void Initialize(v8::Handle<v8::Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    t->Inherit(EventEmitter::constructor_template);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", GunzipInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflate", GunzipInflate);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", GunzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflateAsync", GunzipInflateAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "endAsync", GunzipEndAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "getIndex", GunzipGetIndex);
+    NODE_SET_PROTOTYPE_METHOD(t, "setIndex", GunzipSetIndex);
+    NODE_SET_PROTOTYPE_METHOD(t, "seek", GunzipSeek);
+    NODE_SET_PROTOTYPE_METHOD(t, "checkpoint", GunzipCheckpoint);
+    NODE_SET_PROTOTYPE_METHOD(t, "restore", GunzipRestore);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GunzipGetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", GunzipDestroy);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflateInto", GunzipInflateInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "read", GunzipRead);
+    NODE_SET_PROTOTYPE_METHOD(t, "pending", GunzipPending);
+
+    target->Set(String::NewSymbol("Gunzip"), t->GetFunction());
+  }
+
+  int GunzipInit(int span, int window_bits, int checkpoint = 0) {
+    index_span = span;
+    index_last = 0;
+    seek_point = NULL;
+    skip = 0;
+    checkpoint_span = checkpoint;
+    ClearCheckpoint();
+    Release();
+    // the window is up to the stream, nothing to degrade to
+    MemoryBudget::Hold hold;
+    if (!hold.Admit(INFLATE_MEMORY(MAX_WBITS))) {
+      return MemoryBudget::Refuse(Z_MEM_ERROR);
+    }
+    /* borrow inflate state */
+    int ret;
+    // 16+MAX_WBITS decodes only the gzip format (no auto-header detection)
+    strm = ZStreamPool::Inflate(window_bits, &ret);
+    if (strm) {
+      stats.Acquire(INFLATE_MEMORY(MAX_WBITS));
+    }
+    if (strm && ret == Z_OK && window_bits < 0 && !dictionary.empty()) {
+      // raw deflate has no header asking for it, the dictionary goes in up front
+      ret = inflateSetDictionary(strm, (const Bytef*)dictionary.data(), dictionary.size());
+    }
+    return ret;
+  }
+
+  /* hand the stream back to the pool */
+  void Release() {
+    if (strm) {
+      ZStreamPool::ReleaseInflate(strm);
+      strm = NULL;
+    }
+    stats.Release();
+    held.clear();
+    held_pos = 0;
+    held_more = false;
+  }
+
+  const char* Msg() {
+    return strm && strm->msg ? strm->msg : "";
+  }
+
+  int GunzipInflate(const char* data, int data_len, char** out, int* out_len) {
+    if (max_output > 0) {
+      return GunzipPull(data, data_len, max_output, out, out_len);
+    }
+    StatCall call(stats, data_len, out_len);
+    int ret = 0;
+    int cap = 0;
+
+    *out = NULL;
+    *out_len = 0;
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    if (at_trailer) {
+      return TakeTrailer(data, data_len);
+    }
+    // stop at every block boundary when indexing or keeping restart points
+    int flush = index_span || checkpoint_span ? Z_BLOCK : Z_NO_FLUSH;
+    // a streaming call can not tell a whole member from the first piece of
+    // one, so the trailer is left to gunzipSync and gunzipBatch
+    int hint = RatioHint(strm->total_in, strm->total_out, data_len, 4.0);
+
+    if (seek_point && data_len > 0) {
+      // first input after a seek, pick up the odd bits of the byte before the block
+      if (seek_point->bits) {
+        ret = inflatePrime(strm, seek_point->bits, (unsigned char)data[0] >> (8 - seek_point->bits));
+        data++;
+        data_len--;
+      }
+      if (ret == Z_OK) {
+        ret = inflateSetDictionary(strm, seek_point->window, seek_point->window_len);
+      }
+      seek_point = NULL;
+      if (ret != Z_OK) {
+        return ret;
+      }
+    }
+
+    while (data_len > 0) {
+      if (data_len > chunk) {
+        strm->avail_in = chunk;
+      } else {
+        strm->avail_in = data_len;
+      }
+
+      strm->next_in = (Bytef*)data;
+
+      do {
+        if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+          return Z_MEM_ERROR;
+        }
+        strm->avail_out = cap - *out_len;
+        strm->next_out = (Bytef*)*out + *out_len;
+        int before = *out_len;
+        ret = inflate(strm, flush);
+        if (ret == Z_NEED_DICT && !dictionary.empty()) {
+          // the zlib header names a preset dictionary, hand ours over and carry on
+          ret = inflateSetDictionary(strm, (const Bytef*)dictionary.data(), dictionary.size());
+          if (ret == Z_OK) {
+            ret = inflate(strm, flush);
+          }
+        }
+        // former assert
+        THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GunzipInflate.inflate: %d", ret);  /* state not clobbered */
+
+        switch (ret) {
+        case Z_NEED_DICT:
+          ret = Z_DATA_ERROR;     /* and fall through */
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+          (void)inflateEnd(strm);
+          return ret;
+        }
+        *out_len = cap - strm->avail_out;
+        if (resumed) {
+          // a raw stream, the crc the trailer is checked against is kept here
+          crc = Crc32(crc, (const Bytef*)*out + before, *out_len - before);
+        }
+        // at the end of a block header, other than the last one's
+        if ((strm->data_type & 128) && !(strm->data_type & 64)) {
+          if (index_span) {
+            AddAccessPoint();
+          }
+          if (checkpoint_span) {
+            MarkRestartPoint();
+          }
+        }
+        if (ret == Z_STREAM_END && resumed) {
+          const char* next = (const char*)strm->next_in;
+          return TakeTrailer(next, data + data_len - next);
+        }
+      } while (strm->avail_out == 0 || (flush == Z_BLOCK && strm->avail_in > 0 && ret != Z_STREAM_END));
+      data += chunk;
+      data_len -= chunk;
+    }
+
+    if (skip > 0 && *out_len > 0) {
+      // drop the output between the access point and the seek offset
+      int drop = skip < (uint64_t)*out_len ? (int)skip : *out_len;
+      memmove(*out, *out + drop, *out_len - drop);
+      *out_len -= drop;
+      skip -= drop;
+    }
+    return ret;
+  }
+
+  /* maxOutput: data joins the input held back from earlier calls, and at most
+   * limit bytes are inflated from it. whatever is left stays held for the next
+   * inflate or read, so one call never takes more than limit bytes of output
+   * whatever the compression ratio.
+   */
+  int GunzipPull(const char* data, int data_len, int limit, char** out, int* out_len) {
+    StatCall call(stats, data_len, out_len);
+    int ret = Z_OK;
+    int cap = 0;
+
+    *out = NULL;
+    *out_len = 0;
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    if (data_len > 0) {
+      // drop what was taken before the held input grows
+      held.erase(0, held_pos);
+      held_pos = 0;
+      held.append(data, data_len);
+    }
+    int hint = RatioHint(strm->total_in, strm->total_out, held.size() - held_pos, 4.0);
+
+    do {
+      if (!GrowOutput(out, &cap, std::min(*out_len + chunk, limit), std::min(hint, limit), &call, limit)) {
+        return Z_MEM_ERROR;
+      }
+      size_t avail = std::min(held.size() - held_pos, (size_t)chunk);
+      strm->next_in = (Bytef*)held.data() + held_pos;
+      strm->avail_in = avail;
+      strm->avail_out = cap - *out_len;
+      strm->next_out = (Bytef*)*out + *out_len;
+      ret = inflate(strm, Z_NO_FLUSH);
+      if (ret == Z_NEED_DICT && !dictionary.empty()) {
+        ret = inflateSetDictionary(strm, (const Bytef*)dictionary.data(), dictionary.size());
+        if (ret == Z_OK) {
+          ret = inflate(strm, Z_NO_FLUSH);
+        }
+      }
+      THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GunzipPull.inflate: %d", ret);  /* state not clobbered */
+
+      switch (ret) {
+      case Z_NEED_DICT:
+        ret = Z_DATA_ERROR;     /* and fall through */
+      case Z_DATA_ERROR:
+      case Z_MEM_ERROR:
+        (void)inflateEnd(strm);
+        return ret;
+      }
+      held_pos += avail - strm->avail_in;
+      *out_len = cap - strm->avail_out;
+      // a full output block may mean zlib has more, even with no input left
+    } while (ret != Z_STREAM_END && *out_len < limit && (held_pos < held.size() || strm->avail_out == 0));
+
+    held_more = ret != Z_STREAM_END && (held_pos < held.size() || strm->avail_out == 0);
+    if (ret == Z_STREAM_END) {
+      // as inflate does, input after the end of the stream is ignored
+      held.clear();
+      held_pos = 0;
+    }
+    // Z_BUF_ERROR only says there was nothing to do
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+  /* inflate into memory of the caller's, stops when either side runs out */
+  int GunzipInflateInto(const char* data, int data_len, char* out, int out_len, int* read, int* written) {
+    *read = 0;
+    *written = 0;
+    if (strm == NULL) {
+      return Z_STREAM_ERROR;
+    }
+    uint64_t start = Stats::Now();
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = data_len;
+    strm->next_out = (Bytef*)out;
+    strm->avail_out = out_len;
+    int ret = inflate(strm, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT && !dictionary.empty()) {
+      ret = inflateSetDictionary(strm, (const Bytef*)dictionary.data(), dictionary.size());
+      if (ret == Z_OK) {
+        ret = inflate(strm, Z_NO_FLUSH);
+      }
+    }
+    THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GunzipInflateInto.inflate: %d", ret);  /* state not clobbered */
+
+    *read = data_len - strm->avail_in;
+    *written = out_len - strm->avail_out;
+    stats.Call(*read, *written, Stats::Now() - start);
+    switch (ret) {
+    case Z_NEED_DICT:
+      ret = Z_DATA_ERROR;     /* and fall through */
+    case Z_DATA_ERROR:
+    case Z_MEM_ERROR:
+      (void)inflateEnd(strm);
+      return ret;
+    }
+    // Z_BUF_ERROR only says there was nothing to do
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+  void AddAccessPoint() {
+    uint64_t out = strm->total_out;
+    if (points.size() > 0 && out - index_last < (uint64_t)index_span) {
+      return;
+    }
+    AccessPoint* point = new AccessPoint();
+    point->out = out;
+    point->in = strm->total_in;
+    point->bits = strm->data_type & 7;
+    point->window_len = GZIP_WINDOW;
+    inflateGetDictionary(strm, point->window, &point->window_len);
+    points.push_back(point);
+    index_last = out;
+  }
+
+  void ClearIndex() {
+    for (size_t i = 0; i < points.size(); i++) {
+      delete points[i];
+    }
+    points.clear();
+    // a pending seek would prime from a freed point (a restored mark is not one of them)
+    if (seek_point != mark) {
+      seek_point = NULL;
+      skip = 0;
+    }
+  }
+
+  /* restart as a raw inflate at the last access point at or before offset,
+   * returns the compressed offset input has to be supplied from
+   */
+  int GunzipSeek(uint64_t offset, uint64_t* in) {
+    size_t p = 0;
+    while (p + 1 < points.size() && points[p+1]->out <= offset) {
+      p++;
+    }
+    AccessPoint* point = points[p];
+    Release();
+    index_span = 0;
+    // the gzip header is long gone, the trailer is not checked
+    int ret;
+    strm = ZStreamPool::Inflate(-MAX_WBITS, &ret);
+    if (strm) {
+      stats.Acquire(INFLATE_MEMORY(MAX_WBITS));
+    }
+    seek_point = point;
+    skip = offset - point->out;
+    *in = point->in - (point->bits ? 1 : 0);
+    return ret;
+  }
+
+  /* checkpoint: the latest block boundary at least checkpoint_span past the last
+   * one becomes the restart point, with the crc of the output before it
+   */
+  void MarkRestartPoint() {
+    uint64_t out = base_out + strm->total_out;
+    if (mark && out - mark->out < (uint64_t)checkpoint_span) {
+      return;
+    }
+    if (mark == NULL) {
+      mark = new AccessPoint();
+    }
+    mark->out = out;
+    mark->in = base_in + strm->total_in;
+    mark->bits = strm->data_type & 7;
+    mark->window_len = GZIP_WINDOW;
+    inflateGetDictionary(strm, mark->window, &mark->window_len);
+    mark_crc = resumed ? crc : strm->adler;
+  }
+
+  void ClearCheckpoint() {
+    delete mark;
+    mark = NULL;
+    resumed = false;
+    at_trailer = false;
+    trailer.clear();
+    base_in = base_out = 0;
+    crc = 0;
+  }
+
+  /* "GZCK", version, out, in, bits, crc, window length and the window
+   * compressed with zlib. all little endian.
+   */
+  bool SerializeCheckpoint(std::string& s) {
+    s = GZIP_CHECKPOINT_MAGIC;
+    uLongf clen = compressBound(mark->window_len);
+    std::string cwin(clen, '\0');
+    if (compress2((Bytef*)&cwin[0], &clen, mark->window, mark->window_len, Z_BEST_COMPRESSION) != Z_OK) {
+      return false;
+    }
+    PutLE(s, GZIP_CHECKPOINT_VERSION, 4);
+    PutLE(s, mark->out, 8);
+    PutLE(s, mark->in, 8);
+    PutLE(s, mark->bits, 1);
+    PutLE(s, mark_crc, 4);
+    PutLE(s, mark->window_len, 4);
+    PutLE(s, clen, 4);
+    s.append(cwin, 0, clen);
+    return true;
+  }
+
+  /* carry on from a checkpoint as a raw inflate, the output crc is kept here
+   * and checked against the trailer. returns the compressed offset input has
+   * to be supplied from, Z_DATA_ERROR for a blob that is not a checkpoint and
+   * Z_MEM_ERROR if the new stream does not fit the memory budget
+   */
+  int GunzipRestore(const unsigned char* p, size_t len, uint64_t* in) {
+    if (len < 37 || memcmp(p, GZIP_CHECKPOINT_MAGIC, 4) != 0 || GetLE(p + 4, 4) != GZIP_CHECKPOINT_VERSION) {
+      return Z_DATA_ERROR;
+    }
+    AccessPoint* point = new AccessPoint();
+    point->out = GetLE(p + 8, 8);
+    point->in = GetLE(p + 16, 8);
+    point->bits = p[24];
+    uint32_t point_crc = GetLE(p + 25, 4);
+    uint64_t declared = GetLE(p + 29, 4);
+    uLongf wlen = GZIP_WINDOW;
+    uLong clen = GetLE(p + 33, 4);
+    // a blob is untrusted input: the window is the last 32K of output, or
+    // all of it when there is less, and a bit offset needs the byte before
+    if (point->bits > 7 || (point->bits && point->in == 0) ||
+        (declared != GZIP_WINDOW && declared != point->out) || len - 37 < clen ||
+        uncompress(point->window, &wlen, p + 37, clen) != Z_OK || wlen != declared) {
+      delete point;
+      return Z_DATA_ERROR;
+    }
+    point->window_len = wlen;
+
+    Release();
+    ClearCheckpoint();
+    seek_point = NULL;
+    skip = 0;
+    // a stream of its own, charged as init charges one
+    MemoryBudget::Hold hold;
+    if (!hold.Admit(INFLATE_MEMORY(MAX_WBITS))) {
+      delete point;
+      return MemoryBudget::Refuse(Z_MEM_ERROR);
+    }
+    int ret;
+    strm = ZStreamPool::Inflate(-MAX_WBITS, &ret);
+    if (strm) {
+      stats.Acquire(INFLATE_MEMORY(MAX_WBITS));
+    }
+    mark = point;
+    mark_crc = point_crc;
+    seek_point = point;
+    resumed = true;
+    crc = point_crc;
+    base_in = point->in;
+    base_out = point->out;
+    *in = point->in - (point->bits ? 1 : 0);
+    return ret;
+  }
+
+  /* resumed: the 8 byte trailer after the deflate data, possibly over several
+   * calls. Z_STREAM_END once it matched, Z_OK while it is incomplete
+   */
+  int TakeTrailer(const char* p, int n) {
+    at_trailer = true;
+    int take = n < 8 - (int)trailer.size() ? n : 8 - (int)trailer.size();
+    trailer.append(p, take);
+    if (trailer.size() < 8) {
+      return Z_OK;
+    }
+    const unsigned char* t = (const unsigned char*)trailer.data();
+    uint64_t total = base_out + strm->total_out;
+    if (GetLE(t, 4) != crc || GetLE(t + 4, 4) != (total & 0xffffffffUL)) {
+      return Z_DATA_ERROR;
+    }
+    return Z_STREAM_END;
+  }
+
+  /* "GZIX", version, span, count, then per point: out, in, bits, window length
+   * and the window compressed with zlib. all little endian.
+   */
+  bool SerializeIndex(std::string& s) {
+    s = GZIP_INDEX_MAGIC;
+    PutLE(s, GZIP_INDEX_VERSION, 4);
+    PutLE(s, index_span, 4);
+    PutLE(s, points.size(), 4);
+    for (size_t i = 0; i < points.size(); i++) {
+      AccessPoint* point = points[i];
+      uLongf clen = compressBound(point->window_len);
+      std::string cwin(clen, '\0');
+      if (compress2((Bytef*)&cwin[0], &clen, point->window, point->window_len, Z_BEST_COMPRESSION) != Z_OK) {
+        return false;
+      }
+      PutLE(s, point->out, 8);
+      PutLE(s, point->in, 8);
+      PutLE(s, point->bits, 1);
+      PutLE(s, point->window_len, 4);
+      PutLE(s, clen, 4);
+      s.append(cwin, 0, clen);
+    }
+    return true;
+  }
+
+  bool ParseIndex(const unsigned char* p, size_t len) {
+    ClearIndex();
+    if (len < 16 || memcmp(p, GZIP_INDEX_MAGIC, 4) != 0 || GetLE(p + 4, 4) != GZIP_INDEX_VERSION) {
+      return false;
+    }
+    uint64_t count = GetLE(p + 12, 4);
+    size_t off = 16;
+    for (uint64_t i = 0; i < count; i++) {
+      if (len - off < 25) {
+        ClearIndex();
+        return false;
+      }
+      AccessPoint* point = new AccessPoint();
+      points.push_back(point);
+      point->out = GetLE(p + off, 8);
+      point->in = GetLE(p + off + 8, 8);
+      point->bits = p[off + 16];
+      uLongf wlen = GetLE(p + off + 17, 4);
+      uLong clen = GetLE(p + off + 21, 4);
+      off += 25;
+      if (point->bits > 7 || wlen > GZIP_WINDOW || len - off < clen ||
+          uncompress(point->window, &wlen, p + off, clen) != Z_OK) {
+        ClearIndex();
+        return false;
+      }
+      point->window_len = wlen;
+      off += clen;
+      // access points are recorded in stream order from the first block at
+      // offset 0, a bit offset needs the byte before it: anything else is corrupt
+      if ((i == 0 && point->out != 0) || (point->bits && point->in == 0) ||
+          (i > 0 && (point->out <= points[i-1]->out || point->in <= points[i-1]->in))) {
+        ClearIndex();
+        return false;
+      }
+    }
+    return points.size() > 0;
+  }
+
+  /* input maxOutput held back and read() never took is reported, not
+   * dropped silently; the stream goes back to the pool either way
+   */
+  void GunzipEnd() {
+    bool undrained = held_more || held_pos < held.size();
+    Release();
+    if (undrained) {
+      throw std::string("gunzip end: input held back by maxOutput was not read()");
+    }
+  }
+
+  /* runs on a worker thread, see AsyncQueue */
+  void AsyncWork(AsyncRequest* req) {
+    if (req->end) {
+      GunzipEnd();
+    } else {
+      req->ret = GunzipInflate(req->in, req->in_len, &req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "gunzip inflate: error(%d) %s", req->ret, Msg());
+    }
+  }
+ protected:
+
+  static Handle<Value> New(const Arguments& args) {
+    HandleScope scope;
+
+    Gunzip *gunzip = new Gunzip();
+    gunzip->Wrap(args.This());
+
+    return args.This();
+  }
+
+  /* options: encoding: string [null], if set output strings, else buffers
+   *          index:    int    [0], record an access point about every index
+   *                             bytes of output, see getIndex
+   *          chunkSize: int   [16K], input slice, output grows by at least this
+   *          dictionary: Buffer|string [null], preset dictionary used by the deflater
+   *          format:   string [gzip], 'gzip', 'zlib' or 'raw', zlib by default
+   *                             with a dictionary
+   *          maxOutput: int   [0], if set inflate returns at most this many bytes
+   *                             and holds the rest of the input back, see read
+   *          checkpoint: int  [0], keep a restart point about every checkpoint
+   *                             bytes of output, see checkpoint (format gzip only)
+   *          priority: string [normal], 'high', 'normal' or 'low', class of the async calls
+   */
+  static Handle<Value> GunzipInit(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip init: async calls are still pending");
+    gunzip->priority = TASK_NORMAL;
+
+    int span = 0;
+    int window_bits = 0;
+    int checkpoint = 0;
+    gunzip->use_buffers = true;
+    gunzip->chunk = CHUNK;
+    gunzip->max_output = 0;
+    gunzip->dictionary.clear();
+    if (args.Length() > 0) {
+      THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
+      Local<Object> options = args[0]->ToObject();
+      Local<Value> enc = options->Get(String::NewSymbol("encoding"));
+      Local<Value> pri = options->Get(String::NewSymbol("priority"));
+      Local<Value> idx = options->Get(String::NewSymbol("index"));
+      Local<Value> cs = options->Get(String::NewSymbol("chunkSize"));
+      Local<Value> dict = options->Get(String::NewSymbol("dictionary"));
+      Local<Value> fmt = options->Get(String::NewSymbol("format"));
+      Local<Value> mo = options->Get(String::NewSymbol("maxOutput"));
+      Local<Value> ck = options->Get(String::NewSymbol("checkpoint"));
+
+      if ((enc->IsUndefined() || enc->IsNull()) == false) {
+        gunzip->encoding = ParseEncoding(enc);
+        gunzip->use_buffers = false;
+      }
+      if ((pri->IsUndefined() || pri->IsNull()) == false) {
+        gunzip->priority = TaskPriority(pri);
+        THROW_IF_NOT (gunzip->priority >= 0, "invalid priority, expected 'high', 'normal' or 'low'");
+      }
+      if ((mo->IsUndefined() || mo->IsNull()) == false) {
+        gunzip->max_output = mo->Int32Value();
+        THROW_IF_NOT_A (gunzip->max_output >= 0, "invalid maxOutput: %d", gunzip->max_output);
+      }
+      if ((idx->IsUndefined() || idx->IsNull()) == false) {
+        span = idx->Int32Value();
+        THROW_IF_NOT_A (span >= 0, "invalid index span: %d", span);
+        THROW_IF_NOT (span == 0 || gunzip->max_output == 0, "index and maxOutput can not be combined");
+      }
+      if ((cs->IsUndefined() || cs->IsNull()) == false) {
+        gunzip->chunk = cs->Int32Value();
+        THROW_IF_NOT_A (1024 <= gunzip->chunk && gunzip->chunk <= 64*1024*1024,
+                        "invalid chunkSize: %d", gunzip->chunk);
+      }
+      if ((dict->IsUndefined() || dict->IsNull()) == false) {
+        THROW_IF_NOT (ValueBytes(dict, UTF8, &gunzip->dictionary), "invalid dictionary");
+      }
+      if ((fmt->IsUndefined() || fmt->IsNull()) == false) {
+        window_bits = FormatWindowBits(fmt);
+        THROW_IF_NOT (window_bits != 0, "invalid format, expected 'gzip', 'zlib' or 'raw'");
+      }
+      if ((ck->IsUndefined() || ck->IsNull()) == false) {
+        checkpoint = ck->Int32Value();
+        THROW_IF_NOT_A (checkpoint >= 0, "invalid checkpoint span: %d", checkpoint);
+        THROW_IF_NOT (checkpoint == 0 || (span == 0 && gunzip->max_output == 0),
+                      "checkpoint can not be combined with index or maxOutput");
+      }
+    }
+    if (window_bits == 0) {
+      window_bits = gunzip->dictionary.empty() ? 16+MAX_WBITS : MAX_WBITS;
+    }
+    THROW_IF_NOT (checkpoint == 0 || window_bits == 16+MAX_WBITS, "checkpoint needs format 'gzip'");
+
+    if (span > 0) {
+      gunzip->ClearIndex();
+    }
+    int r = gunzip->GunzipInit(span, window_bits, checkpoint);
+    gunzip->stats.Report();
+    return scope.Close(Integer::New(r));
+  }
+
+  static Handle<Value> GunzipInflate(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip inflate: async calls are still pending");
+    std::auto_ptr<BufferWrapper> bw;
+
+    char* buf;
+    ssize_t len;
+    // inflate a buffer or a binary string?
+    if (Buffer::HasInstance(args[0])) {
+       // buffer
+       Local<Object> buffer = args[0]->ToObject();
+       len = BufferLength(buffer);
+       buf = BufferData(buffer);
+    } else {
+      // string, default encoding is binary. this is much worse than using a buffer
+      enum encoding enc = args.Length() == 1 ? BINARY : ParseEncoding(args[1], BINARY);
+      len = DecodeBytes(args[0], enc);
+      THROW_IF_NOT_A (len >= 0, "invalid DecodeBytes result: %zd", len);
+
+      buf = new char[len];
+      bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
+      ssize_t written = DecodeWrite(buf, len, args[0], enc);
+      THROW_IF_NOT_A (written == len, "GunzipInflate.DecodeWrite: %zd != %zd", written, len);
+    }
+
+    char* out;
+    int r, out_size;
+    try {
+      r = gunzip->GunzipInflate(buf, len, &out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gunzip inflate: error(%d) %s", r, gunzip->Msg());
+    THROW_IF_NOT_A (out_size >= 0, "gunzip inflate: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, gunzip->use_buffers, gunzip->encoding));
+  }
+
+  static Handle<Value> GunzipEnd(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip end: async calls are still pending");
+    try {
+      gunzip->GunzipEnd();
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    gunzip->stats.Report();
+    return scope.Close(Undefined());
+  }
+
+  /* inflateAsync(data, [encoding], callback), callback(err, data) */
+  static Handle<Value> GunzipInflateAsync(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 2, "inflateAsync: expected data and a callback");
+
+    // default encoding is binary
+    enum encoding enc = args.Length() == 2 ? BINARY : ParseEncoding(args[1], BINARY);
+    AsyncRequest* req = new AsyncRequest();
+    if (!req->SetInput(args[0], enc)) {
+      delete req;
+      return ThrowException(Exception::Error (String::New("inflateAsync: invalid input")));
+    }
+    return scope.Close(AsyncQueue<Gunzip>::Queue(gunzip, args, req));
+  }
+
+  /* endAsync(callback), callback(err) */
+  static Handle<Value> GunzipEndAsync(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "endAsync: expected a callback");
+
+    AsyncRequest* req = new AsyncRequest();
+    req->end = true;
+    return scope.Close(AsyncQueue<Gunzip>::Queue(gunzip, args, req));
+  }
+
+  /* inflateInto(input, output, [offset]) inflates the input Buffer straight
+   * into the output Buffer from offset on. returns {read, written, more, end},
+   * while more is set call again with the input not read yet (or an empty
+   * Buffer), end is set once the gzip member is complete.
+   */
+  static Handle<Value> GunzipInflateInto(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip inflateInto: async calls are still pending");
+    THROW_IF_NOT (gunzip->index_span == 0 && gunzip->seek_point == NULL && gunzip->skip == 0,
+                  "gunzip inflateInto: not available while indexing or after a seek");
+    THROW_IF_NOT (gunzip->checkpoint_span == 0 && !gunzip->resumed,
+                  "gunzip inflateInto: not available with checkpoints");
+    THROW_IF_NOT (gunzip->held_pos == gunzip->held.size(), "gunzip inflateInto: input is held back, read() it first");
+    char* in;
+    char* out;
+    int in_len, out_len;
+    const char* err = IntoArgs(args, &in, &in_len, &out, &out_len);
+    THROW_IF_NOT_A (err == NULL, "gunzip inflateInto: %s", err);
+
+    int r, read, written;
+    try {
+      r = gunzip->GunzipInflateInto(in, in_len, out, out_len, &read, &written);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gunzip inflateInto: error(%d) %s", r, gunzip->Msg());
+    bool end = r == Z_STREAM_END;
+    return scope.Close(IntoResult(read, written, !end && written == out_len, end));
+  }
+
+  /* read([n]) inflates up to n bytes (default maxOutput) more from the input
+   * held back by inflate, an empty result once it is all through
+   */
+  static Handle<Value> GunzipRead(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip read: async calls are still pending");
+    int n = gunzip->max_output > 0 ? gunzip->max_output : gunzip->chunk;
+    if (args.Length() > 0 && !args[0]->IsUndefined() && !args[0]->IsNull()) {
+      n = args[0]->Int32Value();
+      THROW_IF_NOT_A (n > 0, "gunzip read: invalid size: %d", n);
+    }
+
+    char* out;
+    int r, out_size;
+    try {
+      r = gunzip->GunzipPull(NULL, 0, n, &out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "gunzip read: error(%d) %s", r, gunzip->Msg());
+    return scope.Close(MakeOutput(out, out_size, gunzip->use_buffers, gunzip->encoding));
+  }
+
+  /* pending() {input: compressed bytes held back, more: read() has output to give} */
+  static Handle<Value> GunzipPending(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    Local<Object> o = Object::New();
+    o->Set(String::NewSymbol("input"), Number::New(gunzip->held.size() - gunzip->held_pos));
+    o->Set(String::NewSymbol("more"), Boolean::New(gunzip->held_more));
+    return scope.Close(o);
+  }
+
+  /* destroy(), give the native state back now rather than whenever the
+   * object is collected. nothing but init() works afterwards
+   */
+  static Handle<Value> GunzipDestroy(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip destroy: async calls are still pending");
+    gunzip->Release();
+    gunzip->ClearIndex();
+    gunzip->ClearCheckpoint();
+    gunzip->stats.Report();
+    return scope.Close(Undefined());
+  }
+
+  /* checkpoint() the latest restart point as {state, input, output}, see
+   * CheckpointResult. state is null before the first one, the stream then
+   * has to start over from input 0
+   */
+  static Handle<Value> GunzipCheckpoint(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip checkpoint: async calls are still pending");
+    THROW_IF_NOT (gunzip->checkpoint_span > 0 || gunzip->resumed,
+                  "checkpoint: no restart points, use init({checkpoint: span})");
+    AccessPoint* mark = gunzip->mark;
+    if (mark == NULL) {
+      return scope.Close(CheckpointResult(NULL, 0, 0));
+    }
+    std::string s;
+    THROW_IF_NOT (gunzip->SerializeCheckpoint(s), "checkpoint: out of memory");
+    return scope.Close(CheckpointResult(&s, mark->in - (mark->bits ? 1 : 0), mark->out));
+  }
+
+  /* restore(state) carry on from a checkpoint of this or an earlier process,
+   * returns {input, output}: the compressed offset to inflate from, and the
+   * uncompressed offset the output starts at. init() first, its checkpoint
+   * span carries on.
+   */
+  static Handle<Value> GunzipRestore(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip restore: async calls are still pending");
+    THROW_IF_NOT (args.Length() > 0 && Buffer::HasInstance(args[0]), "restore argument must be a buffer");
+    THROW_IF_NOT (gunzip->index_span == 0 && gunzip->max_output == 0, "restore: not available with index or maxOutput");
+    Local<Object> buffer = args[0]->ToObject();
+    uint64_t in;
+    int r = gunzip->GunzipRestore((const unsigned char*)BufferData(buffer), BufferLength(buffer), &in);
+    THROW_IF_NOT (r != Z_DATA_ERROR, "restore: invalid checkpoint");
+    THROW_IF_NOT (r != Z_MEM_ERROR, "gunzip restore: over the memory budget");
+    THROW_IF_NOT_A (r == Z_OK, "gunzip restore: error(%d)", r);
+    gunzip->stats.Report();
+    return scope.Close(RestoreResult(in, gunzip->base_out));
+  }
+
+  /* getStats() this object's counters, see gzbz2.getStats */
+  static Handle<Value> GunzipGetStats(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    return scope.Close(gunzip->stats.ToObject());
+  }
+
+  /* getIndex() the access points recorded so far (or loaded) as a Buffer */
+  static Handle<Value> GunzipGetIndex(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip getIndex: async calls are still pending");
+    std::string s;
+    THROW_IF_NOT (gunzip->SerializeIndex(s), "getIndex: out of memory");
+    Buffer* b = Buffer::New(s.size());
+    memcpy(BufferData(b), s.data(), s.size());
+    return scope.Close(b->handle_);
+  }
+
+  /* setIndex(buffer) load an index written by getIndex */
+  static Handle<Value> GunzipSetIndex(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip setIndex: async calls are still pending");
+    THROW_IF_NOT (args.Length() > 0 && Buffer::HasInstance(args[0]), "setIndex argument must be a buffer");
+    Local<Object> buffer = args[0]->ToObject();
+    THROW_IF_NOT (gunzip->ParseIndex((const unsigned char*)BufferData(buffer), BufferLength(buffer)),
+                  "setIndex: invalid index");
+    return scope.Close(Integer::New(gunzip->points.size()));
+  }
+
+  /* seek(offset) restart inflation from the access point before the uncompressed
+   * offset, returns the compressed offset to inflate from. output starts at offset.
+   */
+  static Handle<Value> GunzipSeek(const Arguments& args) {
+    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (gunzip->async_head == NULL, "gunzip seek: async calls are still pending");
+    THROW_IF_NOT (args.Length() > 0 && args[0]->IsNumber(), "seek argument must be a number");
+    THROW_IF_NOT (gunzip->points.size() > 0, "seek: no index, use init({index: span}) or setIndex");
+    THROW_IF_NOT (gunzip->max_output == 0, "seek: not available with maxOutput");
+    THROW_IF_NOT (gunzip->checkpoint_span == 0 && !gunzip->resumed, "seek: not available with checkpoints");
+    double offset = args[0]->NumberValue();
+    THROW_IF_NOT (offset >= 0, "seek: negative offset");
+
+    uint64_t in;
+    int r = gunzip->GunzipSeek((uint64_t)offset, &in);
+    THROW_IF_NOT_A (r == Z_OK, "gunzip seek: error(%d)", r);
+    return scope.Close(Number::New((double)in));
+  }
+
+  Gunzip() : EventEmitter(), strm(NULL), use_buffers(true), encoding(BINARY), chunk(CHUNK),
+    async_head(NULL), async_tail(NULL), priority(TASK_NORMAL), index_span(0), index_last(0),
+    seek_point(NULL), skip(0), max_output(0), held_pos(0), held_more(false), checkpoint_span(0),
+    mark(NULL), mark_crc(0), resumed(false), crc(0), base_in(0), base_out(0), at_trailer(false),
+    stats(STATS_GUNZIP) {
+  }
+
+  ~Gunzip() {
+    Release();
+    ClearIndex();
+    ClearCheckpoint();
+    stats.Report();
+  }
+
+ private:
+
+  z_stream* strm;
+  bool use_buffers;
+  enum encoding encoding;
+  int chunk;                // input slice and minimum output growth
+  std::string dictionary;   // preset dictionary, empty for none
+  AsyncRequest* async_head;
+  AsyncRequest* async_tail;
+  int priority;             // TaskClass of the async calls
+  int index_span;                     // 0 when not indexing
+  uint64_t index_last;                // output offset of the last access point
+  std::vector<AccessPoint*> points;
+  AccessPoint* seek_point;            // set by seek until the first inflate
+  uint64_t skip;                      // output still to drop after a seek
+  int max_output;                     // 0, or the most one inflate/read returns
+  std::string held;                   // input held back by maxOutput
+  size_t held_pos;                    // taken from held so far
+  bool held_more;                     // read() has more output to give
+  int checkpoint_span;                // 0, or output between restart points
+  AccessPoint* mark;                  // the restart point checkpoint() returns
+  uint32_t mark_crc;                  // crc of the output before mark
+  bool resumed;                       // restored, a raw inflate from here on
+  uint32_t crc;                       // resumed: crc of all output so far
+  uint64_t base_in;                   // resumed: offsets the raw stream started at
+  uint64_t base_out;
+  bool at_trailer;                    // resumed: the deflate data is done
+  std::string trailer;                // resumed: trailer bytes so far
+  Stats stats;
+
+  friend class AsyncQueue<Gunzip>;
+  friend class FileJob;
+};
+
+/* an item's gzip trailer is not trusted past this ratio, and the shared block
+ * is never bigger than BATCH_MAX_RESERVE. items that need more spill into
+ * blocks of their own as they go.
+ */
+#define BATCH_ROOM_RATIO 16.0
+#define BATCH_MAX_RESERVE (1024*1024*1024)
+
+/* gzipBatch/gunzipBatch: a whole array of small independent payloads in one
+ * native call. a worker borrows one pooled stream and resets it between its
+ * items, and every result is written into one shared block, which then backs
+ * all of the returned Buffers as slices.
+ */
+class ZBatch {
+public:
+  /* gzipBatch(array, [options]), array of Buffers or strings (utf8)
+   * options: level:   int [-1]
+   *          threads: int [1] (> 1 spreads large batches over threads)
+   * returns an array of Buffers, each a complete gzip member
+   */
+  static Handle<Value> GzipBatch(const Arguments& args) {
+    return Run(args, true);
+  }
+
+  /* gunzipBatch(array, [options]), array of Buffers, each one or more gzip members
+   * options: threads: int [1]
+   * returns an array of Buffers
+   */
+  static Handle<Value> GunzipBatch(const Arguments& args) {
+    return Run(args, false);
+  }
+
+private:
+  struct Item {
+    const char* in;
+    int in_len;
+    int64_t out;        // offset of the item's room in the shared block
+    int cap;            // size of that room
+    int out_len;
+    char* spill;        // own block when the output did not fit the room
+    int ret;
+  };
+
+  ZBatch(bool d, int level, int count) : deflating(d), items(count), parts(1), block(NULL) {
+    key.level = level;
+    key.window_bits = 16+MAX_WBITS;
+    key.mem_level = 8;
+    key.strategy = Z_DEFAULT_STRATEGY;
+  }
+
+  ~ZBatch() {
+    for (size_t i = 0; i < items.size(); i++) {
+      free(items[i].spill);
+    }
+    free(block);
+  }
+
+  static Handle<Value> Run(const Arguments& args, bool deflating) {
+    HandleScope scope;
+    const char* name = deflating ? "gzipBatch" : "gunzipBatch";
+
+    THROW_IF_NOT_A (args.Length() >= 1 && args[0]->IsArray(), "%s argument must be an array", name);
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    int level = Z_DEFAULT_COMPRESSION;
+    int threads = 1;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      THROW_IF_NOT_A (args[1]->IsObject(), "%s options must be an object", name);
+      Local<Object> options = args[1]->ToObject();
+      Local<Value> lev = options->Get(String::NewSymbol("level"));
+      Local<Value> thr = options->Get(String::NewSymbol("threads"));
+
+      if ((lev->IsUndefined() || lev->IsNull()) == false) {
+        level = lev->Int32Value();
+        THROW_IF_NOT_A (Z_NO_COMPRESSION <= level && level <= Z_BEST_COMPRESSION,
+                        "invalid compression level: %d", level);
+      }
+      if ((thr->IsUndefined() || thr->IsNull()) == false) {
+        threads = thr->Int32Value();
+        THROW_IF_NOT_A (1 <= threads && threads <= 256, "invalid threads: %d", threads);
+      }
+    }
+
+    uint64_t start = Stats::Now();
+    int count = list->Length();
+    ZBatch batch(deflating, level, count);
+    std::vector<std::string> strings(count);
+    int64_t total_in = 0;
+    int64_t reserve = 0;
+    for (int i = 0; i < count; i++) {
+      Local<Value> v = list->Get(i);
+      Item& it = batch.items[i];
+      if (Buffer::HasInstance(v)) {
+        Local<Object> buffer = v->ToObject();
+        it.in = BufferData(buffer);
+        it.in_len = BufferLength(buffer);
+      } else {
+        THROW_IF_NOT_A (deflating && v->IsString(), "%s: item %d is not a Buffer", name, i);
+        ssize_t len = DecodeBytes(v, UTF8);
+        THROW_IF_NOT_A (len >= 0, "invalid DecodeBytes result: %zd", len);
+        strings[i].resize(len);
+        DecodeWrite(len ? &strings[i][0] : NULL, len, v, UTF8);
+        it.in = strings[i].data();
+        it.in_len = len;
+      }
+      // deflate output fits compressBound plus the bigger gzip wrapper,
+      // inflate output is taken from the gzip trailer, up to BATCH_ROOM_RATIO
+      int64_t room;
+      int exact;
+      if (deflating) {
+        room = compressBound(it.in_len) + 12;
+      } else if ((exact = GzipExactSize(it.in, it.in_len)) > 0) {
+        room = std::min(exact, RatioHint(0, 0, it.in_len, BATCH_ROOM_RATIO));
+      } else {
+        room = RatioHint(0, 0, it.in_len, 4.0);
+      }
+      it.out = reserve;
+      it.cap = room > INT_MAX ? INT_MAX : room;
+      it.out_len = 0;
+      it.spill = NULL;
+      it.ret = Z_OK;
+      reserve += it.cap;
+      total_in += it.in_len;
+      THROW_IF_NOT_A (reserve <= BATCH_MAX_RESERVE, "%s: batch too large, split it up", name);
+    }
+
+    batch.block = (char *)malloc(reserve > 0 ? reserve : 1);
+    THROW_IF_NOT_A (batch.block != NULL, "%s: out of memory", name);
+
+    // a thread only pays off with some 64K of input to work through
+    batch.parts = threads < count ? threads : count;
+    if (batch.parts > 1 + total_in / (64*1024)) {
+      batch.parts = 1 + total_in / (64*1024);
+    }
+    if (count > 0) {
+      ParallelRun::Run(Part, &batch, batch.parts, batch.parts);
+    }
+
+    int64_t total = 0;
+    bool spilled = false;
+    for (int i = 0; i < count; i++) {
+      const Item& it = batch.items[i];
+      THROW_IF_NOT_A (it.ret == Z_OK, "%s: item %d error(%d)", name, i, it.ret);
+      total += it.out_len;
+      spilled = spilled || it.spill != NULL;
+    }
+    THROW_IF_NOT_A (total <= INT_MAX, "%s: output too large", name);
+
+    // pack the results back to back
+    char* packed = spilled ? (char *)malloc(total > 0 ? total : 1) : batch.block;
+    THROW_IF_NOT_A (packed != NULL, "%s: out of memory", name);
+    int64_t pos = 0;
+    for (int i = 0; i < count; i++) {
+      Item& it = batch.items[i];
+      memmove(packed + pos, it.spill ? it.spill : batch.block + it.out, it.out_len);
+      it.out = pos;
+      pos += it.out_len;
+    }
+    if (packed == batch.block) {
+      batch.block = NULL;
+      char* temp = (char *)realloc(packed, total > 0 ? total : 1);
+      if (temp != NULL) {
+        packed = temp;
+      }
+    }
+
+    Local<Object> backing;
+    if (total > 0) {
+      backing = Local<Object>::New(BufferAdopt(packed, total)->handle_);
+    } else {
+      free(packed);
+      backing = Local<Object>::New(Buffer::New(0)->handle_);
+    }
+    // the whole batch counts as one call
+    Stats::Global(deflating ? STATS_GZIP : STATS_GUNZIP)->Call(total_in, total, Stats::Now() - start);
+
+    Local<Function> slice = Local<Function>::Cast(backing->Get(String::NewSymbol("slice")));
+    Local<Array> result = Array::New(count);
+    for (int i = 0; i < count; i++) {
+      const Item& it = batch.items[i];
+      Local<Value> range[2] = { Integer::New((int)it.out), Integer::New((int)it.out + it.out_len) };
+      result->Set(i, slice->Call(backing, 2, range));
+    }
+    return scope.Close(result);
+  }
+
+  /* one contiguous share of the items on one stream */
+  static void Part(void* arg, int part) {
+    ZBatch* batch = static_cast<ZBatch*>(arg);
+    int count = batch->items.size();
+    int first = (int64_t)count * part / batch->parts;
+    int last = (int64_t)count * (part+1) / batch->parts;
+    int ret;
+    z_stream* strm = batch->deflating ? ZStreamPool::Deflate(batch->key, &ret)
+                                      : ZStreamPool::Inflate(16+MAX_WBITS, &ret);
+    for (int i = first; i < last; i++) {
+      Item& it = batch->items[i];
+      if (strm == NULL) {
+        it.ret = ret;
+        continue;
+      }
+      if (i > first) {
+        ret = batch->deflating ? deflateReset(strm) : inflateReset(strm);
+        if (ret != Z_OK) {
+          it.ret = ret;
+          continue;
+        }
+      }
+      it.ret = batch->Process(strm, it);
+    }
+    if (strm != NULL) {
+      if (batch->deflating) {
+        ZStreamPool::ReleaseDeflate(strm, batch->key);
+      } else {
+        ZStreamPool::ReleaseInflate(strm);
+      }
+    }
+  }
+
+  /* the whole item in one go into its room, continuing in a block of its own
+   * if the room turns out too small. gzip members that follow each other are
+   * all inflated, as gunzipSync does
+   */
+  int Process(z_stream* strm, Item& it) {
+    strm->next_in = (Bytef*)it.in;
+    strm->avail_in = it.in_len;
+    strm->next_out = (Bytef*)block + it.out;
+    strm->avail_out = it.cap;
+    int cap = 0;
+    int ret;
+    for (;;) {
+      ret = deflating ? deflate(strm, Z_FINISH) : inflate(strm, Z_FINISH);
+      it.out_len = (it.spill ? cap : it.cap) - strm->avail_out;
+      if ((ret == Z_OK || ret == Z_BUF_ERROR) && strm->avail_out == 0) {
+        bool first = it.spill == NULL;
+        if (!GrowOutput(&it.spill, &cap, it.out_len + CHUNK, it.out_len * 2 + CHUNK)) {
+          return Z_MEM_ERROR;
+        }
+        if (first) {
+          memcpy(it.spill, block + it.out, it.out_len);
+        }
+        strm->next_out = (Bytef*)it.spill + it.out_len;
+        strm->avail_out = cap - it.out_len;
+        continue;
+      }
+      if (deflating || ret != Z_STREAM_END || strm->avail_in == 0) {
+        break;
+      }
+      const unsigned char* p = strm->next_in;
+      if (strm->avail_in < 2 || p[0] != 0x1f || p[1] != 0x8b) {
+        // zero padding after the last member is tolerated, as gzip does
+        const unsigned char* end = p + strm->avail_in;
+        while (p < end && *p == 0) {
+          p++;
+        }
+        return p == end ? Z_OK : Z_DATA_ERROR;
+      }
+      if ((ret = inflateReset(strm)) != Z_OK) {
+        return ret;
+      }
+    }
+    if (ret == Z_STREAM_END) {
+      return Z_OK;
+    }
+    // out of input before the end of the stream
+    return ret == Z_OK || ret == Z_BUF_ERROR ? Z_DATA_ERROR : ret;
+  }
+
+  bool deflating;
+  ZStreamPool::Key key;
+  std::vector<Item> items;
+  int parts;
+  char* block;
+};
+
+/* gzipSync/gunzipSync: a whole buffer in one call and in one pass, without an
+ * object, init or end. the raw deflate/inflate streams are cached per thread
+ * (deflate per level) for the life of the thread and only reset between calls.
+ * the gzip header and trailer are done here so the crc goes through Crc32.
+ */
+class ZSync {
+public:
+  /* gzipSync(data, [options]), data a Buffer or a string (utf8)
+   * options: level:    int    [-1]
+   *          encoding: string [null] if set the output is a string, else a Buffer
+   * returns one complete gzip member
+   */
+  static Handle<Value> GzipSync(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "gzipSync: expected data");
+    int level = Z_DEFAULT_COMPRESSION;
+    bool use_buffers = true;
+    enum encoding enc = BINARY;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      THROW_IF_NOT (args[1]->IsObject(), "gzipSync options must be an object");
+      Local<Object> options = args[1]->ToObject();
+      Local<Value> lev = options->Get(String::NewSymbol("level"));
+      Local<Value> en = options->Get(String::NewSymbol("encoding"));
+
+      if ((lev->IsUndefined() || lev->IsNull()) == false) {
+        level = lev->Int32Value();
+        THROW_IF_NOT_A (Z_NO_COMPRESSION <= level && level <= Z_BEST_COMPRESSION,
+                        "invalid compression level: %d", level);
+      }
+      if ((en->IsUndefined() || en->IsNull()) == false) {
+        enc = ParseEncoding(en);
+        use_buffers = false;
+      }
+    }
+
+    std::string str;
+    const char* in;
+    ssize_t len;
+    if (Buffer::HasInstance(args[0])) {
+      Local<Object> buffer = args[0]->ToObject();
+      in = BufferData(buffer);
+      len = BufferLength(buffer);
+    } else {
+      THROW_IF_NOT (ValueBytes(args[0], UTF8, &str), "gzipSync: invalid input");
+      in = str.data();
+      len = str.size();
+    }
+    THROW_IF_NOT (len <= INT_MAX - 1024, "gzipSync: input too large");
+
+    char* out;
+    int out_len;
+    int r = Deflate(in, len, level, &out, &out_len);
+    if (r != Z_OK) {
+      free(out);
+    }
+    THROW_IF_NOT_A (r == Z_OK, "gzipSync: error(%d)", r);
+    return scope.Close(MakeOutput(out, out_len, use_buffers, enc));
+  }
+
+  /* gunzipSync(data, [options]), data a Buffer or a string (binary) holding one
+   * or more gzip members
+   * options: encoding: string [null] if set the output is a string, else a Buffer
+   */
+  static Handle<Value> GunzipSync(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "gunzipSync: expected data");
+    bool use_buffers = true;
+    enum encoding enc = BINARY;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      THROW_IF_NOT (args[1]->IsObject(), "gunzipSync options must be an object");
+      Local<Value> en = args[1]->ToObject()->Get(String::NewSymbol("encoding"));
+      if ((en->IsUndefined() || en->IsNull()) == false) {
+        enc = ParseEncoding(en);
+        use_buffers = false;
+      }
+    }
+
+    std::string str;
+    const char* in;
+    ssize_t len;
+    if (Buffer::HasInstance(args[0])) {
+      Local<Object> buffer = args[0]->ToObject();
+      in = BufferData(buffer);
+      len = BufferLength(buffer);
+    } else {
+      THROW_IF_NOT (ValueBytes(args[0], BINARY, &str), "gunzipSync: invalid input");
+      in = str.data();
+      len = str.size();
+    }
+    THROW_IF_NOT (len <= INT_MAX, "gunzipSync: input too large");
+
+    char* out;
+    int out_len;
+    int r = Inflate(in, len, &out, &out_len);
+    if (r != Z_OK) {
+      free(out);
+    }
+    THROW_IF_NOT (r != Z_DATA_ERROR, "gunzipSync: invalid or truncated gzip data");
+    THROW_IF_NOT_A (r == Z_OK, "gunzipSync: error(%d)", r);
+    return scope.Close(MakeOutput(out, out_len, use_buffers, enc));
+  }
+
+private:
+  /* header, raw deflate of everything with Z_FINISH, trailer. the output block
+   * is sized by deflateBound so the one deflate call always completes
+   */
+  static int Deflate(const char* in, int in_len, int level, char** out, int* out_len) {
+    StatCall call(*Stats::Global(STATS_GZIP), in_len, out_len);
+    *out = NULL;
+    int ret;
+    z_stream* strm = Deflater(level, &ret);
+    if (strm == NULL) {
+      return ret;
+    }
+    uLong bound = deflateBound(strm, in_len) + 18;
+    int cap = 0;
+    if (bound > INT_MAX || !GrowOutput(out, &cap, bound, bound, &call)) {
+      return Z_MEM_ERROR;
+    }
+    unsigned char* o = (unsigned char *)*out;
+    // magic, deflate, no flags, no mtime, no extra flags, os unix
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    memcpy(o, header, 10);
+
+    strm->next_in = (Bytef*)in;
+    strm->avail_in = in_len;
+    strm->next_out = o + 10;
+    strm->avail_out = cap - 18;
+    ret = deflate(strm, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+      return ret == Z_OK ? Z_BUF_ERROR : ret;
+    }
+    o = strm->next_out;
+    PutLE32(o, Crc32(crc32(0L, Z_NULL, 0), (const unsigned char*)in, in_len));
+    PutLE32(o + 4, in_len);
+    *out_len = (char*)o + 8 - *out;
+    return Z_OK;
+  }
+
+  /* every member in turn, the output is allocated once at the last member's
+   * ISIZE (the whole output for the usual single member) and grows past it only
+   * for more members. the crc and length are checked per member
+   */
+  static int Inflate(const char* in, int in_len, char** out, int* out_len) {
+    StatCall call(*Stats::Global(STATS_GUNZIP), in_len, out_len);
+    *out = NULL;
+    int ret;
+    z_stream* strm = Inflater(&ret);
+    if (strm == NULL) {
+      return ret;
+    }
+    int exact = GzipExactSize(in, in_len);
+    int hint = exact ? exact : RatioHint(0, 0, in_len, 4.0);
+    int step = exact ? 1 : CHUNK;
+    int cap = 0;
+    const unsigned char* p = (const unsigned char*)in;
+    const unsigned char* end = p + in_len;
+    do {
+      int head = HeaderSize(p, end - p);
+      if (head < 0) {
+        return Z_DATA_ERROR;
+      }
+      if (p != (const unsigned char*)in && (ret = inflateReset(strm)) != Z_OK) {
+        return ret;
+      }
+      strm->next_in = (Bytef*)p + head;
+      strm->avail_in = end - p - head;
+      int start = *out_len;
+      do {
+        if (!GrowOutput(out, &cap, *out_len + step, hint, &call)) {
+          return Z_MEM_ERROR;
+        }
+        strm->next_out = (Bytef*)*out + *out_len;
+        strm->avail_out = cap - *out_len;
+        ret = inflate(strm, Z_NO_FLUSH);
+        *out_len = cap - strm->avail_out;
+      } while (ret == Z_OK);
+      if (ret != Z_STREAM_END) {
+        // out of input (Z_BUF_ERROR) before the end of the member is corrupt too
+        return ret == Z_BUF_ERROR || ret == Z_NEED_DICT ? Z_DATA_ERROR : ret;
+      }
+      p = strm->next_in;
+      if (end - p < 8) {
+        return Z_DATA_ERROR;
+      }
+      uLong crc = Crc32(crc32(0L, Z_NULL, 0), (const unsigned char*)*out + start, *out_len - start);
+      if (GetLE32(p) != crc || GetLE32(p + 4) != ((uint32_t)(*out_len - start) & 0xffffffffUL)) {
+        return Z_DATA_ERROR;
+      }
+      p += 8;
+    } while (end - p >= 2 && p[0] == 0x1f && p[1] == 0x8b);
+    // zero padding after the last member is tolerated, as gzip does
+    while (p < end && *p == 0) {
+      p++;
+    }
+    return p == end ? Z_OK : Z_DATA_ERROR;
+  }
+
+  /* this thread's raw deflate stream for level, reset for a new member */
+  static z_stream* Deflater(int level, int* ret) {
+    static __thread z_stream* cached[Z_BEST_COMPRESSION + 2];
+    z_stream*& strm = cached[level + 1];
+    if (strm) {
+      *ret = deflateReset(strm);
+      return *ret == Z_OK ? strm : NULL;
+    }
+    ZStreamPool::Key key;
+    key.level = level;
+    key.window_bits = -MAX_WBITS;
+    key.mem_level = 8;
+    key.strategy = Z_DEFAULT_STRATEGY;
+    strm = ZStreamPool::Deflate(key, ret);
+    if (strm) {
+      Stats::Global(STATS_GZIP)->Contexts(1, DEFLATE_MEMORY(MAX_WBITS, 8));
+    }
+    return strm;
+  }
+
+  /* this thread's raw inflate stream, reset */
+  static z_stream* Inflater(int* ret) {
+    static __thread z_stream* cached;
+    if (cached) {
+      *ret = inflateReset(cached);
+      return *ret == Z_OK ? cached : NULL;
+    }
+    cached = ZStreamPool::Inflate(-MAX_WBITS, ret);
+    if (cached) {
+      Stats::Global(STATS_GUNZIP)->Contexts(1, INFLATE_MEMORY(MAX_WBITS));
+    }
+    return cached;
+  }
+
+  /* length of the gzip member header at p, -1 if there is none */
+  static int HeaderSize(const unsigned char* p, size_t len) {
+    if (len < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xe0)) {
+      return -1;
+    }
+    size_t pos = 10;
+    if (p[3] & 4) {
+      // FEXTRA
+      if (len < pos + 2) {
+        return -1;
+      }
+      pos += 2 + (p[pos] | (p[pos+1] << 8));
+    }
+    for (int flag = 8; flag <= 16; flag <<= 1) {
+      // FNAME and FCOMMENT, zero terminated
+      if (p[3] & flag) {
+        while (pos < len && p[pos] != 0) {
+          pos++;
+        }
+        pos++;
+      }
+    }
+    if (p[3] & 2) {
+      // FHCRC
+      pos += 2;
+    }
+    return pos <= len ? (int)pos : -1;
+  }
+
+  static void PutLE32(unsigned char* p, uLong v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+  }
+
+  static uLong GetLE32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uLong)p[3] << 24);
+  }
+};
+
+/* trainDictionary: a preset dictionary for small payloads built from a sample
+ * corpus. every 8 byte gram is counted once per sample it occurs in, runs of
+ * grams shared by several samples become candidate segments, and the segments
+ * that would save the most are packed in, the best ones at the end where
+ * deflate reaches them with the shortest distances.
+ */
+class DictTrainer {
+public:
+  /* trainDictionary(samples, [size]), samples an array of Buffers or strings
+   * (utf8), size the dictionary size [32K], returns a Buffer
+   */
+  static Handle<Value> Train(const Arguments& args) {
+    HandleScope scope;
+
+    THROW_IF_NOT (args.Length() >= 1 && args[0]->IsArray(),
+                  "trainDictionary argument must be an array of samples");
+    int size = GZIP_WINDOW;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      size = args[1]->Int32Value();
+      THROW_IF_NOT_A (256 <= size && size <= GZIP_WINDOW, "invalid dictionary size: %d", size);
+    }
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    std::vector<std::string> samples(list->Length());
+    for (size_t i = 0; i < samples.size(); i++) {
+      THROW_IF_NOT_A (ValueBytes(list->Get(i), UTF8, &samples[i]), "trainDictionary: invalid sample %d", (int)i);
+    }
+
+    std::string dict = Build(samples, size);
+    char* out = (char *)malloc(dict.size() > 0 ? dict.size() : 1);
+    THROW_IF_NOT (out != NULL, "trainDictionary: out of memory");
+    memcpy(out, dict.data(), dict.size());
+    return scope.Close(MakeOutput(out, dict.size(), true, BINARY));
+  }
+
+  static std::string Build(const std::vector<std::string>& samples, int size) {
+    // document frequency of every gram
+    std::map<uint64_t, Gram> grams;
+    for (size_t i = 0; i < samples.size(); i++) {
+      const std::string& s = samples[i];
+      for (size_t p = 0; p + GRAM <= s.size(); p++) {
+        Gram& g = grams[Hash(s.data() + p)];
+        if (g.count == 0 || g.sample != i) {
+          g.count++;
+          g.sample = i;
+        }
+      }
+    }
+
+    // maximal runs of shared grams, scored by the bytes they would save
+    std::map<std::string, uint64_t> segments;
+    for (size_t i = 0; i < samples.size(); i++) {
+      const std::string& s = samples[i];
+      size_t start = 0;
+      uint64_t score = 0;
+      bool in_run = false;
+      for (size_t p = 0; p + GRAM <= s.size() + 1; p++) {
+        int count = p + GRAM <= s.size() ? grams[Hash(s.data() + p)].count : 0;
+        if (count > 1) {
+          if (!in_run) {
+            start = p;
+            score = 0;
+            in_run = true;
+          }
+          score += count - 1;
+        } else if (in_run) {
+          uint64_t& best = segments[s.substr(start, p - 1 + GRAM - start)];
+          if (score > best) {
+            best = score;
+          }
+          in_run = false;
+        }
+      }
+    }
+
+    std::vector<std::pair<uint64_t, std::string> > ranked;
+    for (std::map<std::string, uint64_t>::iterator it = segments.begin(); it != segments.end(); ++it) {
+      ranked.push_back(std::make_pair(it->second, it->first));
+    }
+    std::sort(ranked.begin(), ranked.end(), Better);
+
+    // best first, skipping what the dictionary already contains
+    std::vector<const std::string*> chosen;
+    std::string seen;
+    size_t used = 0;
+    for (size_t i = 0; i < ranked.size() && used < (size_t)size; i++) {
+      const std::string& seg = ranked[i].second;
+      if (seen.find(seg) != std::string::npos) {
+        continue;
+      }
+      chosen.push_back(&seg);
+      seen += seg;
+      seen += '\0';
+      used += seg.size();
+    }
+
+    // the best segment goes last, the least useful one gets cut at the front
+    std::string dict;
+    for (size_t i = chosen.size(); i-- > 0; ) {
+      dict += *chosen[i];
+    }
+    if (dict.size() < (size_t)size) {
+      // too little shared material, top up with the tail of the corpus
+      std::string tail;
+      for (size_t i = samples.size(); i-- > 0 && dict.size() + tail.size() < (size_t)size; ) {
+        tail.insert(0, samples[i]);
+      }
+      dict.insert(0, tail);
+    }
+    if (dict.size() > (size_t)size) {
+      dict.erase(0, dict.size() - size);
+    }
+    return dict;
+  }
+
+private:
+  static const int GRAM = 8;
+
+  struct Gram {
+    Gram() : count(0), sample(0) { }
+    int count;        // samples the gram occurs in
+    size_t sample;    // last sample it was counted for
+  };
+
+  static uint64_t Hash(const char* p) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < GRAM; i++) {
+      h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  static bool Better(const std::pair<uint64_t, std::string>& a,
+                     const std::pair<uint64_t, std::string>& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  }
+};
+#endif//WITH_GZIP
+
+
+#ifdef  WITH_BZIP
+#define BZIP_BLOCK_MAGIC 0x314159265359ULL
+#define BZIP_EOS_MAGIC   0x177245385090ULL
+
+#define BZIP_CHECKPOINT_MAGIC "BZCK"
+#define BZIP_CHECKPOINT_VERSION 1
+#define BZIP_CHECKPOINT_SIZE 30
+
+#define BZMEM_BLOCKS 8
+
+/* what libbzip2 allocates for a stream, as given in its manual. the block size
+ * of a stream being decompressed is not known up front, the largest is assumed
+ */
+#define BZ_COMPRESS_MEMORY(level) (400*1024 + 8 * (level) * 100000)
+#define BZ_DECOMPRESS_MEMORY(small) (100*1024 + ((small) ? 5 * 900000 / 2 : 4 * 900000))
+/* the most a block can take compressed, from the manual's 1% plus 600 bytes */
+#define BZ_BLOCK_MAX_BYTES(level) ((level) * 101000 + 600)
+
+static uint64_t BzTotal(unsigned int lo32, unsigned int hi32) {
+  return ((uint64_t)hi32 << 32) | lo32;
+}
+
+/* bzip2 has no reset, so instead the few large blocks a stream allocates are
+ * kept around: a BzMemory hands them out again to the next BZ2_bzCompressInit
+ * or BZ2_bzDecompressInit of the same kind, which then skips malloc and the
+ * page faults of fresh memory. idle BzMemorys are pooled per kind (the block
+ * size for compression, normal or small for decompression).
+ */
+class BzMemory {
+public:
+  static BzMemory* Borrow(int kind) {
+    BzMemory* mem = NULL;
+    pthread_mutex_lock(&lock);
+    for (size_t i = pool.size(); i-- > 0; ) {
+      if (pool[i]->kind == kind) {
+        mem = pool[i];
+        pool.erase(pool.begin() + i);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    return mem ? mem : new BzMemory(kind);
+  }
+
+  /* after BZ2_bzCompressEnd/BZ2_bzDecompressEnd, may run on a worker thread */
+  static void Release(BzMemory* mem) {
+    bool kept = false;
+    pthread_mutex_lock(&lock);
+    if (mem->live.empty() && Count(mem->kind) < Limit(mem->kind)) {
+      pool.push_back(mem);
+      kept = true;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!kept) {
+      delete mem;
+    }
+  }
+
+  /* idle memory kept per kind, returns the previous limit */
+  static int SetLimit(bool compressing, int limit) {
+    std::vector<BzMemory*> drop;
+    pthread_mutex_lock(&lock);
+    int* l = compressing ? &compress_limit : &decompress_limit;
+    int prev = *l;
+    *l = limit;
+    for (size_t i = pool.size(); i-- > 0; ) {
+      if (Count(pool[i]->kind) > Limit(pool[i]->kind)) {
+        drop.push_back(pool[i]);
+        pool.erase(pool.begin() + i);
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < drop.size(); i++) {
+      delete drop[i];
+    }
+    return prev;
+  }
+
+  static int CompressKind(int level) {
+    return level;
+  }
+
+  static int DecompressKind(int small) {
+    return small ? -2 : -1;
+  }
+
+  /* bzalloc/bzfree, opaque is the BzMemory */
+  static void* Alloc(void* opaque, int n, int m) {
+    BzMemory* mem = static_cast<BzMemory*>(opaque);
+    int size = n * m;
+    void* p = NULL;
+    for (int i = 0; i < mem->n_idle; i++) {
+      if (mem->idle[i].size == size) {
+        p = mem->idle[i].p;
+        mem->idle[i] = mem->idle[--mem->n_idle];
+        break;
+      }
+    }
+    bool fresh = false;
+    if (p == NULL) {
+      p = malloc(size);
+      fresh = true;
+    }
+    if (p != NULL) {
+      // every live block is tracked, so Free can size (and uncharge) each one
+      Block b = { p, size };
+      mem->live.push_back(b);
+      if (fresh) {
+        MemoryBudget::Charge(size);
+      }
+    }
+    return p;
+  }
+
+  static void Free(void* opaque, void* p) {
+    BzMemory* mem = static_cast<BzMemory*>(opaque);
+    for (size_t i = 0; i < mem->live.size(); i++) {
+      if (mem->live[i].p == p) {
+        if (mem->n_idle < BZMEM_BLOCKS) {
+          mem->idle[mem->n_idle++] = mem->live[i];
+          p = NULL;
+        } else {
+          MemoryBudget::Charge(-mem->live[i].size);
+        }
+        mem->live[i] = mem->live.back();
+        mem->live.pop_back();
+        break;
+      }
+    }
+    free(p);
+  }
+
+private:
+  BzMemory(int kind) : kind(kind), n_idle(0) { }
+
+  ~BzMemory() {
+    for (int i = 0; i < n_idle; i++) {
+      MemoryBudget::Charge(-idle[i].size);
+      free(idle[i].p);
+    }
+  }
+
+  static int Count(int kind) {
+    int n = 0;
+    for (size_t i = 0; i < pool.size(); i++) {
+      if (pool[i]->kind == kind) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  static int Limit(int kind) {
+    return kind > 0 ? compress_limit : decompress_limit;
+  }
+
+  struct Block {
+    void* p;
+    int size;
+  };
+
+  int kind;
+  Block idle[BZMEM_BLOCKS];
+  int n_idle;
+  std::vector<Block> live;    // handed out, a stream takes about four
+
+  static pthread_mutex_t lock;
+  static std::vector<BzMemory*> pool;
+  static int compress_limit;
+  static int decompress_limit;
+};
+
+pthread_mutex_t BzMemory::lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<BzMemory*> BzMemory::pool;
+int BzMemory::compress_limit = 2;
+int BzMemory::decompress_limit = 2;
+
+/* read n (<= 56) bits msb first, starting at bit offset off */
+static uint64_t GetBits(const unsigned char* p, uint64_t off, int n) {
+  uint64_t v = 0;
+  while (n > 0) {
+    int bit = off & 7;
+    int take = 8 - bit < n ? 8 - bit : n;
+    v = (v << take) | ((p[off >> 3] >> (8 - bit - take)) & ((1 << take) - 1));
+    off += take;
+    n -= take;
+  }
+  return v;
+}
+
+/* builds a bit stream msb first, the way bzip2 writes it. whole bytes are
+ * handed out by Take, the odd trailing bits stay behind for the next Put.
+ */
+class BitWriter {
+public:
+  BitWriter() : buf(NULL), size(0), cap(0), acc(0), nacc(0), failed(false) { }
+  ~BitWriter() { free(buf); }
+
+  /* append the low n (<= 56) bits of v */
+  void Put(uint64_t v, int n) {
+    while (n > 0) {
+      int take = 8 - nacc < n ? 8 - nacc : n;
+      acc = (acc << take) | ((v >> (n - take)) & ((1 << take) - 1));
+      nacc += take;
+      n -= take;
+      if (nacc == 8) {
+        PutByte(acc);
+        acc = 0;
+        nacc = 0;
+      }
+    }
+  }
+
+  /* append nbits of src starting at bit offset off */
+  void Copy(const unsigned char* src, uint64_t off, uint64_t nbits) {
+    if (nacc == 0 && (off & 7) == 0) {
+      size_t bytes = nbits >> 3;
+      if (Reserve(bytes)) {
+        memcpy(buf + size, src + (off >> 3), bytes);
+        size += bytes;
+      }
+      off += bytes << 3;
+      nbits -= bytes << 3;
+    }
+    for (; nbits >= 8; off += 8, nbits -= 8) {
+      Put(GetBits(src, off, 8), 8);
+    }
+    Put(GetBits(src, off, nbits), nbits);
+  }
+
+  /* zero pad to a whole byte */
+  void Pad() {
+    if (nacc > 0) {
+      Put(0, 8 - nacc);
+    }
+  }
+
+  /* hand the finished bytes to the caller (malloc'd), returns false on allocation failure */
+  bool Take(char** out, int* out_len) {
+    if (failed) {
+      return false;
+    }
+    *out = buf;
+    *out_len = size;
+    buf = NULL;
+    size = cap = 0;
+    return true;
+  }
+
+private:
+  bool Reserve(size_t n) {
+    if (size + n > cap) {
+      size_t ncap = cap ? cap : CHUNK;
+      while (ncap < size + n) {
+        ncap *= 2;
+      }
+      char* temp = (char *)realloc(buf, ncap);
+      if (temp == NULL) {
+        failed = true;
+        return false;
+      }
+      buf = temp;
+      cap = ncap;
+    }
+    return true;
+  }
+
+  void PutByte(unsigned int b) {
+    if (Reserve(1)) {
+      buf[size++] = (char)b;
+    }
+  }
+
+  char* buf;
+  size_t size;
+  size_t cap;
+  unsigned int acc;
+  int nacc;
+  bool failed;
+};
+
+/* pbzip2 style parallel bzip2. the input is cut into pieces that are sure to
+ * fit one bzip2 block, each is compressed as a stream of its own on a worker
+ * thread and then the block bits are spliced into one standard stream with
+ * the combined crc recomputed from the block crcs.
+ */
+class ParallelBzip {
+public:
+  ParallelBzip(int level, int work, int threads)
+    : level(level), work(work), threads(threads),
+      // bzip2 fills a block with at most 100000*level - 19 bytes after its
+      // initial run length coding, which can grow the input by 5/4
+      piece_size((100000*level - 19 - 256) / 5 * 4),
+      pending(NULL), pending_len(0), header_done(false), combined_crc(0) {
+    pending = (char *)malloc(piece_size);
+  }
+
+  ~ParallelBzip() {
+    free(pending);
+  }
+
+  /* action is BZ_RUN, BZ_FLUSH (which also compresses the partial piece as a
+   * block of its own) or BZ_FINISH
+   */
+  int Deflate(const char* data, int data_len, int action, char** out, int* out_len) {
+    *out = NULL;
+    *out_len = 0;
+    if (pending == NULL) {
+      return BZ_MEM_ERROR;
+    }
+    bool finish = action == BZ_FINISH;
+
+    // top up the buffered partial piece first
+    std::vector<Piece> pieces;
+    if (pending_len > 0) {
+      int take = piece_size - pending_len < data_len ? piece_size - pending_len : data_len;
+      memcpy(pending + pending_len, data, take);
+      pending_len += take;
+      data += take;
+      data_len -= take;
+      if (pending_len == piece_size || action != BZ_RUN) {
+        pieces.push_back(Piece(pending, pending_len));
+      }
+    }
+    while (data_len >= piece_size) {
+      pieces.push_back(Piece(data, piece_size));
+      data += piece_size;
+      data_len -= piece_size;
+    }
+    if (action != BZ_RUN && data_len > 0) {
+      pieces.push_back(Piece(data, data_len));
+      data_len = 0;
+    }
+
+    if (pieces.size() > 0) {
+      current = &pieces[0];
+      ParallelRun::Run(CompressPiece, this, pieces.size(), threads);
+    }
+
+    int ret = finish ? BZ_STREAM_END : BZ_RUN_OK;
+    if (!header_done) {
+      bits.Put('B', 8);
+      bits.Put('Z', 8);
+      bits.Put('h', 8);
+      bits.Put('0' + level, 8);
+      header_done = true;
+    }
+    for (size_t i = 0; i < pieces.size() && ret >= 0; i++) {
+      Piece& p = pieces[i];
+      if (p.ret < 0) {
+        ret = p.ret;
+        break;
+      }
+      // everything between the stream header and the end of stream marker
+      bits.Copy((const unsigned char*)p.out, 32, p.eos_bit - 32);
+      combined_crc = ((combined_crc << 1) | (combined_crc >> 31)) ^ p.crc;
+    }
+    for (size_t i = 0; i < pieces.size(); i++) {
+      free(pieces[i].out);
+    }
+    if (ret < 0) {
+      return ret;
+    }
+    if (finish) {
+      bits.Put(BZIP_EOS_MAGIC, 48);
+      bits.Put(combined_crc, 32);
+      bits.Pad();
+    }
+    if (!bits.Take(out, out_len)) {
+      return BZ_MEM_ERROR;
+    }
+
+    if (pieces.size() > 0 && pieces[0].in == pending) {
+      pending_len = 0;
+    }
+    if (data_len > 0) {
+      memcpy(pending + pending_len, data, data_len);
+      pending_len += data_len;
+    }
+    return ret;
+  }
+
+private:
+  struct Piece {
+    Piece(const char* in, int in_len)
+      : in(in), in_len(in_len), out(NULL), eos_bit(0), crc(0), ret(BZ_OK) { }
+    const char* in;
+    int in_len;
+    char* out;
+    uint64_t eos_bit;   // bit offset of the end of stream marker in out
+    uint32_t crc;       // the crc of its single block
+    int ret;
+  };
+
+  /* runs on a worker thread */
+  static void CompressPiece(void* arg, int i) {
+    ParallelBzip* self = static_cast<ParallelBzip*>(arg);
+    Piece& p = self->current[i];
+
+    BzMemory* mem = BzMemory::Borrow(BzMemory::CompressKind(self->level));
+    bz_stream strm;
+    strm.bzalloc = BzMemory::Alloc;
+    strm.bzfree = BzMemory::Free;
+    strm.opaque = mem;
+    p.ret = BZ2_bzCompressInit(&strm, self->level, 0, self->work);
+    if (p.ret != BZ_OK) {
+      BzMemory::Release(mem);
+      return;
+    }
+    // the documented worst case is 1% plus 600 bytes
+    unsigned int size = p.in_len + p.in_len / 100 + 600;
+    p.out = (char *)malloc(size);
+    if (p.out == NULL) {
+      BZ2_bzCompressEnd(&strm);
+      BzMemory::Release(mem);
+      p.ret = BZ_MEM_ERROR;
+      return;
+    }
+    strm.next_in = (char*)p.in;
+    strm.avail_in = p.in_len;
+    strm.next_out = p.out;
+    strm.avail_out = size;
+    int ret;
+    do {
+      ret = BZ2_bzCompress(&strm, BZ_FINISH);
+    } while (ret == BZ_FINISH_OK && strm.avail_out > 0);
+    unsigned int len = size - strm.avail_out;
+    BZ2_bzCompressEnd(&strm);
+    BzMemory::Release(mem);
+    if (ret != BZ_STREAM_END) {
+      p.ret = ret < 0 ? ret : BZ_OUTBUFF_FULL;
+      return;
+    }
+
+    // the stream ends in the 48 bit marker, the 32 bit crc and up to 7 bits of padding
+    const unsigned char* o = (const unsigned char*)p.out;
+    p.ret = BZ_DATA_ERROR;
+    for (int pad = 0; pad < 8 && len >= 14; pad++) {
+      uint64_t eos = (uint64_t)len * 8 - pad - 80;
+      if (GetBits(o, eos, 48) == BZIP_EOS_MAGIC) {
+        p.eos_bit = eos;
+        p.crc = GetBits(o, 32 + 48, 32);
+        p.ret = BZ_OK;
+        break;
+      }
+    }
+  }
+
+  int level;
+  int work;
+  int threads;
+  int piece_size;
+  char* pending;       // input that did not fill a whole piece yet
+  int pending_len;
+  bool header_done;
+  uint32_t combined_crc;
+  BitWriter bits;
+  Piece* current;      // pieces of the running Deflate call
+};
+
+/* finds the first block or end of stream marker starting in [from, nbits),
+ * returns false if there is none yet
+ */
+static bool FindMagic(const unsigned char* p, uint64_t from, uint64_t nbits, uint64_t* at) {
+  if (from + 48 > nbits) {
+    return false;
+  }
+  const uint64_t mask = (1ULL << 48) - 1;
+  uint64_t w = GetBits(p, from, 48);
+  for (uint64_t pos = from; ; pos++) {
+    if (w == BZIP_BLOCK_MAGIC || w == BZIP_EOS_MAGIC) {
+      *at = pos;
+      return true;
+    }
+    uint64_t next = pos + 48;
+    if (next >= nbits) {
+      return false;
+    }
+    w = ((w << 1) | ((p[next >> 3] >> (7 - (next & 7))) & 1)) & mask;
+  }
+}
+
+/* a guess at what a bzip2 buffer decompresses to. the blocks before the last
+ * are counted full (the block size of the first stream header), the last one
+ * at the ratio of the others, or 4:1 if it is the only one. the initial run
+ * length coding lets a block hold more than its size for long runs, so this
+ * is an estimate and no bound. -1 if data does not start with a stream header
+ */
+static int64_t BzipSizeEstimate(const char* data, int data_len) {
+  const unsigned char* p = (const unsigned char*)data;
+  if (data_len < 14 || memcmp(data, "BZh", 3) != 0 || p[3] < '1' || p[3] > '9') {
+    return -1;
+  }
+  int64_t block = (p[3] - '0') * 100000;
+  uint64_t nbits = (uint64_t)data_len * 8;
+  uint64_t at, pos = 32, first = 0, last = 0, end = nbits;
+  int64_t blocks = 0;
+  while (FindMagic(p, pos, nbits, &at)) {
+    if (GetBits(p, at, 48) == BZIP_BLOCK_MAGIC) {
+      if (blocks++ == 0) {
+        first = at;
+      }
+      last = at;
+      end = nbits;
+    } else if (blocks > 0 && end == nbits) {
+      // the end of stream marker after the last block so far
+      end = at;
+    }
+    pos = at + 48;
+  }
+  if (blocks == 0) {
+    return 0;
+  }
+  double ratio = blocks > 1 ? (double)(blocks - 1) * block * 8 / (last - first) : 4.0;
+  double tail = (end - last) / 8.0 * ratio;
+  return (blocks - 1) * block + (int64_t)(tail < block ? tail : block);
+}
+
+/* RatioHint-style output size for an estimate, 0 for none */
+static int BzipSizeHint(const char* data, int data_len) {
+  int64_t est = BzipSizeEstimate(data, data_len);
+  if (est <= 0) {
+    return 0;
+  }
+  est += est / 8 + 64;
+  return est > INT_MAX ? INT_MAX : (int)est;
+}
+
+/* parallel bzip2 decompression. blocks are found by scanning for the 48 bit
+ * block marker, every block is wrapped up as a single block stream of its own
+ * and decoded on a worker thread. the output is emitted in order and the block
+ * crcs are combined and checked against the end of stream marker.
+ * concatenated streams (as written by pbzip2) are followed as well.
+ */
+class ParallelBunzip {
+public:
+  ParallelBunzip(int small, int threads)
+    : small(small), threads(threads), buf(NULL), len(0), cap(0),
+      in_header(true), pos(0), scan(0), level(0), combined_crc(0), dropped(0), total_out(0) { }
+
+  ~ParallelBunzip() {
+    free(buf);
+  }
+
+  int Inflate(const char* data, int data_len, char** out, int* out_len) {
+    *out = NULL;
+    *out_len = 0;
+    if (len + data_len > cap) {
+      size_t ncap = cap ? cap : CHUNK;
+      while (ncap < len + data_len) {
+        ncap *= 2;
+      }
+      char* temp = (char *)realloc(buf, ncap);
+      if (temp == NULL) {
+        return BZ_MEM_ERROR;
+      }
+      buf = temp;
+      cap = ncap;
+    }
+    memcpy(buf + len, data, data_len);
+    len += data_len;
+
+    const unsigned char* p = (const unsigned char*)buf;
+    uint64_t nbits = (uint64_t)len * 8;
+    int ret = BZ_OK;
+    for (;;) {
+      if (in_header) {
+        if (pos + 32 > nbits) {
+          break;
+        }
+        const unsigned char* h = p + (pos >> 3);
+        if (h[0] != 'B' || h[1] != 'Z' || h[2] != 'h' || h[3] < '1' || h[3] > '9') {
+          return BZ_DATA_ERROR_MAGIC;
+        }
+        level = h[3] - '0';
+        combined_crc = 0;
+        pos += 32;
+        in_header = false;
+      }
+      if (pos + 48 > nbits) {
+        break;
+      }
+      uint64_t magic = GetBits(p, pos, 48);
+      if (magic == BZIP_EOS_MAGIC) {
+        if (pos + 80 > nbits) {
+          break;
+        }
+        // everything up to here has to be out before the crc can be checked
+        uint64_t eos = pos;
+        int r = DecodeReady(out, out_len);
+        if (r < 0) {
+          return r;
+        }
+        if (pos != eos) {
+          // the block before did not end here, the match was inside it
+          continue;
+        }
+        if (GetBits(p, pos + 48, 32) != combined_crc) {
+          return BZ_DATA_ERROR;
+        }
+        // the next stream, if any, starts on a byte boundary
+        pos = (pos + 80 + 7) & ~7ULL;
+        in_header = true;
+        ret = BZ_STREAM_END;
+        continue;
+      }
+      if (magic != BZIP_BLOCK_MAGIC) {
+        return BZ_DATA_ERROR;
+      }
+      uint64_t next;
+      if (!FindMagic(p, scan > pos + 48 ? scan : pos + 48, nbits, &next)) {
+        scan = nbits > 47 ? nbits - 47 : 0;
+        break;
+      }
+      ready.push_back(Block(pos, next));
+      pos = next;
+    }
+
+    if (ready.size() >= (size_t)threads) {
+      int r = DecodeReady(out, out_len);
+      if (r < 0) {
+        return r;
+      }
+    }
+
+    // drop the input that is fully decoded
+    size_t keep = (ready.size() > 0 ? ready[0].start : pos) >> 3;
+    if (keep > 0) {
+      memmove(buf, buf + keep, len - keep);
+      len -= keep;
+      dropped += keep;
+      uint64_t shift = (uint64_t)keep * 8;
+      pos -= shift;
+      scan = scan > shift ? scan - shift : 0;
+      for (size_t i = 0; i < ready.size(); i++) {
+        ready[i].start -= shift;
+        ready[i].end -= shift;
+      }
+    }
+    return ret;
+  }
+
+  /* "BZCK", version, then the restart point: the input bit offset of the
+   * first block (or stream header) not decoded yet, the output offset, whether
+   * a stream header comes next, the block size and the combined crc so far.
+   * *in is the byte to read on from after restoring.
+   */
+  std::string Checkpoint(uint64_t* in, uint64_t* out) {
+    uint64_t bit = dropped * 8 + (ready.size() > 0 ? ready[0].start : pos);
+    std::string s(BZIP_CHECKPOINT_MAGIC);
+    PutLE(s, BZIP_CHECKPOINT_VERSION, 4);
+    PutLE(s, bit, 8);
+    PutLE(s, total_out, 8);
+    PutLE(s, in_header, 1);
+    PutLE(s, level, 1);
+    PutLE(s, combined_crc, 4);
+    *in = bit >> 3;
+    *out = total_out;
+    return s;
+  }
+
+  /* what the decoding threads take, as BunzipInit admits it */
+  int64_t Memory() {
+    return (int64_t)threads * BZ_DECOMPRESS_MEMORY(small);
+  }
+
+  /* carry on from a Checkpoint blob, input is then supplied from *in */
+  bool Restore(const unsigned char* p, size_t n, uint64_t* in, uint64_t* out) {
+    if (n != BZIP_CHECKPOINT_SIZE || memcmp(p, BZIP_CHECKPOINT_MAGIC, 4) != 0 ||
+        GetLE(p + 4, 4) != BZIP_CHECKPOINT_VERSION || p[24] > 1 || p[25] > 9 || (p[24] == 0 && p[25] < 1)) {
+      return false;
+    }
+    uint64_t bit = GetLE(p + 8, 8);
+    for (size_t i = 0; i < ready.size(); i++) {
+      free(ready[i].out);
+    }
+    ready.clear();
+    len = 0;
+    scan = 0;
+    dropped = bit >> 3;
+    pos = bit & 7;
+    total_out = GetLE(p + 16, 8);
+    in_header = p[24] != 0;
+    level = p[25];
+    combined_crc = GetLE(p + 26, 4);
+    *in = dropped;
+    *out = total_out;
+    return !in_header || pos == 0;
+  }
+
+private:
+  struct Block {
+    Block(uint64_t start, uint64_t end) : start(start), end(end), out(NULL), out_len(0), ret(BZ_OK) { }
+    uint64_t start;     // bit offset of the block marker
+    uint64_t end;       // bit offset of the next marker
+    char* out;
+    unsigned int out_len;
+    int ret;
+  };
+
+  /* decode every complete block found so far, appending to out in order. a
+   * last block that fails may just end at a chance match of a marker inside
+   * it: it is held back (pos goes back to its start) and tried again with the
+   * next marker found after that match, up to the largest size a block takes
+   */
+  int DecodeReady(char** out, int* out_len) {
+    if (ready.empty()) {
+      return BZ_OK;
+    }
+    ParallelRun::Run(DecodeJob, this, ready.size(), threads);
+
+    int ret = BZ_OK;
+    for (size_t i = 0; i < ready.size(); i++) {
+      Block& b = ready[i];
+      // a block marker can turn up inside compressed data by chance, such a
+      // block fails to decode and is glued to the one after it
+      while (b.ret < 0 && i + 1 < ready.size()) {
+        free(b.out);
+        b.out = NULL;
+        b.end = ready[i+1].end;
+        free(ready[i+1].out);
+        ready.erase(ready.begin() + i + 1);
+        b.ret = DecodeBlock((const unsigned char*)buf, b.start, b.end, level, small, &b.out, &b.out_len);
+      }
+      if (b.ret < 0 && b.end - b.start <= (uint64_t)BZ_BLOCK_MAX_BYTES(level) * 8) {
+        pos = b.start;
+        scan = b.end + 1;
+        break;
+      }
+      if (b.ret < 0) {
+        ret = b.ret;
+        break;
+      }
+      char* temp = (char *)realloc(*out, *out_len + b.out_len + 1);
+      if (temp == NULL) {
+        ret = BZ_MEM_ERROR;
+        break;
+      }
+      *out = temp;
+      memcpy(*out + *out_len, b.out, b.out_len);
+      *out_len += b.out_len;
+      total_out += b.out_len;
+      uint32_t crc = GetBits((const unsigned char*)buf, b.start + 48, 32);
+      combined_crc = ((combined_crc << 1) | (combined_crc >> 31)) ^ crc;
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+      free(ready[i].out);
+    }
+    ready.clear();
+    return ret;
+  }
+
+  /* runs on a worker thread */
+  static void DecodeJob(void* arg, int i) {
+    ParallelBunzip* self = static_cast<ParallelBunzip*>(arg);
+    Block& b = self->ready[i];
+    b.ret = DecodeBlock((const unsigned char*)self->buf, b.start, b.end, self->level, self->small, &b.out, &b.out_len);
+  }
+
+  /* wrap the block at [start, end) up as a stream of its own, its combined crc
+   * is just the block crc, and decompress that
+   */
+  static int DecodeBlock(const unsigned char* src, uint64_t start, uint64_t end, int level, int small,
+                         char** out, unsigned int* out_len) {
+    *out = NULL;
+    *out_len = 0;
+    BitWriter w;
+    w.Put('B', 8);
+    w.Put('Z', 8);
+    w.Put('h', 8);
+    w.Put('0' + level, 8);
+    w.Copy(src, start, end - start);
+    w.Put(BZIP_EOS_MAGIC, 48);
+    w.Put(GetBits(src, start + 48, 32), 32);
+    w.Pad();
+    char* in;
+    int in_len;
+    if (!w.Take(&in, &in_len)) {
+      return BZ_MEM_ERROR;
+    }
+
+    BzMemory* mem = BzMemory::Borrow(BzMemory::DecompressKind(small));
+    bz_stream strm;
+    strm.bzalloc = BzMemory::Alloc;
+    strm.bzfree = BzMemory::Free;
+    strm.opaque = mem;
+    int ret = BZ2_bzDecompressInit(&strm, 0, small);
+    if (ret != BZ_OK) {
+      BzMemory::Release(mem);
+      free(in);
+      return ret;
+    }
+    strm.next_in = in;
+    strm.avail_in = in_len;
+    unsigned int size = 0;
+    do {
+      if (*out_len == size) {
+        size = size ? size * 2 : 100000 * level;
+        char* temp = (char *)realloc(*out, size);
+        if (temp == NULL) {
+          ret = BZ_MEM_ERROR;
+          break;
+        }
+        *out = temp;
+      }
+      strm.next_out = *out + *out_len;
+      strm.avail_out = size - *out_len;
+      ret = BZ2_bzDecompress(&strm);
+      *out_len = size - strm.avail_out;
+    } while (ret == BZ_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+    BZ2_bzDecompressEnd(&strm);
+    BzMemory::Release(mem);
+    free(in);
+    if (ret == BZ_OK) {
+      // the stream stopped short of its end marker
+      ret = BZ_UNEXPECTED_EOF;
+    }
+    return ret == BZ_STREAM_END ? BZ_OK : ret;
+  }
+
+  int small;
+  int threads;
+  char* buf;           // input from the oldest block not yet decoded
+  size_t len;
+  size_t cap;
+  bool in_header;      // expecting a BZh stream header at pos
+  uint64_t pos;        // bit offset of the next header or marker
+  uint64_t scan;       // where the search for the next marker resumes
+  int level;
+  uint32_t combined_crc;
+  uint64_t dropped;    // input bytes dropped from buf so far
+  uint64_t total_out;
+  std::vector<Block> ready;
+};
+
+class Bzip : public EventEmitter {
  public:
   static void Initialize(v8::Handle<v8::Object> target) {
     HandleScope scope;
@@ -57,66 +5027,169 @@ class Gzip : public EventEmitter {
     t->Inherit(EventEmitter::constructor_template);
     t->InstanceTemplate()->SetInternalFieldCount(1);
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", GzipInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "deflate", GzipDeflate);
-    NODE_SET_PROTOTYPE_METHOD(t, "end", GzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "init", BzipInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflate", BzipDeflate);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", BzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "flush", BzipFlush);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflateAsync", BzipDeflateAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "flushAsync", BzipFlushAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "endAsync", BzipEndAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", BzipGetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", BzipDestroy);
+    NODE_SET_PROTOTYPE_METHOD(t, "deflateInto", BzipDeflateInto);
 
-    target->Set(String::NewSymbol("Gzip"), t->GetFunction());
+    target->Set(String::NewSymbol("Bzip"), t->GetFunction());
   }
 
-  int GzipInit(int level) {
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    // +16 to windowBits to write a simple gzip header and trailer around the
-    // compressed data instead of a zlib wrapper
-    return deflateInit2(&strm, level, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  int BzipInit(int level, int work, int threads) {
+    Release();
+    // over the memory budget: give up, or go down to one thread, then to smaller blocks
+    MemoryBudget::Hold hold;
+    bool degraded = false;
+    while (!hold.Admit(threads > 1 ? (int64_t)threads * BZ_COMPRESS_MEMORY(level)
+                                            : BZ_COMPRESS_MEMORY(level))) {
+      if (!MemoryBudget::Degrading() || (threads == 1 && level == 1)) {
+        return MemoryBudget::Refuse(BZ_MEM_ERROR);
+      }
+      if (threads > 1) {
+        threads = 1;
+      } else {
+        level = level / 2 > 1 ? level / 2 : 1;
+      }
+      degraded = true;
+    }
+    if (degraded) {
+      MemoryBudget::Degraded();
+    }
+    if (threads > 1) {
+      // every piece gets its own stream, strm stays unused
+      parallel = new ParallelBzip(level, work, threads);
+      stats.Acquire((int64_t)threads * BZ_COMPRESS_MEMORY(level));
+      return BZ_OK;
+    }
+    /* allocate deflate state from recycled memory */
+    mem = BzMemory::Borrow(BzMemory::CompressKind(level));
+    strm.bzalloc = BzMemory::Alloc;
+    strm.bzfree = BzMemory::Free;
+    strm.opaque = mem;
+    int ret = BZ2_bzCompressInit(&strm, level, 0, work);
+    if (ret != BZ_OK) {
+      BzMemory::Release(mem);
+      mem = NULL;
+    } else {
+      stats.Acquire(BZ_COMPRESS_MEMORY(level));
+    }
+    return ret;
   }
 
-  int GzipDeflate(char* data, int data_len, char** out, int* out_len) {
+  /* end the stream and hand its memory back */
+  void Release() {
+    delete parallel;
+    parallel = NULL;
+    if (mem) {
+      BZ2_bzCompressEnd(&strm);
+      BzMemory::Release(mem);
+      mem = NULL;
+    }
+    stats.Release();
+  }
+
+  int BzipDeflate(char* data, int data_len, char** out, int* out_len) {
+    StatCall call(stats, data_len, out_len);
+    // the call that takes the stream past flushBytes ends in a flush
+    int action = BZ_RUN;
+    unflushed += data_len;
+    if (flush_bytes > 0 && unflushed >= (uint64_t)flush_bytes) {
+      action = BZ_FLUSH;
+      unflushed = 0;
+    }
+    if (parallel) {
+      return parallel->Deflate(data, data_len, action, out, out_len);
+    }
     int ret = 0;
-    char* temp;
-    int i=1;
+    int cap = 0;
+    // output comes a whole block at a time, the running ratio evens that out
+    int hint = RatioHint(BzTotal(strm.total_in_lo32, strm.total_in_hi32),
+                         BzTotal(strm.total_out_lo32, strm.total_out_hi32), data_len, 0.5);
 
     *out = NULL;
     *out_len = 0;
     ret = 0;
 
     while (data_len > 0) {
-      if (data_len > CHUNK) {
-        strm.avail_in = CHUNK;
+      if (data_len > chunk) {
+        strm.avail_in = chunk;
       } else {
         strm.avail_in = data_len;
       }
 
-      strm.next_in = (Bytef*)data;
+      strm.next_in = (char*)data;
+      // a flush stays on the last slice until bzip2 says it is through
+      int act = data_len <= chunk ? action : BZ_RUN;
       do {
-        temp = (char *)realloc(*out, CHUNK*i +1);
-        if (temp == NULL) {
-          return Z_MEM_ERROR;
+        if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+          return BZ_MEM_ERROR;
         }
-        *out = temp;
-        strm.avail_out = CHUNK;
-        strm.next_out = (Bytef*)*out + *out_len;
-        ret = deflate(&strm, Z_NO_FLUSH);
+        strm.avail_out = cap - *out_len;
+        strm.next_out = (char*)*out + *out_len;
+        ret = BZ2_bzCompress(&strm, act);
         // former assert
-        THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipDeflate.deflate: %d", ret);  /* state not clobbered */
+        THROWS_IF_NOT_A (ret == BZ_RUN_OK || ret == BZ_FLUSH_OK,
+                         "BzipDeflate.BZ2_bzCompress: %d != BZ_RUN_OK", ret);
 
-        *out_len += (CHUNK - strm.avail_out);
-        i++;
-      } while (strm.avail_out == 0);
+        *out_len = cap - strm.avail_out;
+      } while (act == BZ_FLUSH ? ret == BZ_FLUSH_OK : strm.avail_out == 0);
 
-      data += CHUNK;
-      data_len -= CHUNK;
+      data += chunk;
+      data_len -= chunk;
     }
     return ret;
   }
 
-  int GzipEnd(char** out, int* out_len) {
+  /* ends the current block so everything compressed so far comes out, less
+   * the up to 7 bits bzip2 keeps until the next block or the end of stream
+   */
+  int BzipFlush(char** out, int* out_len) {
+    StatCall call(stats, 0, out_len);
+    unflushed = 0;
+    if (parallel) {
+      return parallel->Deflate(NULL, 0, BZ_FLUSH, out, out_len);
+    }
+    *out = NULL;
+    *out_len = 0;
+    if (mem == NULL) {
+      return BZ_SEQUENCE_ERROR;
+    }
+    int ret;
+    int cap = 0;
+    strm.avail_in = 0;
+    strm.next_in = NULL;
+
+    do {
+      if (!GrowOutput(out, &cap, *out_len + chunk, chunk, &call)) {
+        return BZ_MEM_ERROR;
+      }
+      strm.avail_out = cap - *out_len;
+      strm.next_out = (char*)*out + *out_len;
+      ret = BZ2_bzCompress(&strm, BZ_FLUSH);
+      THROWS_IF_NOT_A (ret == BZ_FLUSH_OK || ret == BZ_RUN_OK,
+                       "BzipFlush.BZ2_bzCompress: %d != BZ_FLUSH_OK || BZ_RUN_OK", ret);
+
+      *out_len = cap - strm.avail_out;
+    } while (ret == BZ_FLUSH_OK);
+    return ret;
+  }
+
+  int BzipEnd(char** out, int* out_len) {
+    StatCall call(stats, 0, out_len);
+    if (parallel) {
+      int ret = parallel->Deflate(NULL, 0, BZ_FINISH, out, out_len);
+      Release();
+      return ret;
+    }
     int ret;
-    char* temp;
-    int i = 1;
+    int cap = 0;
+    int hint = chunk;
 
     *out = NULL;
     *out_len = 0;
@@ -124,73 +5197,152 @@ class Gzip : public EventEmitter {
     strm.next_in = NULL;
 
     do {
-      temp = (char *)realloc(*out, CHUNK*i);
-      if (temp == NULL) {
-        return Z_MEM_ERROR;
+      if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+        return BZ_MEM_ERROR;
       }
-      *out = temp;
-      strm.avail_out = CHUNK;
-      strm.next_out = (Bytef*)*out + *out_len;
-      ret = deflate(&strm, Z_FINISH);
+      strm.avail_out = cap - *out_len;
+      strm.next_out = (char*)*out + *out_len;
+      ret = BZ2_bzCompress(&strm, BZ_FINISH);
       // former assert
-      THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GzipEnd.deflate: %d", ret);  /* state not clobbered */
+      THROWS_IF_NOT_A (ret == BZ_FINISH_OK || ret == BZ_STREAM_END,
+                       "BzipEnd.BZ2_bzCompress: %d != BZ_FINISH_OK || BZ_STREAM_END", ret);
 
-      *out_len += (CHUNK - strm.avail_out);
-      i++;
+      *out_len = cap - strm.avail_out;
     } while (strm.avail_out == 0);
 
-    // ret had better be Z_STREAM_END
-    THROWS_IF_NOT_A (ret == Z_STREAM_END, "GzipEnd.deflate: %d != Z_STREAM_END", ret);
-    deflateEnd(&strm);
+    Release();
+    return ret;
+  }
+
+  /* compress into memory of the caller's, stops once the input is taken (and
+   * the flush is through) or the output is full. a complete BZ_FINISH ends the
+   * stream as BzipEnd does.
+   */
+  int BzipDeflateInto(char* data, int data_len, int action, char* out, int out_len, int* read, int* written) {
+    *read = 0;
+    *written = 0;
+    if (mem == NULL) {
+      return BZ_SEQUENCE_ERROR;
+    }
+    uint64_t start = Stats::Now();
+    strm.next_in = data;
+    strm.avail_in = data_len;
+    strm.next_out = out;
+    strm.avail_out = out_len;
+    int ret = BZ2_bzCompress(&strm, action);
+    if (ret == BZ_PARAM_ERROR && action == BZ_RUN) {
+      // BZ_RUN without any progress, nothing to take or no room
+      ret = BZ_RUN_OK;
+    }
+    *read = data_len - strm.avail_in;
+    *written = out_len - strm.avail_out;
+    stats.Call(*read, *written, Stats::Now() - start);
+    if (ret == BZ_STREAM_END) {
+      Release();
+      // only deflateInto calls this, on the main thread
+      stats.Report();
+    }
     return ret;
   }
 
+  /* runs on a worker thread, see AsyncQueue */
+  void AsyncWork(AsyncRequest* req) {
+    if (req->end) {
+      req->ret = BzipEnd(&req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "bzip end: error(%d)", req->ret);
+    } else if (req->flush) {
+      req->ret = BzipFlush(&req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "bzip flush: error(%d)", req->ret);
+    } else {
+      req->ret = BzipDeflate(req->in, req->in_len, &req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "bzip deflate: error(%d)", req->ret);
+    }
+  }
  protected:
 
   static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
 
-    Gzip *gzip = new Gzip();
-    gzip->Wrap(args.This());
+    Bzip *bzip = new Bzip();
+    bzip->Wrap(args.This());
 
     return args.This();
   }
 
-  /* options: encoding: string [null] if set output strings, else buffers
-   *          level:    int    [-1]   (compression level)
+  /* options: encoding:   string [null] if set output strings, else buffers
+   *          level:      int    [1]    (block size in 100K)
+   *          workfactor: int    [30]
+   *          threads:    int    [1]    (> 1 compresses blocks in parallel)
+   *          chunkSize:  int    [16K]  (input slice, output grows by at least this)
+   *          flushBytes: int    [0]    (flush every time this much more input went in)
+   *          priority:   string [normal] ('high', 'normal' or 'low', class of the async calls)
    */
-  static Handle<Value> GzipInit(const Arguments& args) {
-    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+  static Handle<Value> BzipInit(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip init: async calls are still pending");
+    bzip->priority = TASK_NORMAL;
 
-    int level = Z_DEFAULT_COMPRESSION;
-    gzip->use_buffers = true;
+    int level = 1;
+    int work = 30;
+    int threads = 1;
+    bzip->use_buffers = true;
+    bzip->chunk = CHUNK;
+    bzip->flush_bytes = 0;
+    bzip->unflushed = 0;
     if (args.Length() > 0) {
       THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
       Local<Object> options = args[0]->ToObject();
       Local<Value> enc = options->Get(String::NewSymbol("encoding"));
+      Local<Value> pri = options->Get(String::NewSymbol("priority"));
       Local<Value> lev = options->Get(String::NewSymbol("level"));
+      Local<Value> wf = options->Get(String::NewSymbol("workfactor"));
+      Local<Value> thr = options->Get(String::NewSymbol("threads"));
+      Local<Value> cs = options->Get(String::NewSymbol("chunkSize"));
+      Local<Value> fb = options->Get(String::NewSymbol("flushBytes"));
 
       if ((enc->IsUndefined() || enc->IsNull()) == false) {
-        gzip->encoding = ParseEncoding(enc);
-        gzip->use_buffers = false;
+        bzip->encoding = ParseEncoding(enc);
+        bzip->use_buffers = false;
+      }
+      if ((pri->IsUndefined() || pri->IsNull()) == false) {
+        bzip->priority = TaskPriority(pri);
+        THROW_IF_NOT (bzip->priority >= 0, "invalid priority, expected 'high', 'normal' or 'low'");
       }
       if ((lev->IsUndefined() || lev->IsNull()) == false) {
         level = lev->Int32Value();
-        THROW_IF_NOT_A (Z_NO_COMPRESSION <= level && level <= Z_BEST_COMPRESSION,
-                        "invalid compression level: %d", level);
+        THROW_IF_NOT_A (1 <= level && level <= 9, "invalid compression level: %d", level);
+      }
+      if ((wf->IsUndefined() || wf->IsNull()) == false) {
+        work = wf->Int32Value();
+        THROW_IF_NOT_A (0 <= work && work <= 250, "invalid workfactor: %d", work);
+      }
+      if ((thr->IsUndefined() || thr->IsNull()) == false) {
+        threads = thr->Int32Value();
+        THROW_IF_NOT_A (1 <= threads && threads <= 256, "invalid threads: %d", threads);
+      }
+      if ((cs->IsUndefined() || cs->IsNull()) == false) {
+        bzip->chunk = cs->Int32Value();
+        THROW_IF_NOT_A (1024 <= bzip->chunk && bzip->chunk <= 64*1024*1024,
+                        "invalid chunkSize: %d", bzip->chunk);
+      }
+      if ((fb->IsUndefined() || fb->IsNull()) == false) {
+        bzip->flush_bytes = fb->Int32Value();
+        THROW_IF_NOT_A (bzip->flush_bytes >= 0, "invalid flushBytes: %d", bzip->flush_bytes);
       }
     }
 
-    int r = gzip->GzipInit(level);
+    int r = bzip->BzipInit(level, work, threads);
+    bzip->stats.Report();
     return scope.Close(Integer::New(r));
   }
 
-  static Handle<Value> GzipDeflate(const Arguments& args) {
-    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+  static Handle<Value> BzipDeflate(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip deflate: async calls are still pending");
     std::auto_ptr<BufferWrapper> bw;
 
     char* buf;
@@ -210,84 +5362,193 @@ class Gzip : public EventEmitter {
       buf = new char[len];
       bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
       ssize_t written = DecodeWrite(buf, len, args[0], enc);
-      THROW_IF_NOT_A (written == len, "GzipDeflate.DecodeWrite: %zd != %zd", written, len);
+      THROW_IF_NOT_A (written == len, "BzipDeflate.DecodeWrite: %zd != %zd", written, len);
     }
 
     char* out;
     int r, out_size;
     try {
-      r = gzip->GzipDeflate(buf, len, &out, &out_size);
+      r = bzip->BzipDeflate(buf, len, &out, &out_size);
     } catch( const std::string & msg ) {
       return ThrowException(Exception::Error (String::New(msg.c_str())));
     }
-    THROW_IF_NOT_A (r >= 0, "gzip deflate: error(%d) %s", r, gzip->strm.msg);
-    THROW_IF_NOT_A (out_size >= 0, "gzip deflate: negative output size: %d", out_size);
+    THROW_IF_NOT_A (r >= 0, "bzip deflate: error(%d)", r);
+    THROW_IF_NOT_A (out_size >= 0, "bzip deflate: negative output size: %d", out_size);
 
-    if (gzip->use_buffers) {
-      // output compressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
-      }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
-    } else {
-      // output compressed data in a binary string
-      Local<Value> outString = Encode(out, out_size, gzip->encoding);
-      free(out);
-      return scope.Close(outString);
+    return scope.Close(MakeOutput(out, out_size, bzip->use_buffers, bzip->encoding));
+  }
+
+  /* flush(), returns the output so far, the stream stays open */
+  static Handle<Value> BzipFlush(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip flush: async calls are still pending");
+
+    char* out;
+    int r, out_size;
+    try {
+      r = bzip->BzipFlush(&out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
     }
+    THROW_IF_NOT_A (r >= 0, "bzip flush: error(%d)", r);
+    THROW_IF_NOT_A (out_size >= 0, "bzip flush: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, bzip->use_buffers, bzip->encoding));
   }
 
-  static Handle<Value> GzipEnd(const Arguments& args) {
-    Gzip *gzip = ObjectWrap::Unwrap<Gzip>(args.This());
+  static Handle<Value> BzipEnd(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip end: async calls are still pending");
 
     char* out;
     int r, out_size;
     try {
-      r = gzip->GzipEnd(&out, &out_size);
+      r = bzip->BzipEnd(&out, &out_size);
     } catch( const std::string & msg ) {
       return ThrowException(Exception::Error (String::New(msg.c_str())));
     }
-    THROW_IF_NOT_A (r >= 0, "gzip end: error(%d) %s", r, gzip->strm.msg);
-    THROW_IF_NOT_A (out_size >= 0, "gzip end: negative output size: %d", out_size);
+    bzip->stats.Report();
+    THROW_IF_NOT_A (r >= 0, "bzip end: error(%d)", r);
+    THROW_IF_NOT_A (out_size >= 0, "bzip end: negative output size: %d", out_size);
+
+    return scope.Close(MakeOutput(out, out_size, bzip->use_buffers, bzip->encoding));
+  }
+
+  /* deflateAsync(data, [encoding], callback), callback(err, data) */
+  static Handle<Value> BzipDeflateAsync(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 2, "deflateAsync: expected data and a callback");
+
+    // default encoding is utf8
+    enum encoding enc = args.Length() == 2 ? UTF8 : ParseEncoding(args[1], UTF8);
+    AsyncRequest* req = new AsyncRequest();
+    if (!req->SetInput(args[0], enc)) {
+      delete req;
+      return ThrowException(Exception::Error (String::New("deflateAsync: invalid input")));
+    }
+    return scope.Close(AsyncQueue<Bzip>::Queue(bzip, args, req));
+  }
+
+  /* flushAsync(callback), callback(err, data) */
+  static Handle<Value> BzipFlushAsync(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "flushAsync: expected a callback");
+
+    AsyncRequest* req = new AsyncRequest();
+    req->flush = BZ_FLUSH;
+    return scope.Close(AsyncQueue<Bzip>::Queue(bzip, args, req));
+  }
+
+  /* endAsync(callback), callback(err, data) */
+  static Handle<Value> BzipEndAsync(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "endAsync: expected a callback");
+
+    AsyncRequest* req = new AsyncRequest();
+    req->end = true;
+    return scope.Close(AsyncQueue<Bzip>::Queue(bzip, args, req));
+  }
+
+  /* deflateInto(input, output, [offset], [mode]) compresses the input Buffer
+   * straight into the output Buffer from offset on, mode is null, 'flush' or
+   * 'finish'. returns {read, written, more, end}, while more is set call again
+   * with the input not read yet (or an empty Buffer) and the same mode. a
+   * complete 'finish' sets end and ends the stream like end(). flushBytes
+   * does not apply.
+   */
+  static Handle<Value> BzipDeflateInto(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
 
-    if (gzip->use_buffers) {
-      // output compressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
+    HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip deflateInto: async calls are still pending");
+    THROW_IF_NOT (bzip->parallel == NULL, "bzip deflateInto: not available with threads > 1");
+    char* in;
+    char* out;
+    int in_len, out_len;
+    const char* err = IntoArgs(args, &in, &in_len, &out, &out_len);
+    THROW_IF_NOT_A (err == NULL, "bzip deflateInto: %s", err);
+    int action = BZ_RUN;
+    if (args.Length() > 3 && !args[3]->IsUndefined() && !args[3]->IsNull()) {
+      String::AsciiValue name(args[3]);
+      if (strcmp(*name, "flush") == 0) {
+        action = BZ_FLUSH;
+      } else {
+        THROW_IF_NOT (strcmp(*name, "finish") == 0, "invalid deflateInto mode, expected 'flush' or 'finish'");
+        action = BZ_FINISH;
       }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
-    } else {
-      // output compressed data in a binary string
-      Local<Value> outString = Encode(out, out_size, gzip->encoding);
-      free(out);
-      return scope.Close(outString);
     }
+
+    int r, read, written;
+    try {
+      r = bzip->BzipDeflateInto(in, in_len, action, out, out_len, &read, &written);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "bzip deflateInto: error(%d)", r);
+    bool more = action == BZ_RUN ? written == out_len : r == BZ_FLUSH_OK || r == BZ_FINISH_OK;
+    return scope.Close(IntoResult(read, written, more, r == BZ_STREAM_END));
+  }
+
+  /* destroy(), give the native state back now rather than whenever the
+   * object is collected. nothing but init() works afterwards
+   */
+  static Handle<Value> BzipDestroy(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    THROW_IF_NOT (bzip->async_head == NULL, "bzip destroy: async calls are still pending");
+    bzip->Release();
+    bzip->stats.Report();
+    return scope.Close(Undefined());
+  }
+
+  /* getStats() this object's counters, see gzbz2.getStats */
+  static Handle<Value> BzipGetStats(const Arguments& args) {
+    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+
+    HandleScope scope;
+    return scope.Close(bzip->stats.ToObject());
   }
 
-  Gzip() : EventEmitter(), use_buffers(true), encoding(BINARY) {
+  Bzip() : EventEmitter(), mem(NULL), use_buffers(true), encoding(BINARY), chunk(CHUNK),
+    flush_bytes(0), unflushed(0), async_head(NULL), async_tail(NULL), priority(TASK_NORMAL), parallel(NULL), stats(STATS_BZIP) {
   }
 
-  ~Gzip() {
+  ~Bzip() {
+    Release();
+    stats.Report();
   }
 
  private:
 
-  z_stream strm;
+  bz_stream strm;
+  BzMemory* mem;            // set while strm is initialised
   bool use_buffers;
   enum encoding encoding;
+  int chunk;                // input slice and minimum output growth
+  int flush_bytes;          // flushBytes, 0 for no automatic flushes
+  uint64_t unflushed;       // input since the last flush
+  AsyncRequest* async_head;
+  AsyncRequest* async_tail;
+  int priority;             // TaskClass of the async calls
+  ParallelBzip* parallel;
+  Stats stats;
+
+  friend class AsyncQueue<Bzip>;
+  friend class FileJob;
 };
 
-class Gunzip : public EventEmitter {
+class Bunzip : public EventEmitter {
  public:
   static void Initialize(v8::Handle<v8::Object> target) {
     HandleScope scope;
@@ -297,112 +5558,323 @@ class Gunzip : public EventEmitter {
     t->Inherit(EventEmitter::constructor_template);
     t->InstanceTemplate()->SetInternalFieldCount(1);
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", GunzipInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "inflate", GunzipInflate);
-    NODE_SET_PROTOTYPE_METHOD(t, "end", GunzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "init", BunzipInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflate", BunzipInflate);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", BunzipEnd);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflateAsync", BunzipInflateAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "endAsync", BunzipEndAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", BunzipGetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", BunzipDestroy);
+    NODE_SET_PROTOTYPE_METHOD(t, "inflateInto", BunzipInflateInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "read", BunzipRead);
+    NODE_SET_PROTOTYPE_METHOD(t, "pending", BunzipPending);
+    NODE_SET_PROTOTYPE_METHOD(t, "checkpoint", BunzipCheckpoint);
+    NODE_SET_PROTOTYPE_METHOD(t, "restore", BunzipRestore);
 
-    target->Set(String::NewSymbol("Gunzip"), t->GetFunction());
+    target->Set(String::NewSymbol("Bunzip"), t->GetFunction());
   }
 
-  int GunzipInit() {
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+  int BunzipInit(int small, int threads, bool blocks = false) {
+    Release();
+    // over the memory budget: give up, or go down to one thread, then to small mode
+    MemoryBudget::Hold hold;
+    bool degraded = false;
+    while (!hold.Admit(threads > 1 ? (int64_t)threads * BZ_DECOMPRESS_MEMORY(small)
+                                            : BZ_DECOMPRESS_MEMORY(small))) {
+      if (!MemoryBudget::Degrading() || (threads == 1 && small)) {
+        return MemoryBudget::Refuse(BZ_MEM_ERROR);
+      }
+      if (threads > 1) {
+        threads = 1;
+      } else {
+        small = 1;
+      }
+      degraded = true;
+    }
+    if (degraded) {
+      MemoryBudget::Degraded();
+    }
+    if (threads > 1 || blocks) {
+      // blocks are decoded by their own streams, strm stays unused
+      parallel = new ParallelBunzip(small, threads);
+      stats.Acquire((int64_t)threads * BZ_DECOMPRESS_MEMORY(small));
+      return BZ_OK;
+    }
+    /* allocate inflate state from recycled memory */
+    mem = BzMemory::Borrow(BzMemory::DecompressKind(small));
+    strm.bzalloc = BzMemory::Alloc;
+    strm.bzfree = BzMemory::Free;
+    strm.opaque = mem;
     strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    // +16 to decode only the gzip format (no auto-header detection)
-    return inflateInit2(&strm, 16+MAX_WBITS);
+    strm.next_in = NULL;
+    int ret = BZ2_bzDecompressInit(&strm, 0, small);
+    if (ret != BZ_OK) {
+      BzMemory::Release(mem);
+      mem = NULL;
+    } else {
+      stats.Acquire(BZ_DECOMPRESS_MEMORY(small));
+    }
+    return ret;
   }
 
-  int GunzipInflate(const char* data, int data_len, char** out, int* out_len) {
+  /* end the stream (a no-op if an error ended it already) and hand its memory back */
+  void Release() {
+    delete parallel;
+    parallel = NULL;
+    if (mem) {
+      BZ2_bzDecompressEnd(&strm);
+      BzMemory::Release(mem);
+      mem = NULL;
+    }
+    stats.Release();
+    held.clear();
+    held_pos = 0;
+    held_more = false;
+  }
+
+  int BunzipInflate(const char* data, int data_len, char** out, int* out_len) {
+    if (max_output > 0) {
+      return BunzipPull(data, data_len, max_output, out, out_len);
+    }
+    StatCall call(stats, data_len, out_len);
+    if (parallel) {
+      return parallel->Inflate(data, data_len, out, out_len);
+    }
     int ret = 0;
-    char* temp;
-    int i=1;
+    int cap = 0;
+    // not the block estimate, a chunk of a stream is no whole buffer and fake magics would inflate it
+    int hint = RatioHint(BzTotal(strm.total_in_lo32, strm.total_in_hi32),
+                         BzTotal(strm.total_out_lo32, strm.total_out_hi32), data_len, 4.0);
 
     *out = NULL;
     *out_len = 0;
 
     while (data_len > 0) {
-      if (data_len > CHUNK) {
-        strm.avail_in = CHUNK;
+      if (data_len > chunk) {
+        strm.avail_in = chunk;
       } else {
         strm.avail_in = data_len;
       }
 
-      strm.next_in = (Bytef*)data;
+      strm.next_in = (char*)data;
+
+      do {
+        if (!GrowOutput(out, &cap, *out_len + chunk, hint, &call)) {
+          return BZ_MEM_ERROR;
+        }
+        strm.avail_out = cap - *out_len;
+        strm.next_out = (char*)*out + *out_len;
+        ret = BZ2_bzDecompress(&strm);
+        switch (ret) {
+        case BZ_PARAM_ERROR:
+          ret = BZ_DATA_ERROR;     /* and fall through */
+        case BZ_DATA_ERROR:
+        case BZ_DATA_ERROR_MAGIC:
+        case BZ_MEM_ERROR:
+          BZ2_bzDecompressEnd(&strm);
+          return ret;
+        }
+        *out_len = cap - strm.avail_out;
+      } while (strm.avail_out == 0 && ret != BZ_STREAM_END);
+      if (ret == BZ_STREAM_END) {
+        // as inflate does, input after the end of the stream is left alone,
+        // libbz2 would call another decompress a sequence error
+        break;
+      }
+      data += chunk;
+      data_len -= chunk;
+    }
+    return ret;
+  }
+
+  /* maxOutput: data joins the input held back from earlier calls, and at most
+   * limit bytes are decompressed from it, the rest of the input stays held
+   */
+  int BunzipPull(const char* data, int data_len, int limit, char** out, int* out_len) {
+    StatCall call(stats, data_len, out_len);
+    int ret = BZ_OK;
+    int cap = 0;
+
+    *out = NULL;
+    *out_len = 0;
+    if (mem == NULL) {
+      return BZ_SEQUENCE_ERROR;
+    }
+    if (data_len == 0 && !held_more && held_pos == held.size()) {
+      // nothing to do, libbz2 would call another decompress after the end a sequence error
+      return BZ_OK;
+    }
+    if (data_len > 0) {
+      // drop what was taken before the held input grows
+      held.erase(0, held_pos);
+      held_pos = 0;
+      held.append(data, data_len);
+    }
+    int hint = RatioHint(BzTotal(strm.total_in_lo32, strm.total_in_hi32),
+                         BzTotal(strm.total_out_lo32, strm.total_out_hi32), held.size() - held_pos, 4.0);
 
-      do {
-        temp = (char *)realloc(*out, CHUNK*i);
-        if (temp == NULL) {
-          return Z_MEM_ERROR;
-        }
-        *out = temp;
-        strm.avail_out = CHUNK;
-        strm.next_out = (Bytef*)*out + *out_len;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        // former assert
-        THROWS_IF_NOT_A (ret != Z_STREAM_ERROR, "GunzipInflate.inflate: %d", ret);  /* state not clobbered */
+    do {
+      if (!GrowOutput(out, &cap, std::min(*out_len + chunk, limit), std::min(hint, limit), &call, limit)) {
+        return BZ_MEM_ERROR;
+      }
+      size_t avail = std::min(held.size() - held_pos, (size_t)chunk);
+      strm.next_in = (char*)held.data() + held_pos;
+      strm.avail_in = avail;
+      strm.avail_out = cap - *out_len;
+      strm.next_out = *out + *out_len;
+      ret = BZ2_bzDecompress(&strm);
+      switch (ret) {
+      case BZ_PARAM_ERROR:
+        ret = BZ_DATA_ERROR;     /* and fall through */
+      case BZ_DATA_ERROR:
+      case BZ_DATA_ERROR_MAGIC:
+      case BZ_MEM_ERROR:
+        BZ2_bzDecompressEnd(&strm);
+        return ret;
+      }
+      held_pos += avail - strm.avail_in;
+      *out_len = cap - strm.avail_out;
+    } while (ret != BZ_STREAM_END && *out_len < limit && (held_pos < held.size() || strm.avail_out == 0));
+
+    held_more = ret != BZ_STREAM_END && (held_pos < held.size() || strm.avail_out == 0);
+    if (ret == BZ_STREAM_END) {
+      held.clear();
+      held_pos = 0;
+    }
+    return ret;
+  }
 
-        switch (ret) {
-        case Z_NEED_DICT:
-          ret = Z_DATA_ERROR;     /* and fall through */
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-          (void)inflateEnd(&strm);
-          return ret;
-        }
-        *out_len += (CHUNK - strm.avail_out);
-        i++;
-      } while (strm.avail_out == 0);
-      data += CHUNK;
-      data_len -= CHUNK;
+  /* decompress into memory of the caller's, stops when either side runs out */
+  int BunzipInflateInto(const char* data, int data_len, char* out, int out_len, int* read, int* written) {
+    *read = 0;
+    *written = 0;
+    if (mem == NULL) {
+      return BZ_SEQUENCE_ERROR;
+    }
+    uint64_t start = Stats::Now();
+    strm.next_in = (char*)data;
+    strm.avail_in = data_len;
+    strm.next_out = out;
+    strm.avail_out = out_len;
+    int ret = BZ2_bzDecompress(&strm);
+    *read = data_len - strm.avail_in;
+    *written = out_len - strm.avail_out;
+    stats.Call(*read, *written, Stats::Now() - start);
+    switch (ret) {
+    case BZ_PARAM_ERROR:
+      ret = BZ_DATA_ERROR;     /* and fall through */
+    case BZ_DATA_ERROR:
+    case BZ_DATA_ERROR_MAGIC:
+    case BZ_MEM_ERROR:
+      BZ2_bzDecompressEnd(&strm);
+      return ret;
     }
     return ret;
   }
 
-  void GunzipEnd() {
-    inflateEnd(&strm);
+  /* as GunzipEnd, held input that was never read() is an error */
+  void BunzipEnd() {
+    bool undrained = held_more || held_pos < held.size();
+    Release();
+    if (undrained) {
+      throw std::string("bunzip end: input held back by maxOutput was not read()");
+    }
   }
 
+  /* runs on a worker thread, see AsyncQueue */
+  void AsyncWork(AsyncRequest* req) {
+    if (req->end) {
+      BunzipEnd();
+    } else {
+      req->ret = BunzipInflate(req->in, req->in_len, &req->out, &req->out_len);
+      THROWS_IF_NOT_A (req->ret >= 0, "bunzip inflate: error(%d)", req->ret);
+    }
+  }
  protected:
 
   static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
 
-    Gunzip *gunzip = new Gunzip();
-    gunzip->Wrap(args.This());
+    Bunzip *bunzip = new Bunzip();
+    bunzip->Wrap(args.This());
 
     return args.This();
   }
 
-  /* options: encoding: string [null], if set output strings, else buffers
+  /* options: encoding:   string  [null], if set output strings, else buffers
+   *          small:      boolean [false], bunzip in small mode
+   *          threads:    int     [1], > 1 decodes blocks in parallel
+   *          chunkSize:  int     [16K], input slice, output grows by at least this
+   *          maxOutput:  int     [0], if set inflate returns at most this many
+   *                              bytes and holds the rest of the input back, see read
+   *          checkpoint: boolean [false], decode block by block (as threads > 1
+   *                              does) so that checkpoint can name a restart point
+   *          priority:   string  [normal], 'high', 'normal' or 'low', class of the async calls
    */
-  static Handle<Value> GunzipInit(const Arguments& args) {
-    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+  static Handle<Value> BunzipInit(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip init: async calls are still pending");
+    bunzip->priority = TASK_NORMAL;
 
-    gunzip->use_buffers = true;
+    int small = 0;
+    int threads = 1;
+    bool blocks = false;
+    bunzip->use_buffers = true;
+    bunzip->chunk = CHUNK;
+    bunzip->max_output = 0;
     if (args.Length() > 0) {
       THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
       Local<Object> options = args[0]->ToObject();
       Local<Value> enc = options->Get(String::NewSymbol("encoding"));
+      Local<Value> pri = options->Get(String::NewSymbol("priority"));
+      Local<Value> sm = options->Get(String::NewSymbol("small"));
+      Local<Value> thr = options->Get(String::NewSymbol("threads"));
+      Local<Value> cs = options->Get(String::NewSymbol("chunkSize"));
+      Local<Value> mo = options->Get(String::NewSymbol("maxOutput"));
+      Local<Value> ck = options->Get(String::NewSymbol("checkpoint"));
 
       if ((enc->IsUndefined() || enc->IsNull()) == false) {
-        gunzip->encoding = ParseEncoding(enc);
-        gunzip->use_buffers = false;
+        bunzip->encoding = ParseEncoding(enc);
+        bunzip->use_buffers = false;
+      }
+      if ((pri->IsUndefined() || pri->IsNull()) == false) {
+        bunzip->priority = TaskPriority(pri);
+        THROW_IF_NOT (bunzip->priority >= 0, "invalid priority, expected 'high', 'normal' or 'low'");
+      }
+      if ((mo->IsUndefined() || mo->IsNull()) == false) {
+        bunzip->max_output = mo->Int32Value();
+        THROW_IF_NOT_A (bunzip->max_output >= 0, "invalid maxOutput: %d", bunzip->max_output);
+      }
+      if ((sm->IsUndefined() || sm->IsNull()) == false) {
+        small = sm->BooleanValue() ? 1 : 0;
+      }
+      if ((thr->IsUndefined() || thr->IsNull()) == false) {
+        threads = thr->Int32Value();
+        THROW_IF_NOT_A (1 <= threads && threads <= 256, "invalid threads: %d", threads);
+        THROW_IF_NOT (threads == 1 || bunzip->max_output == 0, "threads > 1 and maxOutput can not be combined");
+      }
+      if ((ck->IsUndefined() || ck->IsNull()) == false) {
+        blocks = ck->BooleanValue();
+        THROW_IF_NOT (!blocks || bunzip->max_output == 0, "checkpoint and maxOutput can not be combined");
+      }
+      if ((cs->IsUndefined() || cs->IsNull()) == false) {
+        bunzip->chunk = cs->Int32Value();
+        THROW_IF_NOT_A (1024 <= bunzip->chunk && bunzip->chunk <= 64*1024*1024,
+                        "invalid chunkSize: %d", bunzip->chunk);
       }
     }
-
-    int r = gunzip->GunzipInit();
+    int r = bunzip->BunzipInit(small, threads, blocks);
+    bunzip->stats.Report();
     return scope.Close(Integer::New(r));
   }
 
-  static Handle<Value> GunzipInflate(const Arguments& args) {
-    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+  static Handle<Value> BunzipInflate(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip inflate: async calls are still pending");
     std::auto_ptr<BufferWrapper> bw;
 
     char* buf;
@@ -422,193 +5894,245 @@ class Gunzip : public EventEmitter {
       buf = new char[len];
       bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
       ssize_t written = DecodeWrite(buf, len, args[0], enc);
-      THROW_IF_NOT_A (written == len, "GunzipInflate.DecodeWrite: %zd != %zd", written, len);
+      THROW_IF_NOT_A(written == len, "BunzipInflate.DecodeWrite: %zd != %zd", written, len);
     }
 
     char* out;
     int r, out_size;
     try {
-      r = gunzip->GunzipInflate(buf, len, &out, &out_size);
+      r = bunzip->BunzipInflate(buf, len, &out, &out_size);
     } catch( const std::string & msg ) {
       return ThrowException(Exception::Error (String::New(msg.c_str())));
     }
-    THROW_IF_NOT_A (r >= 0, "gunzip inflate: error(%d) %s", r, gunzip->strm.msg);
-    THROW_IF_NOT_A (out_size >= 0, "gunzip inflate: negative output size: %d", out_size);
+    THROW_IF_NOT_A (r >= 0, "bunzip inflate: error(%d)", r);
+    THROW_IF_NOT_A (out_size >= 0, "bunzip inflate: negative output size: %d", out_size);
 
-    if (gunzip->use_buffers) {
-      // output decompressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
-      }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
-    } else {
-      // output decompressed data in an encoded string
-      Local<Value> outString = Encode(out, out_size, gunzip->encoding);
-      free(out);
-      return scope.Close(outString);
-    }
+    return scope.Close(MakeOutput(out, out_size, bunzip->use_buffers, bunzip->encoding));
   }
 
-  static Handle<Value> GunzipEnd(const Arguments& args) {
-    Gunzip *gunzip = ObjectWrap::Unwrap<Gunzip>(args.This());
+  static Handle<Value> BunzipEnd(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
     HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip end: async calls are still pending");
     try {
-      gunzip->GunzipEnd();
+      bunzip->BunzipEnd();
     } catch( const std::string & msg ) {
       return ThrowException(Exception::Error (String::New(msg.c_str())));
     }
+    bunzip->stats.Report();
     return scope.Close(Undefined());
   }
 
-  Gunzip() : EventEmitter(), use_buffers(true), encoding(BINARY) {
-  }
+  /* inflateAsync(data, [encoding], callback), callback(err, data) */
+  static Handle<Value> BunzipInflateAsync(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-  ~Gunzip() {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 2, "inflateAsync: expected data and a callback");
+
+    // default encoding is binary
+    enum encoding enc = args.Length() == 2 ? BINARY : ParseEncoding(args[1], BINARY);
+    AsyncRequest* req = new AsyncRequest();
+    if (!req->SetInput(args[0], enc)) {
+      delete req;
+      return ThrowException(Exception::Error (String::New("inflateAsync: invalid input")));
+    }
+    return scope.Close(AsyncQueue<Bunzip>::Queue(bunzip, args, req));
   }
 
- private:
-
-  z_stream strm;
-  bool use_buffers;
-  enum encoding encoding;
-};
-#endif//WITH_GZIP
-
+  /* endAsync(callback), callback(err) */
+  static Handle<Value> BunzipEndAsync(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-#ifdef  WITH_BZIP
-class Bzip : public EventEmitter {
- public:
-  static void Initialize(v8::Handle<v8::Object> target) {
     HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "endAsync: expected a callback");
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    AsyncRequest* req = new AsyncRequest();
+    req->end = true;
+    return scope.Close(AsyncQueue<Bunzip>::Queue(bunzip, args, req));
+  }
 
-    t->Inherit(EventEmitter::constructor_template);
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+  /* inflateInto(input, output, [offset]) decompresses the input Buffer
+   * straight into the output Buffer from offset on. returns {read, written,
+   * more, end}, while more is set call again with the input not read yet (or
+   * an empty Buffer), end is set once the bzip2 stream is complete.
+   */
+  static Handle<Value> BunzipInflateInto(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", BzipInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "deflate", BzipDeflate);
-    NODE_SET_PROTOTYPE_METHOD(t, "end", BzipEnd);
+    HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip inflateInto: async calls are still pending");
+    THROW_IF_NOT (bunzip->parallel == NULL, "bunzip inflateInto: not available with threads > 1 or checkpoint");
+    THROW_IF_NOT (bunzip->held_pos == bunzip->held.size(), "bunzip inflateInto: input is held back, read() it first");
+    char* in;
+    char* out;
+    int in_len, out_len;
+    const char* err = IntoArgs(args, &in, &in_len, &out, &out_len);
+    THROW_IF_NOT_A (err == NULL, "bunzip inflateInto: %s", err);
 
-    target->Set(String::NewSymbol("Bzip"), t->GetFunction());
+    int r, read, written;
+    try {
+      r = bunzip->BunzipInflateInto(in, in_len, out, out_len, &read, &written);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "bunzip inflateInto: error(%d)", r);
+    bool end = r == BZ_STREAM_END;
+    return scope.Close(IntoResult(read, written, !end && written == out_len, end));
   }
 
-  int BzipInit(int level, int work) {
-    /* allocate deflate state */
-    strm.bzalloc = NULL;
-    strm.bzfree = NULL;
-    strm.opaque = NULL;
-    return BZ2_bzCompressInit(&strm, level, 0, work);
-  }
+  /* read([n]) decompresses up to n bytes (default maxOutput) more from the
+   * input held back by inflate, an empty result once it is all through
+   */
+  static Handle<Value> BunzipRead(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-  int BzipDeflate(char* data, int data_len, char** out, int* out_len) {
-    int ret = 0;
-    char* temp;
-    int i=1;
+    HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip read: async calls are still pending");
+    THROW_IF_NOT (bunzip->parallel == NULL, "bunzip read: not available with threads > 1 or checkpoint");
+    int n = bunzip->max_output > 0 ? bunzip->max_output : bunzip->chunk;
+    if (args.Length() > 0 && !args[0]->IsUndefined() && !args[0]->IsNull()) {
+      n = args[0]->Int32Value();
+      THROW_IF_NOT_A (n > 0, "bunzip read: invalid size: %d", n);
+    }
 
-    *out = NULL;
-    *out_len = 0;
-    ret = 0;
+    char* out;
+    int r, out_size;
+    try {
+      r = bunzip->BunzipPull(NULL, 0, n, &out, &out_size);
+    } catch( const std::string & msg ) {
+      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    }
+    THROW_IF_NOT_A (r >= 0, "bunzip read: error(%d)", r);
+    return scope.Close(MakeOutput(out, out_size, bunzip->use_buffers, bunzip->encoding));
+  }
 
-    while (data_len > 0) {
-      if (data_len > CHUNK) {
-        strm.avail_in = CHUNK;
-      } else {
-        strm.avail_in = data_len;
-      }
+  /* pending() {input: compressed bytes held back, more: read() has output to give} */
+  static Handle<Value> BunzipPending(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-      strm.next_in = (char*)data;
-      do {
-        temp = (char *)realloc(*out, CHUNK*i +1);
-        if (temp == NULL) {
-          return BZ_MEM_ERROR;
-        }
-        *out = temp;
-        strm.avail_out = CHUNK;
-        strm.next_out = (char*)*out + *out_len;
-        ret = BZ2_bzCompress(&strm, BZ_RUN);
-        // former assert
-        THROWS_IF_NOT_A (ret == BZ_RUN_OK, "BzipDeflate.BZ2_bzCompress: %d != BZ_RUN_OK", ret);
+    HandleScope scope;
+    Local<Object> o = Object::New();
+    o->Set(String::NewSymbol("input"), Number::New(bunzip->held.size() - bunzip->held_pos));
+    o->Set(String::NewSymbol("more"), Boolean::New(bunzip->held_more));
+    return scope.Close(o);
+  }
 
-        *out_len += (CHUNK - strm.avail_out);
-        i++;
-      } while (strm.avail_out == 0);
+  /* destroy(), give the native state back now rather than whenever the
+   * object is collected. nothing but init() works afterwards
+   */
+  static Handle<Value> BunzipDestroy(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-      data += CHUNK;
-      data_len -= CHUNK;
-    }
-    return ret;
+    HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip destroy: async calls are still pending");
+    bunzip->Release();
+    bunzip->stats.Report();
+    return scope.Close(Undefined());
   }
 
-  int BzipEnd(char** out, int* out_len) {
-    int ret;
-    char* temp;
-    int i = 1;
-
-    *out = NULL;
-    *out_len = 0;
-    strm.avail_in = 0;
-    strm.next_in = NULL;
+  /* checkpoint() where the stream can be picked up again as {state, input,
+   * output}, see CheckpointResult: the first block not decoded yet
+   */
+  static Handle<Value> BunzipCheckpoint(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-    do {
-      temp = (char *)realloc(*out, CHUNK*i);
-      if (temp == NULL) {
-        return Z_MEM_ERROR;
-      }
-      *out = temp;
-      strm.avail_out = CHUNK;
-      strm.next_out = (char*)*out + *out_len;
-      ret = BZ2_bzCompress(&strm, BZ_FINISH);
-      // former assert
-      THROWS_IF_NOT_A (ret == BZ_FINISH_OK || ret == BZ_STREAM_END,
-                       "BzipEnd.BZ2_bzCompress: %d != BZ_FINISH_OK || BZ_STREAM_END", ret);
+    HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip checkpoint: async calls are still pending");
+    THROW_IF_NOT (bunzip->parallel != NULL, "checkpoint: use init({checkpoint: true}) or threads > 1");
+    uint64_t in, out;
+    std::string s = bunzip->parallel->Checkpoint(&in, &out);
+    return scope.Close(CheckpointResult(&s, in, out));
+  }
 
-      *out_len += (CHUNK - strm.avail_out);
-      i++;
-    } while (strm.avail_out == 0);
+  /* restore(state) carry on from a checkpoint, returns {input, output} as
+   * Gunzip's restore does. init({checkpoint: true}) (or threads > 1) first
+   */
+  static Handle<Value> BunzipRestore(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-    BZ2_bzCompressEnd(&strm);
-    return ret;
+    HandleScope scope;
+    THROW_IF_NOT (bunzip->async_head == NULL, "bunzip restore: async calls are still pending");
+    THROW_IF_NOT (args.Length() > 0 && Buffer::HasInstance(args[0]), "restore argument must be a buffer");
+    THROW_IF_NOT (bunzip->parallel != NULL, "restore: use init({checkpoint: true}) or threads > 1");
+    Local<Object> buffer = args[0]->ToObject();
+    // the decoders start over, so they have to fit the budget again
+    MemoryBudget::Hold hold;
+    if (!hold.Admit(bunzip->parallel->Memory())) {
+      MemoryBudget::Refuse(BZ_MEM_ERROR);
+      return ThrowException(Exception::Error (String::New("bunzip restore: over the memory budget")));
+    }
+    uint64_t in, out;
+    THROW_IF_NOT (bunzip->parallel->Restore((const unsigned char*)BufferData(buffer), BufferLength(buffer), &in, &out),
+                  "restore: invalid checkpoint");
+    return scope.Close(RestoreResult(in, out));
   }
 
- protected:
+  /* getStats() this object's counters, see gzbz2.getStats */
+  static Handle<Value> BunzipGetStats(const Arguments& args) {
+    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
 
-  static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
+    return scope.Close(bunzip->stats.ToObject());
+  }
 
-    Bzip *bzip = new Bzip();
-    bzip->Wrap(args.This());
+  Bunzip() : EventEmitter(), mem(NULL), use_buffers(true), encoding(BINARY), chunk(CHUNK),
+    async_head(NULL), async_tail(NULL), priority(TASK_NORMAL), parallel(NULL), max_output(0), held_pos(0), held_more(false),
+    stats(STATS_BUNZIP) {
+  }
 
-    return args.This();
+  ~Bunzip() {
+    Release();
+    stats.Report();
   }
 
-  /* options: encoding: string [null] if set output strings, else buffers
-   *          level:    int    [-1]   (compression level)
-   */
-  static Handle<Value> BzipInit(const Arguments& args) {
-    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
+ private:
 
-    HandleScope scope;
+  bz_stream strm;
+  BzMemory* mem;            // set while strm is initialised
+  bool use_buffers;
+  enum encoding encoding;
+  int chunk;                // input slice and minimum output growth
+  AsyncRequest* async_head;
+  AsyncRequest* async_tail;
+  int priority;             // TaskClass of the async calls
+  ParallelBunzip* parallel;
+  int max_output;           // 0, or the most one inflate/read returns
+  std::string held;         // input held back by maxOutput
+  size_t held_pos;          // taken from held so far
+  bool held_more;           // read() has more output to give
+  Stats stats;
+
+  friend class AsyncQueue<Bunzip>;
+  friend class FileJob;
+};
 
+/* bzipSync/bunzipSync: a whole buffer in one call. bzip2 streams can not be
+ * reset, but the memory behind them is cached per thread (per block size), so
+ * a new stream costs no allocations after the first call.
+ */
+class BzSync {
+public:
+  /* bzipSync(data, [options]), data a Buffer or a string (utf8)
+   * options: level:      int    [1]
+   *          workfactor: int    [30]
+   *          encoding:   string [null] if set the output is a string, else a Buffer
+   */
+  static Handle<Value> BzipSync(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "bzipSync: expected data");
     int level = 1;
     int work = 30;
-    bzip->use_buffers = true;
-    if (args.Length() > 0) {
-      THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
-      Local<Object> options = args[0]->ToObject();
-      Local<Value> enc = options->Get(String::NewSymbol("encoding"));
+    bool use_buffers = true;
+    enum encoding enc = BINARY;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      THROW_IF_NOT (args[1]->IsObject(), "bzipSync options must be an object");
+      Local<Object> options = args[1]->ToObject();
       Local<Value> lev = options->Get(String::NewSymbol("level"));
       Local<Value> wf = options->Get(String::NewSymbol("workfactor"));
+      Local<Value> en = options->Get(String::NewSymbol("encoding"));
 
-      if ((enc->IsUndefined() || enc->IsNull()) == false) {
-        bzip->encoding = ParseEncoding(enc);
-        bzip->use_buffers = false;
-      }
       if ((lev->IsUndefined() || lev->IsNull()) == false) {
         level = lev->Int32Value();
         THROW_IF_NOT_A (1 <= level && level <= 9, "invalid compression level: %d", level);
@@ -617,309 +6141,783 @@ class Bzip : public EventEmitter {
         work = wf->Int32Value();
         THROW_IF_NOT_A (0 <= work && work <= 250, "invalid workfactor: %d", work);
       }
+      if ((en->IsUndefined() || en->IsNull()) == false) {
+        enc = ParseEncoding(en);
+        use_buffers = false;
+      }
     }
 
-    int r = bzip->BzipInit(level, work);
-    return scope.Close(Integer::New(r));
-  }
-
-  static Handle<Value> BzipDeflate(const Arguments& args) {
-    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
-
-    HandleScope scope;
-    std::auto_ptr<BufferWrapper> bw;
-
-    char* buf;
+    std::string str;
+    const char* in;
     ssize_t len;
-    // deflate a buffer or a string?
     if (Buffer::HasInstance(args[0])) {
-       // buffer
-       Local<Object> buffer = args[0]->ToObject();
-       len = BufferLength(buffer);
-       buf = BufferData(buffer);
+      Local<Object> buffer = args[0]->ToObject();
+      in = BufferData(buffer);
+      len = BufferLength(buffer);
     } else {
-      // string, default encoding is utf8
-      enum encoding enc = args.Length() == 1 ? UTF8 : ParseEncoding(args[1], UTF8);
-      len = DecodeBytes(args[0], enc);
-      THROW_IF_NOT_A (len >= 0, "invalid DecodeBytes result: %zd", len);
-
-      buf = new char[len];
-      bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
-      ssize_t written = DecodeWrite(buf, len, args[0], enc);
-      THROW_IF_NOT_A (written == len, "BzipDeflate.DecodeWrite: %zd != %zd", written, len);
+      THROW_IF_NOT (ValueBytes(args[0], UTF8, &str), "bzipSync: invalid input");
+      in = str.data();
+      len = str.size();
     }
+    THROW_IF_NOT (len <= INT_MAX / 2, "bzipSync: input too large");
 
     char* out;
-    int r, out_size;
-    try {
-      r = bzip->BzipDeflate(buf, len, &out, &out_size);
-    } catch( const std::string & msg ) {
-      return ThrowException(Exception::Error (String::New(msg.c_str())));
+    int out_len;
+    int r = Compress(in, len, level, work, &out, &out_len);
+    if (r != BZ_OK) {
+      free(out);
     }
-    THROW_IF_NOT_A (r >= 0, "bzip deflate: error(%d)", r);
-    THROW_IF_NOT_A (out_size >= 0, "bzip deflate: negative output size: %d", out_size);
+    THROW_IF_NOT_A (r == BZ_OK, "bzipSync: error(%d)", r);
+    return scope.Close(MakeOutput(out, out_len, use_buffers, enc));
+  }
+
+  /* bunzipSync(data, [options]), data a Buffer or a string (binary) holding one
+   * or more bzip2 streams
+   * options: small:    boolean [false]
+   *          encoding: string  [null] if set the output is a string, else a Buffer
+   */
+  static Handle<Value> BunzipSync(const Arguments& args) {
+    HandleScope scope;
+    THROW_IF_NOT (args.Length() >= 1, "bunzipSync: expected data");
+    int small = 0;
+    bool use_buffers = true;
+    enum encoding enc = BINARY;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      THROW_IF_NOT (args[1]->IsObject(), "bunzipSync options must be an object");
+      Local<Object> options = args[1]->ToObject();
+      Local<Value> sm = options->Get(String::NewSymbol("small"));
+      Local<Value> en = options->Get(String::NewSymbol("encoding"));
 
-    if (bzip->use_buffers) {
-      // output compressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
+      if ((sm->IsUndefined() || sm->IsNull()) == false) {
+        small = sm->BooleanValue() ? 1 : 0;
+      }
+      if ((en->IsUndefined() || en->IsNull()) == false) {
+        enc = ParseEncoding(en);
+        use_buffers = false;
       }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
+    }
+
+    std::string str;
+    const char* in;
+    ssize_t len;
+    if (Buffer::HasInstance(args[0])) {
+      Local<Object> buffer = args[0]->ToObject();
+      in = BufferData(buffer);
+      len = BufferLength(buffer);
     } else {
-      // output compressed data in a binary string
-      Local<Value> outString = Encode(out, out_size, bzip->encoding);
+      THROW_IF_NOT (ValueBytes(args[0], BINARY, &str), "bunzipSync: invalid input");
+      in = str.data();
+      len = str.size();
+    }
+    THROW_IF_NOT (len <= INT_MAX, "bunzipSync: input too large");
+
+    char* out;
+    int out_len;
+    int r = Decompress(in, len, small, &out, &out_len);
+    if (r != BZ_OK) {
       free(out);
-      return scope.Close(outString);
     }
+    THROW_IF_NOT (r != BZ_DATA_ERROR && r != BZ_DATA_ERROR_MAGIC && r != BZ_UNEXPECTED_EOF,
+                  "bunzipSync: invalid or truncated bzip2 data");
+    THROW_IF_NOT_A (r == BZ_OK, "bunzipSync: error(%d)", r);
+    return scope.Close(MakeOutput(out, out_len, use_buffers, enc));
   }
 
-  static Handle<Value> BzipEnd(const Arguments& args) {
-    Bzip *bzip = ObjectWrap::Unwrap<Bzip>(args.This());
-
-    HandleScope scope;
-
-    char* out;
-    int r, out_size;
-    try {
-      r = bzip->BzipEnd(&out, &out_size);
-    } catch( const std::string & msg ) {
-      return ThrowException(Exception::Error (String::New(msg.c_str())));
+private:
+  /* the output block starts at libbzip2's documented worst case (1% and 600
+   * bytes over the input) so BZ_FINISH normally runs through in one call
+   */
+  static int Compress(const char* in, int in_len, int level, int work, char** out, int* out_len) {
+    StatCall call(*Stats::Global(STATS_BZIP), in_len, out_len);
+    *out = NULL;
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    strm.bzalloc = BzMemory::Alloc;
+    strm.bzfree = BzMemory::Free;
+    strm.opaque = Memory(BzMemory::CompressKind(level), STATS_BZIP, BZ_COMPRESS_MEMORY(level));
+    int ret = BZ2_bzCompressInit(&strm, level, 0, work);
+    if (ret != BZ_OK) {
+      return ret;
     }
-    THROW_IF_NOT_A (r >= 0, "bzip end: error(%d)", r);
-    THROW_IF_NOT_A (out_size >= 0, "bzip end: negative output size: %d", out_size);
+    int bound = in_len + in_len / 100 + 600;
+    int cap = 0;
+    strm.next_in = (char*)in;
+    strm.avail_in = in_len;
+    do {
+      if (!GrowOutput(out, &cap, *out_len + CHUNK, bound, &call)) {
+        ret = BZ_MEM_ERROR;
+        break;
+      }
+      strm.next_out = *out + *out_len;
+      strm.avail_out = cap - *out_len;
+      ret = BZ2_bzCompress(&strm, BZ_FINISH);
+      *out_len = cap - strm.avail_out;
+    } while (ret == BZ_FINISH_OK);
+    BZ2_bzCompressEnd(&strm);
+    return ret == BZ_STREAM_END ? BZ_OK : ret;
+  }
 
-    if (bzip->use_buffers) {
-      // output compressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
+  /* every stream in turn, concatenated streams (pbzip2 output) are followed */
+  static int Decompress(const char* in, int in_len, int small, char** out, int* out_len) {
+    StatCall call(*Stats::Global(STATS_BUNZIP), in_len, out_len);
+    *out = NULL;
+    if (in_len == 0) {
+      return BZ_UNEXPECTED_EOF;
+    }
+    BzMemory* mem = Memory(BzMemory::DecompressKind(small), STATS_BUNZIP, BZ_DECOMPRESS_MEMORY(small));
+    int hint = BzipSizeHint(in, in_len);
+    if (hint == 0) {
+      hint = RatioHint(0, 0, in_len, 4.0);
+    }
+    int cap = 0;
+    int ret = BZ_OK;
+    while (in_len > 0) {
+      if (in_len < 3 || memcmp(in, "BZh", 3) != 0) {
+        return BZ_DATA_ERROR_MAGIC;
+      }
+      bz_stream strm;
+      memset(&strm, 0, sizeof(strm));
+      strm.bzalloc = BzMemory::Alloc;
+      strm.bzfree = BzMemory::Free;
+      strm.opaque = mem;
+      ret = BZ2_bzDecompressInit(&strm, 0, small);
+      if (ret != BZ_OK) {
+        return ret;
+      }
+      strm.next_in = (char*)in;
+      strm.avail_in = in_len;
+      do {
+        if (!GrowOutput(out, &cap, *out_len + CHUNK, hint, &call)) {
+          ret = BZ_MEM_ERROR;
+          break;
+        }
+        strm.next_out = *out + *out_len;
+        strm.avail_out = cap - *out_len;
+        ret = BZ2_bzDecompress(&strm);
+        *out_len = cap - strm.avail_out;
+      } while (ret == BZ_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+      in += in_len - strm.avail_in;
+      in_len = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      if (ret != BZ_STREAM_END) {
+        // all input taken and still no end of stream
+        return ret == BZ_OK ? BZ_UNEXPECTED_EOF : ret;
       }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
-    } else {
-      // output compressed data in a binary string
-      Local<Value> outString = Encode(out, out_size, bzip->encoding);
-      free(out);
-      return scope.Close(outString);
     }
+    return BZ_OK;
   }
 
-  Bzip() : EventEmitter(), use_buffers(true), encoding(BINARY) {
+  /* this thread's stream memory for kind, kept for the life of the thread */
+  static BzMemory* Memory(int kind, int codec, int64_t bytes) {
+    static __thread BzMemory* cached[12];   // kinds -2, -1 and 1 to 9
+    BzMemory*& mem = cached[kind + 2];
+    if (mem == NULL) {
+      mem = BzMemory::Borrow(kind);
+      Stats::Global(codec)->Contexts(1, bytes);
+    }
+    return mem;
   }
+};
+#endif//WITH_BZIP
 
-  ~Bzip() {
-  }
+#define FILE_WRITE_SIZE (1024*1024)
 
- private:
+/* output file with large aligned writes, the output of the engines is
+ * gathered into FILE_WRITE_SIZE blocks before it goes to the kernel
+ */
+class FileWriter {
+public:
+  FileWriter(int fd) : fd(fd), buf(NULL), len(0), written(0) {
+    if (posix_memalign((void**)&buf, 4096, FILE_WRITE_SIZE) != 0) {
+      buf = NULL;
+    }
+  }
 
-  bz_stream strm;
-  bool use_buffers;
-  enum encoding encoding;
-};
+  ~FileWriter() {
+    free(buf);
+  }
 
-class Bunzip : public EventEmitter {
- public:
-  static void Initialize(v8::Handle<v8::Object> target) {
-    HandleScope scope;
+  void Write(const char* data, int data_len) {
+    THROWS_IF_NOT_A (buf != NULL, "file write: out of memory");
+    while (data_len > 0) {
+      int take = FILE_WRITE_SIZE - len < data_len ? FILE_WRITE_SIZE - len : data_len;
+      memcpy(buf + len, data, take);
+      len += take;
+      data += take;
+      data_len -= take;
+      if (len == FILE_WRITE_SIZE) {
+        Flush();
+      }
+    }
+  }
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+  void Flush() {
+    const char* p = buf;
+    while (len > 0) {
+      ssize_t n = write(fd, p, len);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      THROWS_IF_NOT_A (n > 0, "file write: %s", strerror(errno));
+      p += n;
+      len -= n;
+      written += n;
+    }
+  }
 
-    t->Inherit(EventEmitter::constructor_template);
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+  int fd;
+  char* buf;
+  int len;
+  uint64_t written;
+};
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", BunzipInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "inflate", BunzipInflate);
-    NODE_SET_PROTOTYPE_METHOD(t, "end", BunzipEnd);
+/* compressFile/decompressFile: disk to disk on a worker thread, the data
+ * never enters the JS heap. the input is mmap'd and streamed through a
+ * natively owned Gzip, Gunzip, Bzip or Bunzip.
+ */
+class FileJob {
+public:
+  /* compressFile(src, dst, [options], callback), callback(err, {in, out})
+   * options: format:  string ['gzip'] ('gzip' or 'bzip')
+   *          level:   int    (the codec's init default)
+   *          threads: int    [1]
+   */
+  static Handle<Value> CompressFile(const Arguments& args) {
+    return Queue(args, true);
+  }
 
-    target->Set(String::NewSymbol("Bunzip"), t->GetFunction());
+  /* decompressFile(src, dst, [options], callback), callback(err, {in, out})
+   * options: format:  string [by the magic of src] ('gzip' or 'bzip')
+   *          threads: int    [1]
+   */
+  static Handle<Value> DecompressFile(const Arguments& args) {
+    return Queue(args, false);
   }
 
-  int BunzipInit(int small) {
-    /* allocate inflate state */
-    strm.bzalloc = NULL;
-    strm.bzfree = NULL;
-    strm.opaque = NULL;
-    strm.avail_in = 0;
-    strm.next_in = NULL;
-    return BZ2_bzDecompressInit(&strm, 0, small);
+  enum Format { DETECT, GZIP, BZIP };
+
+  FileJob(bool c) : compress(c), format(DETECT), level(0), threads(1), in_size(0), out_size(0) {
+    #ifdef  WITH_GZIP
+    gzip = NULL;
+    gunzip = NULL;
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    bzip = NULL;
+    bunzip = NULL;
+    #endif//WITH_BZIP
   }
 
-  int BunzipInflate(const char* data, int data_len, char** out, int* out_len) {
-    int ret = 0;
-    char* temp;
-    int i=1;
+  ~FileJob() {
+    #ifdef  WITH_GZIP
+    delete gzip;
+    delete gunzip;
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    delete bzip;
+    delete bunzip;
+    #endif//WITH_BZIP
+  }
 
-    *out = NULL;
-    *out_len = 0;
+private:
+  static Handle<Value> Queue(const Arguments& args, bool compress) {
+    HandleScope scope;
+    const char* name = compress ? "compressFile" : "decompressFile";
+
+    THROW_IF_NOT_A (args.Length() >= 3 && args[0]->IsString() && args[1]->IsString() &&
+                    args[args.Length()-1]->IsFunction(),
+                    "%s arguments must be src, dst, [options] and a callback", name);
+    std::auto_ptr<FileJob> job(new FileJob(compress));
+    job->src = *String::Utf8Value(args[0]);
+    job->dst = *String::Utf8Value(args[1]);
+    job->format = compress ? GZIP : DETECT;
+    bool level_set = false;
+    if (args.Length() > 3 && !args[2]->IsUndefined()) {
+      THROW_IF_NOT_A (args[2]->IsObject(), "%s options must be an object", name);
+      Local<Object> options = args[2]->ToObject();
+      Local<Value> fmt = options->Get(String::NewSymbol("format"));
+      Local<Value> lev = options->Get(String::NewSymbol("level"));
+      Local<Value> thr = options->Get(String::NewSymbol("threads"));
 
-    while (data_len > 0) {
-      if (data_len > CHUNK) {
-        strm.avail_in = CHUNK;
-      } else {
-        strm.avail_in = data_len;
+      if ((fmt->IsUndefined() || fmt->IsNull()) == false) {
+        String::AsciiValue f(fmt);
+        job->format = strcmp(*f, "gzip") == 0 ? GZIP : strcmp(*f, "bzip") == 0 ? BZIP : DETECT;
+        THROW_IF_NOT (job->format != DETECT, "invalid format, expected 'gzip' or 'bzip'");
+      }
+      if ((lev->IsUndefined() || lev->IsNull()) == false) {
+        job->level = lev->Int32Value();
+        level_set = true;
+      }
+      if ((thr->IsUndefined() || thr->IsNull()) == false) {
+        job->threads = thr->Int32Value();
+        THROW_IF_NOT_A (1 <= job->threads && job->threads <= 256, "invalid threads: %d", job->threads);
       }
-
-      strm.next_in = (char*)data;
-
-      do {
-        temp = (char *)realloc(*out, CHUNK*i);
-        if (temp == NULL) {
-          return BZ_MEM_ERROR;
-        }
-        *out = temp;
-        strm.avail_out = CHUNK;
-        strm.next_out = (char*)*out + *out_len;
-        ret = BZ2_bzDecompress(&strm);
-        switch (ret) {
-        case BZ_PARAM_ERROR:
-          ret = BZ_DATA_ERROR;     /* and fall through */
-        case BZ_DATA_ERROR:
-        case BZ_DATA_ERROR_MAGIC:
-        case BZ_MEM_ERROR:
-          BZ2_bzDecompressEnd(&strm);
-          return ret;
-        }
-        *out_len += (CHUNK - strm.avail_out);
-        i++;
-      } while (strm.avail_out == 0);
-      data += CHUNK;
-      data_len -= CHUNK;
     }
-    return ret;
+    if (!level_set) {
+      job->level = job->format == BZIP ? 1 : -1;
+    }
+    THROW_IF_NOT_A ((job->format == BZIP ? 1 : -1) <= job->level && job->level <= 9,
+                    "invalid compression level: %d", job->level);
+    #ifndef WITH_GZIP
+    THROW_IF_NOT (job->format != GZIP, "gzip support is not compiled in");
+    #endif
+    #ifndef WITH_BZIP
+    THROW_IF_NOT (job->format != BZIP, "bzip support is not compiled in");
+    #endif
+    job->callback = Persistent<Function>::New(Local<Function>::Cast(args[args.Length()-1]));
+
+    eio_custom(Work, EIO_PRI_DEFAULT, After, job.release());
+    ev_ref(EV_DEFAULT_UC);
+    return scope.Close(Undefined());
   }
 
-  void BunzipEnd() {
-    BZ2_bzDecompressEnd(&strm);
+  static int Work(eio_req* r) {
+    FileJob* job = static_cast<FileJob*>(r->data);
+    try {
+      job->Run();
+    } catch( const std::string & msg ) {
+      job->error = msg;
+    }
+    return 0;
   }
 
- protected:
-
-  static Handle<Value> New(const Arguments& args) {
+  static int After(eio_req* r) {
     HandleScope scope;
+    FileJob* job = static_cast<FileJob*>(r->data);
+    ev_unref(EV_DEFAULT_UC);
 
-    Bunzip *bunzip = new Bunzip();
-    bunzip->Wrap(args.This());
+    Handle<Value> argv[2];
+    if (!job->error.empty()) {
+      argv[0] = Exception::Error (String::New(job->error.c_str()));
+      argv[1] = Undefined();
+    } else {
+      Local<Object> sizes = Object::New();
+      sizes->Set(String::NewSymbol("in"), Number::New((double)job->in_size));
+      sizes->Set(String::NewSymbol("out"), Number::New((double)job->out_size));
+      argv[0] = Null();
+      argv[1] = sizes;
+    }
 
-    return args.This();
+    TryCatch try_catch;
+    job->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+    job->callback.Dispose();
+    delete job;
+    return 0;
   }
 
-  /* options: encoding:   string  [null], if set output strings, else buffers
-   *          small:      boolean [false], bunzip in small mode
-   */
-  static Handle<Value> BunzipInit(const Arguments& args) {
-    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
-
-    HandleScope scope;
-
-    int small = 0;
-    bunzip->use_buffers = true;
-    if (args.Length() > 0) {
-      THROW_IF_NOT (args[0]->IsObject(), "init argument must be an object");
-      Local<Object> options = args[0]->ToObject();
-      Local<Value> enc = options->Get(String::NewSymbol("encoding"));
-      Local<Value> sm = options->Get(String::NewSymbol("small"));
+  struct Fd {
+    Fd(int fd) : fd(fd) { }
+    ~Fd() {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    int fd;
+  };
+
+  struct Map {
+    Map() : p(MAP_FAILED), len(0) { }
+    ~Map() {
+      if (p != MAP_FAILED) {
+        munmap(p, len);
+      }
+    }
+    void* p;
+    size_t len;
+  };
+
+  /* runs on a worker thread */
+  void Run() {
+    Fd in(open(src.c_str(), O_RDONLY));
+    THROWS_IF_NOT_A (in.fd >= 0, "open %.80s: %s", src.c_str(), strerror(errno));
+    struct stat st;
+    THROWS_IF_NOT_A (fstat(in.fd, &st) == 0, "stat %.80s: %s", src.c_str(), strerror(errno));
+    in_size = st.st_size;
+
+    Map map;
+    const char* data = NULL;
+    if (in_size > 0) {
+      map.len = in_size;
+      map.p = mmap(NULL, map.len, PROT_READ, MAP_PRIVATE, in.fd, 0);
+      THROWS_IF_NOT_A (map.p != MAP_FAILED, "mmap %.80s: %s", src.c_str(), strerror(errno));
+      data = (const char*)map.p;
+      madvise(map.p, map.len, MADV_SEQUENTIAL);
+    }
+    #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+
+    if (format == DETECT) {
+      const unsigned char* m = (const unsigned char*)data;
+      if (in_size >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+        format = GZIP;
+      } else if (in_size >= 3 && m[0] == 'B' && m[1] == 'Z' && m[2] == 'h') {
+        format = BZIP;
+      }
+      THROWS_IF_NOT_A (format != DETECT, "%.80s: neither gzip nor bzip2", src.c_str());
+    }
 
-      if ((enc->IsUndefined() || enc->IsNull()) == false) {
-        bunzip->encoding = ParseEncoding(enc);
-        bunzip->use_buffers = false;
+    Fd out(open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    THROWS_IF_NOT_A (out.fd >= 0, "open %.80s: %s", dst.c_str(), strerror(errno));
+    FileWriter writer(out.fd);
+
+    Init();
+    // inflating takes smaller steps, a step's output is held in memory at once
+    const uint64_t step = compress ? 1024*1024 : 256*1024;
+    const uint64_t drop = 8*1024*1024;
+    uint64_t dropped = 0;
+    uint64_t member = 0;
+    bool ended = false;
+    int n;
+    for (uint64_t pos = 0; pos < in_size; pos += n) {
+      n = in_size - pos < step ? in_size - pos : step;
+      char* o = NULL;
+      int ol = 0;
+      int ret = Step(data + pos, n, &o, &ol);
+      if (ol > 0 && ret >= 0) {
+        try {
+          writer.Write(o, ol);
+        } catch (...) {
+          free(o);
+          throw;
+        }
       }
-      if ((sm->IsUndefined() || sm->IsNull()) == false) {
-        small = sm->BooleanValue() ? 1 : 0;
+      free(o);
+      THROWS_IF_NOT_A (ret >= 0, "%s: error(%d)", Name(), ret);
+      ended = ended || Ended(ret);
+      if (ended && !compress && Serial()) {
+        // members and streams may follow each other, as gunzipSync and
+        // bunzipSync take them, each gets a decoder of its own
+        uint64_t next = member + Consumed();
+        if (next < in_size && !Follows((const unsigned char*)data + next, in_size - next)) {
+          THROWS_IF_NOT_A (format == GZIP && AllZero(data + next, in_size - next),
+                           "%s: trailing garbage after the end of the stream", Name());
+          next = in_size;
+        }
+        if (next < in_size) {
+          Restart();
+          member = next;
+          ended = false;
+        }
+        n = next - pos;
+      }
+      // the pages behind are done with, keep the resident set flat
+      if (pos + n - dropped >= drop) {
+        uint64_t upto = (pos + n) & ~(uint64_t)4095;
+        madvise((char*)map.p + dropped, upto - dropped, MADV_DONTNEED);
+        dropped = upto;
       }
     }
-    int r = bunzip->BunzipInit(small);
-    return scope.Close(Integer::New(r));
+    char* o = NULL;
+    int ol = 0;
+    int ret = Finish(&o, &ol);
+    if (ol > 0 && ret >= 0) {
+      writer.Write(o, ol);
+    }
+    free(o);
+    THROWS_IF_NOT_A (ret >= 0, "%s end: error(%d)", Name(), ret);
+    THROWS_IF_NOT_A (compress || ended, "%s: truncated input", Name());
+    writer.Flush();
+    out_size = writer.written;
   }
 
-  static Handle<Value> BunzipInflate(const Arguments& args) {
-    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
-
-    HandleScope scope;
-    std::auto_ptr<BufferWrapper> bw;
+  const char* Name() {
+    return format == GZIP ? (compress ? "gzip" : "gunzip") : (compress ? "bzip" : "bunzip");
+  }
 
-    char* buf;
-    ssize_t len;
-    // inflate a buffer or a binary string?
-    if (Buffer::HasInstance(args[0])) {
-       // buffer
-       Local<Object> buffer = args[0]->ToObject();
-       len = BufferLength(buffer);
-       buf = BufferData(buffer);
-    } else {
-      // string, default encoding is binary. this is much worse than using a buffer
-      enum encoding enc = args.Length() == 1 ? BINARY : ParseEncoding(args[1], BINARY);
-      len = DecodeBytes(args[0], enc);
-      THROW_IF_NOT_A (len >= 0, "invalid DecodeBytes result: %zd", len);
+  /* the decoder stops at the end of a member or stream, the threaded bunzip
+   * carries on through them by itself
+   */
+  bool Serial() {
+    #ifdef  WITH_BZIP
+    if (bunzip) {
+      return bunzip->parallel == NULL;
+    }
+    #endif//WITH_BZIP
+    return true;
+  }
 
-      buf = new char[len];
-      bw = std::auto_ptr<BufferWrapper>(new BufferWrapper( buf ));
-      ssize_t written = DecodeWrite(buf, len, args[0], enc);
-      THROW_IF_NOT_A(written == len, "BunzipInflate.DecodeWrite: %zd != %zd", written, len);
+  /* input the ended member or stream took */
+  uint64_t Consumed() {
+    #ifdef  WITH_GZIP
+    if (gunzip) {
+      return gunzip->strm->total_in;
     }
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    if (bunzip) {
+      return BzTotal(bunzip->strm.total_in_lo32, bunzip->strm.total_in_hi32);
+    }
+    #endif//WITH_BZIP
+    return 0;
+  }
 
-    char* out;
-    int r, out_size;
-    try {
-      r = bunzip->BunzipInflate(buf, len, &out, &out_size);
-    } catch( const std::string & msg ) {
-      return ThrowException(Exception::Error (String::New(msg.c_str())));
+  /* another member or stream of the same format starts at p */
+  bool Follows(const unsigned char* p, uint64_t len) {
+    if (format == GZIP) {
+      return len >= 2 && p[0] == 0x1f && p[1] == 0x8b;
     }
-    THROW_IF_NOT_A (r >= 0, "bunzip inflate: error(%d)", r);
-    THROW_IF_NOT_A (out_size >= 0, "bunzip inflate: negative output size: %d", out_size);
+    return len >= 3 && p[0] == 'B' && p[1] == 'Z' && p[2] == 'h';
+  }
 
-    if (bunzip->use_buffers) {
-      // output decompressed data in a buffer
-      Buffer* b = Buffer::New(out_size);
-      if (out_size != 0) {
-        memcpy(BufferData(b), out, out_size);
-        free(out);
+  /* gzip pads with zeros at times, that is not garbage */
+  static bool AllZero(const char* p, uint64_t len) {
+    for (uint64_t i = 0; i < len; i++) {
+      if (p[i] != 0) {
+        return false;
       }
-      return scope.Close(b->handle_);
-    } else if (out_size == 0) {
-      return scope.Close(String::Empty());
-    } else {
-      // output decompressed data in an encoded string
-      Local<Value> outString = Encode(out, out_size, bunzip->encoding);
-      free(out);
-      return scope.Close(outString);
     }
+    return true;
   }
 
-  static Handle<Value> BunzipEnd(const Arguments& args) {
-    Bunzip *bunzip = ObjectWrap::Unwrap<Bunzip>(args.This());
+  /* a fresh decoder for the next member or stream */
+  void Restart() {
+    char* o = NULL;
+    int ol = 0;
+    Finish(&o, &ol);
+    free(o);
+    #ifdef  WITH_GZIP
+    delete gunzip;
+    gunzip = NULL;
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    delete bunzip;
+    bunzip = NULL;
+    #endif//WITH_BZIP
+    Init();
+  }
 
-    HandleScope scope;
-    try {
-      bunzip->BunzipEnd();
-    } catch( const std::string & msg ) {
-      return ThrowException(Exception::Error (String::New(msg.c_str())));
+  void Init() {
+    int ret = -1;
+    #ifdef  WITH_GZIP
+    if (format == GZIP && compress) {
+      gzip = new Gzip();
+      ret = gzip->GzipInit(level, threads, 128*1024, 16+MAX_WBITS);
+    } else if (format == GZIP) {
+      gunzip = new Gunzip();
+      ret = gunzip->GunzipInit(0, 16+MAX_WBITS);
     }
-    return scope.Close(Undefined());
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    if (format == BZIP && compress) {
+      bzip = new Bzip();
+      ret = bzip->BzipInit(level, 30, threads);
+    } else if (format == BZIP) {
+      bunzip = new Bunzip();
+      ret = bunzip->BunzipInit(0, threads);
+    }
+    #endif//WITH_BZIP
+    THROWS_IF_NOT_A (ret == 0, "%s init: error(%d)", Name(), ret);
   }
 
-  Bunzip() : EventEmitter(), use_buffers(true), encoding(BINARY) {
+  int Step(const char* data, int n, char** out, int* out_len) {
+    #ifdef  WITH_GZIP
+    if (gzip) {
+      return gzip->GzipDeflate((char*)data, n, out, out_len);
+    } else if (gunzip) {
+      return gunzip->GunzipInflate(data, n, out, out_len);
+    }
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    if (bzip) {
+      return bzip->BzipDeflate((char*)data, n, out, out_len);
+    } else if (bunzip) {
+      return bunzip->BunzipInflate(data, n, out, out_len);
+    }
+    #endif//WITH_BZIP
+    return -1;
   }
 
-  ~Bunzip() {
+  /* the input held the end of the compressed stream */
+  bool Ended(int ret) {
+    #ifdef  WITH_GZIP
+    if (format == GZIP) {
+      return ret == Z_STREAM_END;
+    }
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    if (format == BZIP) {
+      return ret == BZ_STREAM_END;
+    }
+    #endif//WITH_BZIP
+    return false;
   }
 
- private:
+  int Finish(char** out, int* out_len) {
+    #ifdef  WITH_GZIP
+    if (gzip) {
+      return gzip->GzipEnd(out, out_len);
+    } else if (gunzip) {
+      gunzip->GunzipEnd();
+      return 0;
+    }
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    if (bzip) {
+      return bzip->BzipEnd(out, out_len);
+    } else if (bunzip) {
+      bunzip->BunzipEnd();
+      return 0;
+    }
+    #endif//WITH_BZIP
+    return -1;
+  }
 
-  bz_stream strm;
-  bool use_buffers;
-  enum encoding encoding;
+  bool compress;
+  Format format;
+  int level;
+  int threads;
+  std::string src;
+  std::string dst;
+  uint64_t in_size;
+  uint64_t out_size;
+  std::string error;
+  Persistent<Function> callback;
+  #ifdef  WITH_GZIP
+  Gzip* gzip;
+  Gunzip* gunzip;
+  #endif//WITH_GZIP
+  #ifdef  WITH_BZIP
+  Bzip* bzip;
+  Bunzip* bunzip;
+  #endif//WITH_BZIP
 };
-#endif//WITH_BZIP
 
-extern "C" void init(Handle<Object> target) {
+/* setPoolSize(codec, size) how many idle contexts to keep per codec and
+ * level ('gzip', 'gunzip', 'bzip' or 'bunzip'), returns the previous size
+ */
+static Handle<Value> SetPoolSize(const Arguments& args) {
+  HandleScope scope;
+
+  THROW_IF_NOT (args.Length() >= 2 && args[0]->IsString() && args[1]->IsNumber(),
+                "setPoolSize arguments must be a codec name and a size");
+  String::AsciiValue codec(args[0]);
+  int size = args[1]->Int32Value();
+  THROW_IF_NOT_A (size >= 0, "invalid pool size: %d", size);
+
+  int prev = -1;
+  #ifdef  WITH_GZIP
+  if (strcmp(*codec, "gzip") == 0) {
+    prev = ZStreamPool::SetLimit(true, size);
+  } else if (strcmp(*codec, "gunzip") == 0) {
+    prev = ZStreamPool::SetLimit(false, size);
+  }
+  #endif//WITH_GZIP
+  #ifdef  WITH_BZIP
+  if (strcmp(*codec, "bzip") == 0) {
+    prev = BzMemory::SetLimit(true, size);
+  } else if (strcmp(*codec, "bunzip") == 0) {
+    prev = BzMemory::SetLimit(false, size);
+  }
+  #endif//WITH_BZIP
+  THROW_IF_NOT (prev >= 0, "setPoolSize: unknown codec");
+  return scope.Close(Integer::New(prev));
+}
+
+#ifdef  WITH_GZIP
+/* inflates data into a scratch block to check that it is a single gzip member
+ * and nothing else, the uncompressed size in *size if so
+ */
+static bool GzipVerifySize(const char* data, int data_len, double* size) {
+  int ret;
+  z_stream* strm = ZStreamPool::Inflate(16+MAX_WBITS, &ret);
+  if (strm == NULL) {
+    return false;
+  }
+  char scratch[16384];
+  strm->next_in = (Bytef*)data;
+  strm->avail_in = data_len;
+  do {
+    strm->next_out = (Bytef*)scratch;
+    strm->avail_out = sizeof(scratch);
+    ret = inflate(strm, Z_NO_FLUSH);
+  } while (ret == Z_OK);
+  // a second member or trailing bytes leave input over
+  bool single = ret == Z_STREAM_END && strm->avail_in == 0;
+  *size = strm->total_out;
+  if (ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+    (void)inflateEnd(strm);
+  }
+  ZStreamPool::ReleaseInflate(strm);
+  return single;
+}
+#endif//WITH_GZIP
+
+/* gzbz2.peekUncompressedSize(buffer, [verify]), {size, exact, format} of a
+ * whole gzip or bzip2 buffer, null if it is neither. gzip takes the ISIZE of
+ * the trailer, which says nothing of earlier members; with verify the buffer
+ * is inflated (without keeping the output) and the size is exact once it
+ * turns out a single member. bzip2 is an estimate from the number of blocks.
+ */
+static Handle<Value> PeekUncompressedSize(const Arguments& args) {
   HandleScope scope;
+
+  THROW_IF_NOT (args.Length() >= 1 && Buffer::HasInstance(args[0]), "peekUncompressedSize argument must be a Buffer");
+  Local<Object> buffer = args[0]->ToObject();
+  THROW_IF_NOT (BufferLength(buffer) <= INT_MAX, "peekUncompressedSize: buffer too large");
+  const char* data = BufferData(buffer);
+  int len = BufferLength(buffer);
+
+  double size = 0;
+  bool exact = false;
+  const char* format = NULL;
+  #ifdef  WITH_GZIP
+  bool verify = args.Length() > 1 && args[1]->BooleanValue();
+  uint32_t isize;
+  if (GzipTrailerSize(data, len, &isize)) {
+    size = isize;
+    format = "gzip";
+    if (verify) {
+      double verified;
+      exact = GzipVerifySize(data, len, &verified);
+      size = exact ? verified : size;
+    }
+  }
+  #endif//WITH_GZIP
   #ifdef  WITH_BZIP
+  int64_t est = format ? -1 : BzipSizeEstimate(data, len);
+  if (est >= 0) {
+    size = (double)est;
+    format = "bzip2";
+  }
+  #endif//WITH_BZIP
+  if (format == NULL) {
+    return scope.Close(Null());
+  }
+  Local<Object> o = Object::New();
+  o->Set(String::NewSymbol("size"), Number::New(size));
+  o->Set(String::NewSymbol("exact"), Boolean::New(exact));
+  o->Set(String::NewSymbol("format"), String::New(format));
+  return scope.Close(o);
+}
+
+bool MemoryBudget::Admit(int64_t bytes) {
+  pthread_mutex_lock(&lock);
+  if (!Fits(bytes)) {
+    // idle streams and blocks are only a cache, they go before a new stream is refused
+    #ifdef  WITH_GZIP
+    ZStreamPool::SetLimit(true, ZStreamPool::SetLimit(true, 0));
+    ZStreamPool::SetLimit(false, ZStreamPool::SetLimit(false, 0));
+    ZMemory::Trim();
+    #endif//WITH_GZIP
+    #ifdef  WITH_BZIP
+    BzMemory::SetLimit(true, BzMemory::SetLimit(true, 0));
+    BzMemory::SetLimit(false, BzMemory::SetLimit(false, 0));
+    #endif//WITH_BZIP
+  }
+  bool fits = Fits(bytes);
+  if (fits) {
+    STAT_ADD(reserved, bytes);
+  }
+  pthread_mutex_unlock(&lock);
+  return fits;
+}
+
+extern "C" void init(Handle<Object> target) {
+  HandleScope scope;
+  #ifdef  WITH_GZIP
   Gzip::Initialize(target);
   Gunzip::Initialize(target);
   #endif//WITH_GZIP
@@ -928,4 +6926,25 @@ extern "C" void init(Handle<Object> target) {
   Bzip::Initialize(target);
   Bunzip::Initialize(target);
   #endif//WITH_BZIP
+
+  NODE_SET_METHOD(target, "setPoolSize", SetPoolSize);
+  NODE_SET_METHOD(target, "setMemoryBudget", MemoryBudget::SetBudget);
+  NODE_SET_METHOD(target, "peekUncompressedSize", PeekUncompressedSize);
+  NODE_SET_METHOD(target, "getMemoryBudget", MemoryBudget::GetBudget);
+  NODE_SET_METHOD(target, "compressFile", FileJob::CompressFile);
+  NODE_SET_METHOD(target, "decompressFile", FileJob::DecompressFile);
+  NODE_SET_METHOD(target, "getStats", Stats::GetStats);
+  NODE_SET_METHOD(target, "setExecutorThreads", Executor::SetThreads);
+  NODE_SET_METHOD(target, "getExecutorStats", Executor::GetStats);
+  #ifdef  WITH_GZIP
+  NODE_SET_METHOD(target, "gzipBatch", ZBatch::GzipBatch);
+  NODE_SET_METHOD(target, "gunzipBatch", ZBatch::GunzipBatch);
+  NODE_SET_METHOD(target, "trainDictionary", DictTrainer::Train);
+  NODE_SET_METHOD(target, "gzipSync", ZSync::GzipSync);
+  NODE_SET_METHOD(target, "gunzipSync", ZSync::GunzipSync);
+  #endif//WITH_GZIP
+  #ifdef  WITH_BZIP
+  NODE_SET_METHOD(target, "bzipSync", BzSync::BzipSync);
+  NODE_SET_METHOD(target, "bunzipSync", BzSync::BunzipSync);
+  #endif//WITH_BZIP
 }
@@ -0,0 +1,129 @@
+var fs = require('fs'),
+    gzbz2 = require('gzbz2');
+
+var READ_SIZE = 65536;
+
+/**
+ * copy a list of buffers into one
+ */
+var concat = function(list, length) {
+    var out = new Buffer(length), pos = 0;
+    for (var i = 0; i < list.length; i++) {
+        list[i].copy(out, pos, 0, list[i].length);
+        pos += list[i].length;
+    }
+    return out;
+};
+
+/**
+ * random access reads from a gzip file, inflation starts at the access
+ * point of the index that is closest to the read offset
+ *
+ * @param path      string pathname of the gzip file
+ * @param index     Buffer from buildIndex() or Gunzip.getIndex()
+ */
+var GunzipSeek = function(path, index) {
+    this.fd = fs.openSync(path, 'r');
+    this.index = index;
+    this.pos = 0;       // uncompressed offset of the next read
+    this.gz = null;
+    this.inpos = 0;     // compressed offset of the next input
+    this.rest = null;   // inflated but not yet read
+};
+
+/**
+ * move to an uncompressed offset, reading on from where the last read
+ * stopped does not inflate anything twice
+ */
+GunzipSeek.prototype.seek = function(offset) {
+    if (offset != this.pos) {
+        this.pos = offset;
+        if (this.gz) {
+            this.gz.end();
+            this.gz = null;
+        }
+        this.rest = null;
+    }
+};
+
+/**
+ * @return  a Buffer of up to len bytes from the current offset, shorter at the end of the file
+ */
+GunzipSeek.prototype.read = function(len) {
+    if (!this.gz) {
+        this.gz = new gzbz2.Gunzip();
+        this.gz.init();
+        this.gz.setIndex(this.index);
+        this.inpos = this.gz.seek(this.pos);
+    }
+    var list = [], got = 0;
+    if (this.rest) {
+        list.push(this.rest);
+        got += this.rest.length;
+        this.rest = null;
+    }
+    var buf = new Buffer(READ_SIZE);
+    while (got < len) {
+        var n = fs.readSync(this.fd, buf, 0, READ_SIZE, this.inpos);
+        if (n == 0) {
+            break;
+        }
+        this.inpos += n;
+        var inflated = this.gz.inflate(buf.slice(0, n));
+        if (inflated.length > 0) {
+            list.push(inflated);
+            got += inflated.length;
+        }
+    }
+    var all = concat(list, got);
+    if (got > len) {
+        this.rest = all.slice(len, got);
+        all = all.slice(0, len);
+    }
+    this.pos += all.length;
+    return all;
+};
+
+GunzipSeek.prototype.close = function() {
+    if (this.gz) {
+        this.gz.end();
+        this.gz = null;
+    }
+    fs.closeSync(this.fd);
+};
+exports.GunzipSeek = GunzipSeek;
+
+/**
+ * inflate a whole gzip file once to build its index
+ *
+ * @param path      string pathname of the gzip file
+ * @param span      uncompressed bytes between access points, default 1M
+ *
+ * @return  the index as a Buffer, suitable for writing to a file
+ */
+exports.buildIndex = function(path, span) {
+    var fd = fs.openSync(path, 'r');
+    var gz = new gzbz2.Gunzip();
+    gz.init({index: span || 1048576});
+    var buf = new Buffer(READ_SIZE), n;
+    while ((n = fs.readSync(fd, buf, 0, READ_SIZE, null)) > 0) {
+        gz.inflate(buf.slice(0, n));
+    }
+    fs.closeSync(fd);
+    var index = gz.getIndex();
+    gz.end();
+    return index;
+};
+
+/**
+ * @param path      string pathname of the gzip file
+ * @param index     Buffer index, or string pathname of a saved index
+ *
+ * @return  a GunzipSeek object
+ */
+exports.open = function(path, index) {
+    if (typeof index == 'string') {
+        index = fs.readFileSync(index);
+    }
+    return new GunzipSeek(path, index);
+};
@@ -0,0 +1,42 @@
+var fs = require('fs'),
+    sys = require('sys'),
+    CodecStream = require('./codecstream').CodecStream;
+
+/**
+ * a writable gzip stream: write or pipe data in, compressed data comes out
+ * as 'data' events (or pipe it on). compression runs on the thread pool and
+ * write() returns false while the stream is backed up, see CodecStream.
+ *
+ * @param options   gzip init options (level, threads, dictionary, ...) and CodecStream
+ *                  options (highWaterMark, lowWaterMark, pieceSize)
+ */
+var GzipStream = function(options) {
+    CodecStream.call(this, 'gzip', options);
+};
+sys.inherits(GzipStream, CodecStream);
+exports.GzipStream = GzipStream;
+
+/**
+ * gzip into a writable stream or a file:
+ *
+ * ---------------------------------------------------------------
+ * @param stream    WriteStream, if null/undefined, use stdout
+ * ---------------------------------------------------------------
+ * @param path      string pathname
+ * @param options   gzip stream options, plus the options of fs.createWriteStream()
+ *
+ * @return  a GzipStream object to write to, the underlying WriteStream is available as attribute named 'stream'
+ */
+exports.wrap = function() {
+    // [stream] | [path, [options,]]
+    var stream = arguments[0], options = arguments[1] || {};
+    if( stream == null ) {
+        stream = process.stdout;
+    } else if( typeof stream == 'string' ) {
+        stream = fs.createWriteStream(stream, {flags: options.flags, mode: options.mode});
+    }
+    var out = new GzipStream(options);
+    out.stream = stream;
+    out.pipe(stream);
+    return out;
+};
@@ -40,3 +40,399 @@ gunzip.end(); // no return value
 if (data.length != inflated.length) {
     sys.puts('error! input/output string lengths do not match');
 }
+
+// Round trips of the newer paths, one section per feature. stock gzip and
+// bzip2 are used as the reference decoders where they are installed.
+var exec = require("child_process").exec;
+
+var same = function(a, b) {
+    if (a.length != b.length) {
+        return false;
+    }
+    for (var i = 0; i < a.length; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+};
+
+var concat = function(list) {
+    var length = 0, pos = 0;
+    for (var i = 0; i < list.length; i++) {
+        length += list[i].length;
+    }
+    var out = new Buffer(length);
+    for (var i = 0; i < list.length; i++) {
+        list[i].copy(out, pos, 0, list[i].length);
+        pos += list[i].length;
+    }
+    return out;
+};
+
+var check = function(ok, what) {
+    sys.puts((ok ? 'ok: ' : 'error! ') + what);
+};
+
+// true if fn throws
+var throws = function(fn) {
+    try {
+        fn();
+    } catch (e) {
+        return true;
+    }
+    return false;
+};
+
+// about 3M of text with some variety, several deflate blocks and bzip2 blocks
+var lines = [], seed = 1;
+for (var i = 0; i < 60000; i++) {
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    lines.push(i + ' ' + seed.toString(36) + ' the quick brown fox ' + (seed % 977) + '\n');
+}
+var plain = new Buffer(lines.join(''));
+
+var deflateAll = function(codec, options, input) {
+    codec.init(options);
+    return concat([codec.deflate(input), codec.end()]);
+};
+
+// inflate in pieces, as a stream would be fed
+var inflatePieces = function(codec, input, piece) {
+    var out = [];
+    for (var pos = 0; pos < input.length; pos += piece) {
+        out.push(codec.inflate(input.slice(pos, Math.min(pos + piece, input.length))));
+    }
+    return concat(out);
+};
+
+// decoded by the command line tool, callback(output, or null if it failed),
+// not called at all when the tool is not installed
+var stock = function(cmd, input, name, callback) {
+    fs.writeFileSync(name, input);
+    exec(cmd + ' -dc ' + name + ' > ' + name + '.out', function(err) {
+        if (err && err.code == 127) {
+            sys.puts('skipped, no ' + cmd);
+        } else {
+            callback(err ? null : fs.readFileSync(name + '.out'));
+        }
+        fs.unlinkSync(name);
+        fs.unlinkSync(name + '.out');
+    });
+};
+
+var gunzip, bunzip, partial;
+
+// parallel gzip
+var pgz = deflateAll(new gzbz2.Gzip, {threads: 4, blockSize: 65536}, plain);
+var pgz2 = deflateAll(new gzbz2.Gzip, {threads: 3, level: 1}, plain.slice(1000, 200000));
+var bothPlain = concat([plain, plain.slice(1000, 200000)]);
+
+gunzip = new gzbz2.Gunzip;
+gunzip.init();
+check(same(inflatePieces(gunzip, pgz, 65536), plain), 'parallel gzip through Gunzip');
+gunzip.end();
+
+// Gunzip stops after the first member, gunzipSync carries on through all of them
+gunzip = new gzbz2.Gunzip;
+gunzip.init();
+check(same(gunzip.inflate(concat([pgz, pgz2])), plain), 'Gunzip takes the first member of two');
+gunzip.end();
+check(same(gzbz2.gunzipSync(concat([pgz, pgz2])), bothPlain), 'multi-member parallel gzip through gunzipSync');
+
+var truncated = pgz.slice(0, pgz.length >> 1);
+gunzip = new gzbz2.Gunzip;
+gunzip.init();
+partial = gunzip.inflate(truncated);
+check(partial.length < plain.length && same(partial, plain.slice(0, partial.length)),
+      'truncated parallel gzip gives a prefix through Gunzip');
+
+// flushed every 5000 bytes the blocks are short, the 32K history still rolls on
+var flushed = function(threads) {
+    var gzip = new gzbz2.Gzip, out = [];
+    gzip.init({threads: threads});
+    for (var pos = 0; pos < 500000; pos += 5000) {
+        out.push(gzip.deflate(plain.slice(pos, pos + 5000)));
+        out.push(gzip.flush());
+    }
+    out.push(gzip.end());
+    return concat(out);
+};
+var pflushed = flushed(4), sflushed = flushed(1);
+check(same(gzbz2.gunzipSync(pflushed), plain.slice(0, 500000)) && pflushed.length <= sflushed.length * 1.01,
+      'flushed parallel gzip is as small as serial (' + pflushed.length + ' / ' + sflushed.length + ')');
+
+stock('gzip', concat([pgz, pgz2]), testfile + '.multi.gz', function(out) {
+    check(out != null && same(out, bothPlain), 'multi-member parallel gzip through gzip -d');
+});
+stock('gzip', truncated, testfile + '.trunc.gz', function(out) {
+    check(out == null, 'truncated parallel gzip fails in gzip -d');
+});
+
+// parallel bzip2
+var pbz = deflateAll(new gzbz2.Bzip, {threads: 4, level: 1}, plain);
+var pbz2 = deflateAll(new gzbz2.Bzip, {threads: 2, level: 1}, plain.slice(1000, 200000));
+
+bunzip = new gzbz2.Bunzip;
+bunzip.init();
+check(same(inflatePieces(bunzip, pbz, 100000), plain), 'parallel bzip2 through Bunzip');
+bunzip.end();
+
+// the multi-threaded decoder splits at block markers, in big and small pieces
+bunzip = new gzbz2.Bunzip;
+bunzip.init({threads: 4});
+check(same(inflatePieces(bunzip, pbz, 100000), plain), 'parallel bzip2 through Bunzip threads 4');
+bunzip.end();
+
+bunzip = new gzbz2.Bunzip;
+bunzip.init({threads: 1, checkpoint: true});
+check(same(inflatePieces(bunzip, pbz, 7001), plain), 'parallel bzip2 through block-wise Bunzip in small pieces');
+bunzip.end();
+
+bunzip = new gzbz2.Bunzip;
+bunzip.init({threads: 4});
+check(same(bunzip.inflate(concat([pbz, pbz2])), bothPlain), 'concatenated parallel bzip2 through Bunzip threads 4');
+bunzip.end();
+
+bunzip = new gzbz2.Bunzip;
+bunzip.init({threads: 4});
+partial = bunzip.inflate(pbz.slice(0, pbz.length >> 1));
+check(partial.length < plain.length && same(partial, plain.slice(0, partial.length)),
+      'truncated parallel bzip2 gives a prefix through Bunzip');
+
+stock('bzip2', concat([pbz, pbz2]), testfile + '.multi.bz2', function(out) {
+    check(out != null && same(out, bothPlain), 'concatenated parallel bzip2 through bzip2 -d');
+});
+stock('bzip2', pbz.slice(0, pbz.length >> 1), testfile + '.trunc.bz2', function(out) {
+    check(out == null, 'truncated parallel bzip2 fails in bzip2 -d');
+});
+
+// seek to every access point and compare with the full decode
+var indexed = new gzbz2.Gunzip;
+indexed.init({index: 65536});
+var full = indexed.inflate(pgz);
+indexed.end();
+var index = indexed.getIndex();
+var count = index[12] | (index[13] << 8) | (index[14] << 16) | (index[15] << 24);
+var seekBad = 0;
+for (var i = 0, pos = 16; i < count; i++) {
+    var out = 0;
+    for (var b = 5; b >= 0; b--) {
+        out = out * 256 + index[pos + b];
+    }
+    var clen = index[pos + 21] | (index[pos + 22] << 8) | (index[pos + 23] << 16) | (index[pos + 24] << 24);
+    pos += 25 + clen;
+    var seeker = new gzbz2.Gunzip;
+    seeker.init();
+    seeker.setIndex(index);
+    var from = seeker.seek(out);
+    if (!same(seeker.inflate(pgz.slice(from)), full.slice(out))) {
+        seekBad++;
+    }
+    seeker.end();
+}
+check(count > 1 && seekBad == 0, 'seek to each of ' + count + ' access points matches the full decode');
+
+// an index is input like any other: a first point past offset 0 is refused
+var badIndex = new Buffer(index.length);
+index.copy(badIndex, 0, 0, index.length);
+badIndex[16] = 5;
+seeker = new gzbz2.Gunzip;
+seeker.init();
+check(throws(function() { seeker.setIndex(badIndex); }), 'setIndex refuses a first access point past offset 0');
+seeker.end();
+
+// batches: each item on its own, members that follow each other all come out
+var items = [plain.slice(0, 100000), new Buffer(0), plain.slice(5000, 90000)];
+var zipped = gzbz2.gzipBatch(items, {threads: 2});
+var unzipped = gzbz2.gunzipBatch(zipped, {threads: 2});
+check(unzipped.length == 3 && same(unzipped[0], items[0]) && unzipped[1].length == 0 && same(unzipped[2], items[2]),
+      'gzipBatch then gunzipBatch');
+unzipped = gzbz2.gunzipBatch([concat([zipped[0], zipped[2]])]);
+check(same(unzipped[0], concat([items[0], items[2]])), 'gunzipBatch follows a second member');
+check(throws(function() { gzbz2.gunzipBatch([concat([zipped[0], new Buffer('junk')])]); }),
+      'gunzipBatch throws on trailing garbage');
+
+// preset dictionaries: trained from samples, both sides use the same one
+var samples = [];
+for (var i = 0; i < 200; i++) {
+    samples.push('{"id": ' + i + ', "name": "user' + (i * 7919 % 1000) + '", "status": "active", "tags": ["alpha", "beta"]}');
+}
+var dict = gzbz2.trainDictionary(samples);
+check(dict.length > 0 && dict.length <= 32768, 'trainDictionary gives ' + dict.length + ' bytes');
+var record = new Buffer('{"id": 5000, "name": "user123", "status": "active", "tags": ["alpha", "beta"]}');
+var plainZ = deflateAll(new gzbz2.Gzip, {format: 'zlib'}, record);
+['zlib', 'raw'].forEach(function(format) {
+    var packed = deflateAll(new gzbz2.Gzip, {dictionary: dict, format: format}, record);
+    var inflater = new gzbz2.Gunzip;
+    inflater.init({dictionary: dict, format: format});
+    check(same(inflater.inflate(packed), record) && packed.length < plainZ.length,
+          format + ' with a dictionary: ' + packed.length + ' bytes, ' + plainZ.length + ' without');
+    inflater.end();
+});
+
+// a gzip flush makes everything so far decodable while the stream stays open
+['sync', 'full'].forEach(function(mode) {
+    var gzip = new gzbz2.Gzip, inflater = new gzbz2.Gunzip;
+    gzip.init();
+    inflater.init();
+    var first = concat([gzip.deflate(plain.slice(0, 70000)), gzip.flush(mode)]);
+    var upToFlush = inflater.inflate(first);
+    var second = concat([gzip.deflate(plain.slice(70000, 90000)), gzip.end()]);
+    check(same(upToFlush, plain.slice(0, 70000)) && same(concat([upToFlush, inflater.inflate(second)]), plain.slice(0, 90000)),
+          'gzip ' + mode + ' flush decodes up to the flush');
+    inflater.end();
+});
+
+// a bzip2 flush ends the block, the output so far carries it all but a few bits
+var bzip = new gzbz2.Bzip;
+bzip.init({level: 1});
+var flushedBz = concat([bzip.deflate(plain.slice(0, 70000)), bzip.flush()]);
+var restBz = concat([bzip.deflate(plain.slice(70000, 90000)), bzip.end()]);
+bunzip = new gzbz2.Bunzip;
+bunzip.init();
+check(flushedBz.length > 1000 && same(bunzip.inflate(concat([flushedBz, restBz])), plain.slice(0, 90000)),
+      'bzip2 flush gives ' + flushedBz.length + ' bytes before the end');
+bunzip.end();
+
+// decompressFile runs through every member or stream, not only the first
+[['.two.gz', concat([pgz, pgz2])], ['.two.bz2', concat([pbz, pbz2])]].forEach(function(file) {
+    var name = testfile + file[0];
+    fs.writeFileSync(name, file[1]);
+    gzbz2.decompressFile(name, name + '.out', function(err, sizes) {
+        check(!err && same(fs.readFileSync(name + '.out'), bothPlain),
+              'decompressFile on a' + file[0] + ' of two ' + (err ? err.message : sizes.out + ' bytes'));
+        fs.unlinkSync(name);
+        fs.unlinkSync(name + '.out');
+    });
+});
+
+// the gzipSync trailer crc (pclmul for 64 bytes and up where the cpu has it)
+// against zlib's, every length to 256 from starts around the 16 byte folds
+var crcBad = 0;
+for (var start = 0; start < 20; start++) {
+    for (var len = 0; len <= 256; len++) {
+        var piece = plain.slice(start * 13 + (start & 3), start * 13 + (start & 3) + len);
+        var mine = gzbz2.gzipSync(piece);
+        var zlibs = deflateAll(new gzbz2.Gzip, {level: 6}, piece);
+        if (!same(mine.slice(mine.length - 8), zlibs.slice(zlibs.length - 8))) {
+            crcBad++;
+        }
+        // and zlib checks it again on the way back
+        gunzip = new gzbz2.Gunzip;
+        gunzip.init();
+        try {
+            if (!same(gunzip.inflate(mine), piece)) {
+                crcBad++;
+            }
+        } catch (e) {
+            crcBad++;
+        }
+        gunzip.end();
+    }
+}
+check(crcBad == 0, 'gzipSync crc matches zlib crc32 for lengths 0-256');
+
+// *Into: through a small Buffer of the caller's, from an offset into it
+var into = function(codec, method, input, mode) {
+    var room = new Buffer(100 + 16384), out = [], pos = 0, r;
+    do {
+        r = codec[method](input.slice(pos), room, 100, mode);
+        var piece = new Buffer(r.written);
+        room.copy(piece, 0, 100, 100 + r.written);
+        out.push(piece);
+        pos += r.read;
+    } while (r.more || (!r.end && pos < input.length));
+    return {out: concat(out), end: r.end};
+};
+var intoPlain = plain.slice(0, 300000);
+[[gzbz2.Gzip, gzbz2.Gunzip, gzbz2.gunzipSync, 'gzip'], [gzbz2.Bzip, gzbz2.Bunzip, gzbz2.bunzipSync, 'bzip2']].forEach(function(c) {
+    var deflater = new c[0], inflater = new c[1];
+    deflater.init();
+    var body = into(deflater, 'deflateInto', intoPlain, null);
+    var tail = into(deflater, 'deflateInto', new Buffer(0), 'finish');
+    var packed = concat([body.out, tail.out]);
+    inflater.init();
+    var back = into(inflater, 'inflateInto', packed);
+    inflater.end();
+    check(tail.end && back.end && same(back.out, intoPlain) && same(c[2](packed), intoPlain),
+          c[3] + ' deflateInto then inflateInto, ' + packed.length + ' bytes');
+});
+
+// pull mode: a bomb-like input comes out at most maxOutput bytes a call
+var zeros = new Buffer(2 * 1024 * 1024);
+zeros.fill(0);
+[[gzbz2.Gunzip, gzbz2.gzipSync(zeros), 'gunzip'], [gzbz2.Bunzip, gzbz2.bzipSync(zeros), 'bunzip']].forEach(function(c) {
+    var puller = new c[0], got = [], largest = 0, piece;
+    puller.init({maxOutput: 65536});
+    piece = puller.inflate(c[1]);
+    var held = puller.pending();
+    check(piece.length <= 65536 && (held.input > 0 || held.more), c[2] + ' maxOutput holds the rest back');
+    while (piece.length > 0) {
+        got.push(piece);
+        largest = Math.max(largest, piece.length);
+        piece = puller.read();
+    }
+    check(largest <= 65536 && !puller.pending().more && same(concat(got), zeros),
+          c[2] + ' read() through ' + got.length + ' pieces');
+    puller.end();
+
+    puller = new c[0];
+    puller.init({maxOutput: 1000});
+    puller.inflate(c[1]);
+    check(throws(function() { puller.end(); }), c[2] + ' end() with input held back throws');
+});
+
+// peekUncompressedSize: the gzip trailer says it, verify makes sure of it
+var oneMember = gzbz2.gzipSync(plain.slice(0, 100000));
+var peek = gzbz2.peekUncompressedSize(oneMember);
+check(peek.format == 'gzip' && peek.size == 100000 && !peek.exact, 'peekUncompressedSize of gzip from the trailer');
+peek = gzbz2.peekUncompressedSize(oneMember, true);
+check(peek.size == 100000 && peek.exact, 'peekUncompressedSize of one gzip member, verified');
+peek = gzbz2.peekUncompressedSize(concat([pgz, pgz2]), true);
+check(!peek.exact, 'peekUncompressedSize of two gzip members is not exact');
+peek = gzbz2.peekUncompressedSize(pbz);
+check(peek.format == 'bzip2' && peek.size > 0 && !peek.exact, 'peekUncompressedSize of bzip2 estimates ' + peek.size);
+check(gzbz2.peekUncompressedSize(plain.slice(0, 1000)) === null, 'peekUncompressedSize of neither is null');
+
+// checkpoint halfway, restore in a new object, the output lines up
+var cp = new gzbz2.Gunzip;
+cp.init({checkpoint: 65536});
+cp.inflate(pgz.slice(0, pgz.length >> 1));
+var point = cp.checkpoint();
+cp.end();
+var resumed = new gzbz2.Gunzip;
+resumed.init();
+var at = resumed.restore(point.state);
+var rest = inflatePieces(resumed, pgz.slice(at.input), 65536);
+resumed.end();
+check(point.state != null && same(concat([plain.slice(0, at.output), rest]), plain),
+      'gunzip restore from ' + at.output + ' matches the uninterrupted output');
+
+cp = new gzbz2.Bunzip;
+cp.init({checkpoint: true});
+cp.inflate(pbz.slice(0, pbz.length >> 1));
+point = cp.checkpoint();
+cp.end();
+resumed = new gzbz2.Bunzip;
+resumed.init({checkpoint: true});
+at = resumed.restore(point.state);
+rest = inflatePieces(resumed, pbz.slice(at.input), 100000);
+resumed.end();
+check(same(concat([plain.slice(0, at.output), rest]), plain),
+      'bunzip restore from ' + at.output + ' matches the uninterrupted output');
+
+// a checkpoint is untrusted input too: a window shorter than it claims is refused
+cp = new gzbz2.Gunzip;
+cp.init({checkpoint: 65536});
+cp.inflate(pgz.slice(0, pgz.length >> 1));
+var state = cp.checkpoint().state;
+cp.end();
+var badState = new Buffer(state.length);
+state.copy(badState, 0, 0, state.length);
+badState[29] = 100;
+badState[30] = 0;
+resumed = new gzbz2.Gunzip;
+resumed.init();
+check(throws(function() { resumed.restore(badState); }), 'gunzip restore refuses a window length that does not match');
+resumed.end();